@@ -21,6 +21,22 @@ namespace CommonUtilities
 				(aPosition.y >= myMin.y) && (aPosition.y <= myMax.y) &&
 				(aPosition.z >= myMin.z) && (aPosition.z <= myMax.z);
 		}
+		// Grows the AABB so that it also encloses anAABB3D.
+		void ExpandToInclude(const AABB3D<T>& anAABB3D)
+		{
+			myMin.x = anAABB3D.myMin.x < myMin.x ? anAABB3D.myMin.x : myMin.x;
+			myMin.y = anAABB3D.myMin.y < myMin.y ? anAABB3D.myMin.y : myMin.y;
+			myMin.z = anAABB3D.myMin.z < myMin.z ? anAABB3D.myMin.z : myMin.z;
+			myMax.x = anAABB3D.myMax.x > myMax.x ? anAABB3D.myMax.x : myMax.x;
+			myMax.y = anAABB3D.myMax.y > myMax.y ? anAABB3D.myMax.y : myMax.y;
+			myMax.z = anAABB3D.myMax.z > myMax.z ? anAABB3D.myMax.z : myMax.z;
+		}
+		T GetSurfaceArea() const
+		{
+			Vector3<T> size = myMax - myMin;
+			return T(2) * (size.x * size.y + size.y * size.z + size.z * size.x);
+		}
+		inline const Vector3<T> GetCenter() const { return (myMin + myMax) * T(0.5); }
 		inline const Vector3<T> GetMin() const { return myMin; }
 		inline const Vector3<T> GetMax() const { return myMax; }
 
@@ -28,4 +44,12 @@ namespace CommonUtilities
 		Vector3<T> myMin;
 		Vector3<T> myMax;
 	};
+
+	// Float vectors are SSE registers, min and max pick the same operand as the comparisons above in one instruction each
+	template <>
+	inline void AABB3D<float>::ExpandToInclude(const AABB3D<float>& anAABB3D)
+	{
+		myMin.myValue = _mm_min_ps(anAABB3D.myMin.myValue, myMin.myValue);
+		myMax.myValue = _mm_max_ps(anAABB3D.myMax.myValue, myMax.myValue);
+	}
 }
@@ -4,7 +4,10 @@
 #include "Sphere.hpp"
 #include "Ray.hpp"
 #include "AABB3D.hpp"
+#include "SIMD.hpp"
+#include "RayPacket.hpp"
 #include <cmath>
+#include <limits>
 
 namespace CommonUtilities
 {
@@ -18,6 +21,157 @@ namespace CommonUtilities
 		aOutIntersectionPoint = aRay.GetOrigin() + t * aRay.GetDirection();
 		return true;
 	}
+	// Slab test, if the ray's [minT, maxT] interval overlaps the AABB, true is returned and the overlap is stored in aOutNearT and aOutFarT.
+	// Any ray starting on the inside is considered to intersect the AABB, with aOutNearT being the ray's minT
+	template <typename T>
+	bool IntersectionAABBRay(const AABB3D<T>& aAABB, const Ray<T>& aRay, T& aOutNearT, T& aOutFarT)
+	{
+		const Vector3<T> bounds[2] = { aAABB.GetMin(), aAABB.GetMax() };
+		const auto& ori = aRay.GetOrigin();
+		const auto& inv = aRay.GetInverseDirection();
+
+		T nearT = aRay.GetMinT();
+		T farT = aRay.GetMaxT();
+
+		// NaNs (zero direction with the origin on a slab plane) fail the comparisons and leave the interval untouched
+		T t0 = (bounds[aRay.GetSign(0)].x - ori.x) * inv.x;
+		T t1 = (bounds[1 - aRay.GetSign(0)].x - ori.x) * inv.x;
+		nearT = t0 > nearT ? t0 : nearT;
+		farT = t1 < farT ? t1 : farT;
+
+		t0 = (bounds[aRay.GetSign(1)].y - ori.y) * inv.y;
+		t1 = (bounds[1 - aRay.GetSign(1)].y - ori.y) * inv.y;
+		nearT = t0 > nearT ? t0 : nearT;
+		farT = t1 < farT ? t1 : farT;
+
+		t0 = (bounds[aRay.GetSign(2)].z - ori.z) * inv.z;
+		t1 = (bounds[1 - aRay.GetSign(2)].z - ori.z) * inv.z;
+		nearT = t0 > nearT ? t0 : nearT;
+		farT = t1 < farT ? t1 : farT;
+
+		aOutNearT = nearT;
+		aOutFarT = farT;
+		return nearT <= farT;
+	}
+
+	// If the surface of the AABB is hit within the ray's [minT, maxT] interval, true is returned and the distance is stored in aOutT.
+	// A ray starting on the inside hits the surface where it leaves the AABB
+	template <typename T>
+	bool IntersectionAABBRay(const AABB3D<T>& aAABB, const Ray<T>& aRay, T& aOutT)
+	{
+		const Vector3<T> bounds[2] = { aAABB.GetMin(), aAABB.GetMax() };
+		const auto& ori = aRay.GetOrigin();
+		const auto& inv = aRay.GetInverseDirection();
+
+		T entryT = -std::numeric_limits<T>::infinity();
+		T exitT = std::numeric_limits<T>::infinity();
+
+		T t0 = (bounds[aRay.GetSign(0)].x - ori.x) * inv.x;
+		T t1 = (bounds[1 - aRay.GetSign(0)].x - ori.x) * inv.x;
+		entryT = t0 > entryT ? t0 : entryT;
+		exitT = t1 < exitT ? t1 : exitT;
+
+		t0 = (bounds[aRay.GetSign(1)].y - ori.y) * inv.y;
+		t1 = (bounds[1 - aRay.GetSign(1)].y - ori.y) * inv.y;
+		entryT = t0 > entryT ? t0 : entryT;
+		exitT = t1 < exitT ? t1 : exitT;
+
+		t0 = (bounds[aRay.GetSign(2)].z - ori.z) * inv.z;
+		t1 = (bounds[1 - aRay.GetSign(2)].z - ori.z) * inv.z;
+		entryT = t0 > entryT ? t0 : entryT;
+		exitT = t1 < exitT ? t1 : exitT;
+
+		if (entryT > exitT)
+			return false;
+
+		T t = entryT >= aRay.GetMinT() ? entryT : exitT;
+		if (t < aRay.GetMinT() || t > aRay.GetMaxT())
+			return false;
+
+		aOutT = t;
+		return true;
+	}
+
+	// Tests one ray against FloatN::ourLaneCount AABBs stored as SoA arrays, the same way as the IntersectionAABBRay above.
+	// Returns a bitmask of the lanes hit within the ray's [minT, maxT], their distances are stored in aOutT
+	template <typename FloatN>
+	int IntersectionAABBsRay(const float* someMinX, const float* someMinY, const float* someMinZ,
+		const float* someMaxX, const float* someMaxY, const float* someMaxZ, const Ray<float>& aRay, FloatN& aOutT)
+	{
+		const float* bounds[2][3] = { { someMinX, someMinY, someMinZ }, { someMaxX, someMaxY, someMaxZ } };
+		const auto& ori = aRay.GetOrigin();
+		const auto& inv = aRay.GetInverseDirection();
+
+		FloatN entryT = FloatN::Broadcast(-std::numeric_limits<float>::infinity());
+		FloatN exitT = FloatN::Broadcast(std::numeric_limits<float>::infinity());
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const int sign = aRay.GetSign(axis);
+			FloatN origin = FloatN::Broadcast((&ori.x)[axis]);
+			FloatN invDir = FloatN::Broadcast((&inv.x)[axis]);
+			entryT = Max((FloatN::Load(bounds[sign][axis]) - origin) * invDir, entryT);
+			exitT = Min((FloatN::Load(bounds[1 - sign][axis]) - origin) * invDir, exitT);
+		}
+
+		FloatN minT = FloatN::Broadcast(aRay.GetMinT());
+		FloatN maxT = FloatN::Broadcast(aRay.GetMaxT());
+		FloatN t = Select(entryT >= minT, entryT, exitT);
+		auto isHit = (entryT <= exitT) & (t >= minT) & (t <= maxT);
+
+		aOutT = t;
+		return isHit.ToBits();
+	}
+
+	// Slab test of every ray of aPacket against one AABB, the same way as the IntersectionAABBRay with aOutNearT and aOutFarT above.
+	// Returns a bitmask of the rays whose [minT, maxT] overlaps the AABB, where each overlap starts is stored in aOutNearT
+	template <typename FloatN>
+	int IntersectionAABBRayPacket(const Vector3<float>& aMin, const Vector3<float>& aMax, const RayPacket<FloatN>& aPacket, FloatN& aOutNearT)
+	{
+		const Vector3<float> bounds[2] = { aMin, aMax };
+
+		FloatN nearT = FloatN::Load(aPacket.myMinT);
+		FloatN farT = FloatN::Load(aPacket.myMaxT);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const int sign = aPacket.mySign[axis];
+			FloatN origin = FloatN::Load(aPacket.GetOrigin(axis));
+			FloatN invDir = FloatN::Load(aPacket.GetInverseDirection(axis));
+			nearT = Max((FloatN::Broadcast((&bounds[sign].x)[axis]) - origin) * invDir, nearT);
+			farT = Min((FloatN::Broadcast((&bounds[1 - sign].x)[axis]) - origin) * invDir, farT);
+		}
+
+		aOutNearT = nearT;
+		return (nearT <= farT).ToBits();
+	}
+
+	// Tests every ray of aPacket against the surface of one AABB, the same way as IntersectionAABBsRay tests one ray against many.
+	// Returns a bitmask of the rays that hit it within their [minT, maxT], their distances are stored in aOutT
+	template <typename FloatN>
+	int IntersectionAABBSurfaceRayPacket(const Vector3<float>& aMin, const Vector3<float>& aMax, const RayPacket<FloatN>& aPacket, FloatN& aOutT)
+	{
+		const Vector3<float> bounds[2] = { aMin, aMax };
+
+		FloatN entryT = FloatN::Broadcast(-std::numeric_limits<float>::infinity());
+		FloatN exitT = FloatN::Broadcast(std::numeric_limits<float>::infinity());
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const int sign = aPacket.mySign[axis];
+			FloatN origin = FloatN::Load(aPacket.GetOrigin(axis));
+			FloatN invDir = FloatN::Load(aPacket.GetInverseDirection(axis));
+			entryT = Max((FloatN::Broadcast((&bounds[sign].x)[axis]) - origin) * invDir, entryT);
+			exitT = Min((FloatN::Broadcast((&bounds[1 - sign].x)[axis]) - origin) * invDir, exitT);
+		}
+
+		FloatN minT = FloatN::Load(aPacket.myMinT);
+		FloatN maxT = FloatN::Load(aPacket.myMaxT);
+		FloatN t = Select(entryT >= minT, entryT, exitT);
+		auto isHit = (entryT <= exitT) & (t >= minT) & (t <= maxT);
+
+		aOutT = t;
+		return isHit.ToBits();
+	}
+
 	// If the ray intersects the AABB, true is returned, if not, false is returned.
 	// Any ray starting on the inside is considered to intersect the AABB
 	template <typename T>
@@ -213,6 +367,85 @@ namespace CommonUtilities
 		return true;
 	}
 
+	// If the sphere is hit within the ray's [minT, maxT] interval, true is returned and the distance is stored in aOutT.
+	// A ray starting on the inside hits the surface where it leaves the sphere
+	template <typename T>
+	bool IntersectionSphereRay(const Sphere<T>& aSphere, const Ray<T>& aRay, T& aOutT)
+	{
+		Vector3<T> toCenter = aSphere.GetCenter() - aRay.GetOrigin();
+		T a = toCenter.Dot(aRay.GetDirection());
+		T ac2 = toCenter.LengthSqr() - a * a;
+		T r2 = aSphere.GetRadius() * aSphere.GetRadius();
+		if (ac2 > r2) return false;
+
+		// Reject before the sqrt when the whole sphere lies outside of the interval
+		T radius = aSphere.GetRadius();
+		if (a + radius < aRay.GetMinT() || a - radius > aRay.GetMaxT()) return false;
+
+		T halfChord = sqrt(r2 - ac2);
+		T t = a - halfChord;
+		if (t < aRay.GetMinT()) t = a + halfChord;
+		if (t < aRay.GetMinT() || t > aRay.GetMaxT()) return false;
+
+		aOutT = t;
+		return true;
+	}
+
+	// Tests one ray against FloatN::ourLaneCount spheres stored as SoA arrays, the same way as the IntersectionSphereRay above.
+	// Returns a bitmask of the lanes hit within the ray's [minT, maxT], their distances are stored in aOutT
+	template <typename FloatN>
+	int IntersectionSpheresRay(const float* someCentersX, const float* someCentersY, const float* someCentersZ, const float* someRadii, const Ray<float>& aRay, FloatN& aOutT)
+	{
+		const auto& ori = aRay.GetOrigin();
+		const auto& dir = aRay.GetDirection();
+
+		FloatN toCenterX = FloatN::Load(someCentersX) - FloatN::Broadcast(ori.x);
+		FloatN toCenterY = FloatN::Load(someCentersY) - FloatN::Broadcast(ori.y);
+		FloatN toCenterZ = FloatN::Load(someCentersZ) - FloatN::Broadcast(ori.z);
+
+		FloatN a = toCenterX * FloatN::Broadcast(dir.x) + toCenterY * FloatN::Broadcast(dir.y) + toCenterZ * FloatN::Broadcast(dir.z);
+		FloatN ac2 = toCenterX * toCenterX + toCenterY * toCenterY + toCenterZ * toCenterZ - a * a;
+		FloatN radii = FloatN::Load(someRadii);
+		FloatN discriminant = radii * radii - ac2;
+		auto isHit = discriminant >= FloatN::Broadcast(0.f);
+
+		FloatN halfChord = Sqrt(Max(discriminant, FloatN::Broadcast(0.f)));
+		FloatN minT = FloatN::Broadcast(aRay.GetMinT());
+		FloatN maxT = FloatN::Broadcast(aRay.GetMaxT());
+		FloatN nearT = a - halfChord;
+		FloatN t = Select(nearT >= minT, nearT, a + halfChord);
+		isHit = isHit & (t >= minT) & (t <= maxT);
+
+		aOutT = t;
+		return isHit.ToBits();
+	}
+
+	// Tests every ray of aPacket against one sphere, the same way as IntersectionSpheresRay tests one ray against many.
+	// Returns a bitmask of the rays that hit it within their [minT, maxT], their distances are stored in aOutT
+	template <typename FloatN>
+	int IntersectionSphereRayPacket(float aCenterX, float aCenterY, float aCenterZ, float aRadius, const RayPacket<FloatN>& aPacket, FloatN& aOutT)
+	{
+		FloatN toCenterX = FloatN::Broadcast(aCenterX) - FloatN::Load(aPacket.myOriginX);
+		FloatN toCenterY = FloatN::Broadcast(aCenterY) - FloatN::Load(aPacket.myOriginY);
+		FloatN toCenterZ = FloatN::Broadcast(aCenterZ) - FloatN::Load(aPacket.myOriginZ);
+
+		FloatN a = toCenterX * FloatN::Load(aPacket.myDirectionX) + toCenterY * FloatN::Load(aPacket.myDirectionY) + toCenterZ * FloatN::Load(aPacket.myDirectionZ);
+		FloatN ac2 = toCenterX * toCenterX + toCenterY * toCenterY + toCenterZ * toCenterZ - a * a;
+		FloatN radius = FloatN::Broadcast(aRadius);
+		FloatN discriminant = radius * radius - ac2;
+		auto isHit = discriminant >= FloatN::Broadcast(0.f);
+
+		FloatN halfChord = Sqrt(Max(discriminant, FloatN::Broadcast(0.f)));
+		FloatN minT = FloatN::Load(aPacket.myMinT);
+		FloatN maxT = FloatN::Load(aPacket.myMaxT);
+		FloatN nearT = a - halfChord;
+		FloatN t = Select(nearT >= minT, nearT, a + halfChord);
+		isHit = isHit & (t >= minT) & (t <= maxT);
+
+		aOutT = t;
+		return isHit.ToBits();
+	}
+
 	// If the ray intersects the sphere, true is returned, if not, false is returned.
 	// Any ray starting on the inside is considered to intersect the sphere
 	template <typename T>
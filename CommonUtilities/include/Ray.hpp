@@ -1,31 +1,56 @@
 #pragma once
 #include "Vector3.hpp"
+#include <limits>
 
 namespace CommonUtilities
 {
+	// A ray only intersects things within its [minT, maxT] interval.
+	// The reciprocal direction and its signs are kept up to date for slab tests.
 	template <typename T>
 	class Ray
 	{
 	public:
 		Ray() = default;
 		Ray(const Ray<T>& aRay) = default;
-		Ray(const Vector3<T>& aOrigin, const Vector3<T>& aPoint) : myOrigin(aOrigin), myDirection((aPoint - aOrigin).GetNormalized()) {}
+		Ray(const Vector3<T>& aOrigin, const Vector3<T>& aPoint) : myOrigin(aOrigin), myDirection((aPoint - aOrigin).GetNormalized()) { UpdateInverseDirection(); }
 		// Init the ray with two points, the same as the constructor above.
 		void InitWith2Points(const Vector3<T>& aOrigin, const Vector3<T>& aPoint)
 		{
 			myOrigin = aOrigin;
 			myDirection = (aPoint - aOrigin).GetNormalized();
+			UpdateInverseDirection();
 		}
 		// Init the ray with an origin and a direction.
 		void InitWithOriginAndDirection(const Vector3<T>& aOrigin, const Vector3<T>& aDirection)
 		{
 			myOrigin = aOrigin;
 			myDirection = aDirection.GetNormalized();
+			UpdateInverseDirection();
 		}
+		inline void SetMinT(const T aMinT) { myMinT = aMinT; }
+		inline void SetMaxT(const T aMaxT) { myMaxT = aMaxT; }
 		inline const Vector3<T>& GetOrigin() const { return myOrigin; }
 		inline const Vector3<T>& GetDirection() const { return myDirection; }
+		inline const Vector3<T>& GetInverseDirection() const { return myInverseDirection; }
+		// 1 if the direction is negative along anAxis, else 0
+		inline int GetSign(const int anAxis) const { return mySign[anAxis]; }
+		inline T GetMinT() const { return myMinT; }
+		inline T GetMaxT() const { return myMaxT; }
+		inline Vector3<T> GetPoint(const T aT) const { return myOrigin + aT * myDirection; }
 	private:
+		void UpdateInverseDirection()
+		{
+			myInverseDirection = Vector3<T>(T(1), T(1), T(1)) / myDirection;
+			mySign[0] = myInverseDirection.x < T(0) ? 1 : 0;
+			mySign[1] = myInverseDirection.y < T(0) ? 1 : 0;
+			mySign[2] = myInverseDirection.z < T(0) ? 1 : 0;
+		}
+
 		Vector3<T> myOrigin;
 		Vector3<T> myDirection;
+		Vector3<T> myInverseDirection;
+		T myMinT = T(0);
+		T myMaxT = std::numeric_limits<T>::infinity();
+		int mySign[3] = { 0, 0, 0 };
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "Ray.hpp"
+#include "SIMD.hpp"
+#include <limits>
+
+namespace CommonUtilities
+{
+	// FloatN::ourLaneCount rays stored as SoA arrays, one lane per ray, so a SIMD instruction works on the same component of every ray.
+	// The packet kernels expect every ray to point into the same octant, HasCommonSigns tells if they do.
+	template <typename FloatN>
+	struct RayPacket
+	{
+		static constexpr int ourLaneCount = FloatN::ourLaneCount;
+
+		float myOriginX[ourLaneCount];
+		float myOriginY[ourLaneCount];
+		float myOriginZ[ourLaneCount];
+		float myDirectionX[ourLaneCount];
+		float myDirectionY[ourLaneCount];
+		float myDirectionZ[ourLaneCount];
+		float myInverseDirectionX[ourLaneCount];
+		float myInverseDirectionY[ourLaneCount];
+		float myInverseDirectionZ[ourLaneCount];
+		float myMinT[ourLaneCount];
+		float myMaxT[ourLaneCount]; // lowered to the closest hit so far while tracing
+		int mySign[3] = { 0, 0, 0 }; // of the first ray, the same for every ray if HasCommonSigns
+
+		// Fills lanes [0, aCount) with someRays, the rest repeat the first ray with an empty interval so they never hit anything
+		inline void Set(const Ray<float>* someRays, int aCount)
+		{
+			for (int lane = 0; lane < ourLaneCount; ++lane)
+			{
+				const Ray<float>& ray = someRays[lane < aCount ? lane : 0];
+				myOriginX[lane] = ray.GetOrigin().x;
+				myOriginY[lane] = ray.GetOrigin().y;
+				myOriginZ[lane] = ray.GetOrigin().z;
+				myDirectionX[lane] = ray.GetDirection().x;
+				myDirectionY[lane] = ray.GetDirection().y;
+				myDirectionZ[lane] = ray.GetDirection().z;
+				myInverseDirectionX[lane] = ray.GetInverseDirection().x;
+				myInverseDirectionY[lane] = ray.GetInverseDirection().y;
+				myInverseDirectionZ[lane] = ray.GetInverseDirection().z;
+				myMinT[lane] = lane < aCount ? ray.GetMinT() : std::numeric_limits<float>::infinity();
+				myMaxT[lane] = lane < aCount ? ray.GetMaxT() : -std::numeric_limits<float>::infinity();
+			}
+			for (int axis = 0; axis < 3; ++axis)
+				mySign[axis] = someRays[0].GetSign(axis);
+		}
+
+		// Whether the first aCount rays point into the same octant
+		inline bool HasCommonSigns(const Ray<float>* someRays, int aCount) const
+		{
+			for (int i = 1; i < aCount; ++i)
+			{
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					if (someRays[i].GetSign(axis) != mySign[axis])
+						return false;
+				}
+			}
+			return true;
+		}
+
+		inline const float* GetOrigin(int anAxis) const { return anAxis == 0 ? myOriginX : (anAxis == 1 ? myOriginY : myOriginZ); }
+		inline const float* GetInverseDirection(int anAxis) const { return anAxis == 0 ? myInverseDirectionX : (anAxis == 1 ? myInverseDirectionY : myInverseDirectionZ); }
+	};
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <immintrin.h>
+
+namespace CommonUtilities
+{
+	// Thin wrappers over SSE, AVX and AVX-512 registers, so SIMD kernels can be written once as templates over the lane count.
+	// Max and Min return their second operand when either one is NaN, like the underlying instructions.
+
+	struct Float4
+	{
+		static constexpr int ourLaneCount = 4;
+
+		struct Mask
+		{
+			__m128 myValue;
+			inline int ToBits() const { return _mm_movemask_ps(myValue); }
+		};
+
+		__m128 myValue;
+
+		static inline Float4 Load(const float* someValues) { return { _mm_loadu_ps(someValues) }; }
+		static inline Float4 Broadcast(const float aValue) { return { _mm_set1_ps(aValue) }; }
+		inline void Store(float* someValues) const { _mm_storeu_ps(someValues, myValue); }
+	};
+
+	inline Float4 operator+(const Float4& aLeft, const Float4& aRight) { return { _mm_add_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 operator-(const Float4& aLeft, const Float4& aRight) { return { _mm_sub_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 operator*(const Float4& aLeft, const Float4& aRight) { return { _mm_mul_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 operator/(const Float4& aLeft, const Float4& aRight) { return { _mm_div_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 Min(const Float4& aLeft, const Float4& aRight) { return { _mm_min_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 Max(const Float4& aLeft, const Float4& aRight) { return { _mm_max_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4 Sqrt(const Float4& aValue) { return { _mm_sqrt_ps(aValue.myValue) }; }
+	inline Float4::Mask operator<(const Float4& aLeft, const Float4& aRight) { return { _mm_cmplt_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4::Mask operator<=(const Float4& aLeft, const Float4& aRight) { return { _mm_cmple_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4::Mask operator>(const Float4& aLeft, const Float4& aRight) { return { _mm_cmpgt_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4::Mask operator>=(const Float4& aLeft, const Float4& aRight) { return { _mm_cmpge_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4::Mask operator&(const Float4::Mask& aLeft, const Float4::Mask& aRight) { return { _mm_and_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float4::Mask operator|(const Float4::Mask& aLeft, const Float4::Mask& aRight) { return { _mm_or_ps(aLeft.myValue, aRight.myValue) }; }
+	// Picks aTrue in the lanes where aMask is set, else aFalse
+	inline Float4 Select(const Float4::Mask& aMask, const Float4& aTrue, const Float4& aFalse)
+	{
+		return { _mm_or_ps(_mm_and_ps(aMask.myValue, aTrue.myValue), _mm_andnot_ps(aMask.myValue, aFalse.myValue)) };
+	}
+
+#ifdef __AVX__
+	struct Float8
+	{
+		static constexpr int ourLaneCount = 8;
+
+		struct Mask
+		{
+			__m256 myValue;
+			inline int ToBits() const { return _mm256_movemask_ps(myValue); }
+		};
+
+		__m256 myValue;
+
+		static inline Float8 Load(const float* someValues) { return { _mm256_loadu_ps(someValues) }; }
+		static inline Float8 Broadcast(const float aValue) { return { _mm256_set1_ps(aValue) }; }
+		inline void Store(float* someValues) const { _mm256_storeu_ps(someValues, myValue); }
+	};
+
+	inline Float8 operator+(const Float8& aLeft, const Float8& aRight) { return { _mm256_add_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 operator-(const Float8& aLeft, const Float8& aRight) { return { _mm256_sub_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 operator*(const Float8& aLeft, const Float8& aRight) { return { _mm256_mul_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 operator/(const Float8& aLeft, const Float8& aRight) { return { _mm256_div_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 Min(const Float8& aLeft, const Float8& aRight) { return { _mm256_min_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 Max(const Float8& aLeft, const Float8& aRight) { return { _mm256_max_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 Sqrt(const Float8& aValue) { return { _mm256_sqrt_ps(aValue.myValue) }; }
+	inline Float8::Mask operator<(const Float8& aLeft, const Float8& aRight) { return { _mm256_cmp_ps(aLeft.myValue, aRight.myValue, _CMP_LT_OQ) }; }
+	inline Float8::Mask operator<=(const Float8& aLeft, const Float8& aRight) { return { _mm256_cmp_ps(aLeft.myValue, aRight.myValue, _CMP_LE_OQ) }; }
+	inline Float8::Mask operator>(const Float8& aLeft, const Float8& aRight) { return { _mm256_cmp_ps(aLeft.myValue, aRight.myValue, _CMP_GT_OQ) }; }
+	inline Float8::Mask operator>=(const Float8& aLeft, const Float8& aRight) { return { _mm256_cmp_ps(aLeft.myValue, aRight.myValue, _CMP_GE_OQ) }; }
+	inline Float8::Mask operator&(const Float8::Mask& aLeft, const Float8::Mask& aRight) { return { _mm256_and_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8::Mask operator|(const Float8::Mask& aLeft, const Float8::Mask& aRight) { return { _mm256_or_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float8 Select(const Float8::Mask& aMask, const Float8& aTrue, const Float8& aFalse)
+	{
+		return { _mm256_blendv_ps(aFalse.myValue, aTrue.myValue, aMask.myValue) };
+	}
+#endif
+
+#ifdef __AVX512F__
+	struct Float16
+	{
+		static constexpr int ourLaneCount = 16;
+
+		struct Mask
+		{
+			__mmask16 myValue;
+			inline int ToBits() const { return (int)myValue; }
+		};
+
+		__m512 myValue;
+
+		static inline Float16 Load(const float* someValues) { return { _mm512_loadu_ps(someValues) }; }
+		static inline Float16 Broadcast(const float aValue) { return { _mm512_set1_ps(aValue) }; }
+		inline void Store(float* someValues) const { _mm512_storeu_ps(someValues, myValue); }
+	};
+
+	inline Float16 operator+(const Float16& aLeft, const Float16& aRight) { return { _mm512_add_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 operator-(const Float16& aLeft, const Float16& aRight) { return { _mm512_sub_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 operator*(const Float16& aLeft, const Float16& aRight) { return { _mm512_mul_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 operator/(const Float16& aLeft, const Float16& aRight) { return { _mm512_div_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 Min(const Float16& aLeft, const Float16& aRight) { return { _mm512_min_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 Max(const Float16& aLeft, const Float16& aRight) { return { _mm512_max_ps(aLeft.myValue, aRight.myValue) }; }
+	inline Float16 Sqrt(const Float16& aValue) { return { _mm512_sqrt_ps(aValue.myValue) }; }
+	inline Float16::Mask operator<(const Float16& aLeft, const Float16& aRight) { return { _mm512_cmp_ps_mask(aLeft.myValue, aRight.myValue, _CMP_LT_OQ) }; }
+	inline Float16::Mask operator<=(const Float16& aLeft, const Float16& aRight) { return { _mm512_cmp_ps_mask(aLeft.myValue, aRight.myValue, _CMP_LE_OQ) }; }
+	inline Float16::Mask operator>(const Float16& aLeft, const Float16& aRight) { return { _mm512_cmp_ps_mask(aLeft.myValue, aRight.myValue, _CMP_GT_OQ) }; }
+	inline Float16::Mask operator>=(const Float16& aLeft, const Float16& aRight) { return { _mm512_cmp_ps_mask(aLeft.myValue, aRight.myValue, _CMP_GE_OQ) }; }
+	inline Float16::Mask operator&(const Float16::Mask& aLeft, const Float16::Mask& aRight) { return { (__mmask16)(aLeft.myValue & aRight.myValue) }; }
+	inline Float16::Mask operator|(const Float16::Mask& aLeft, const Float16::Mask& aRight) { return { (__mmask16)(aLeft.myValue | aRight.myValue) }; }
+	inline Float16 Select(const Float16::Mask& aMask, const Float16& aTrue, const Float16& aFalse)
+	{
+		return { _mm512_mask_blend_ps(aMask.myValue, aFalse.myValue, aTrue.myValue) };
+	}
+#endif
+
+	// The widest lane type the target instruction set supports
+#if defined(__AVX512F__)
+	using FloatLanes = Float16;
+#elif defined(__AVX__)
+	using FloatLanes = Float8;
+#else
+	using FloatLanes = Float4;
+#endif
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <immintrin.h>
 
 namespace CommonUtilities
 {
@@ -57,6 +58,7 @@ namespace CommonUtilities
 	template <class T> Vector3<T> operator*(const T& aScalar, const Vector3<T>& aVector) { return aVector * aScalar; }
 	template <class T> Vector3<T> operator*(const Vector3<T>& aLVector, const Vector3<T>& aRVector) { return Vector3<T>(aLVector.x * aRVector.x, aLVector.y * aRVector.y, aLVector.z * aRVector.z); }
 	template <class T> Vector3<T> operator/(const Vector3<T>& aVector, const T& aScalar) { return aVector * (T(1) / aScalar); }
+	template <class T> Vector3<T> operator/(const Vector3<T>& aLVector, const Vector3<T>& aRVector) { return Vector3<T>(aLVector.x / aRVector.x, aLVector.y / aRVector.y, aLVector.z / aRVector.z); }
 	template <class T> void operator+=(Vector3<T>& aVector0, const Vector3<T>& aVector1) 
 	{
 		aVector0.x += aVector1.x;
@@ -71,4 +73,89 @@ namespace CommonUtilities
 		aVector.z *= aScalar;
 	}
 	template <class T> void operator/=(Vector3<T>& aVector, const T& aScalar) { aVector *= (T(1) / aScalar); }
+
+	// Float vectors live in one SSE register, the fourth lane is always zero.
+	// Same interface as the generic Vector3, so everything built on Vector3<float> uses the SIMD path unchanged.
+	template <> class alignas(16) Vector3<float>
+	{
+	public:
+		union
+		{
+			__m128 myValue;
+			struct
+			{
+				float x;
+				float y;
+				float z;
+			};
+		};
+
+		Vector3() : myValue(_mm_setzero_ps()) {}
+		Vector3(const float& aX, const float& aY, const float& aZ) : myValue(_mm_set_ps(0.f, aZ, aY, aX)) {}
+		explicit Vector3(const __m128 aValue) : myValue(aValue) {}
+		Vector3(const Vector3<float>& aVector) = default;
+		Vector3<float>& operator=(const Vector3<float>& aVector3) = default;
+		Vector3<float> operator-() const { return Vector3<float>(_mm_xor_ps(myValue, _mm_set_ps(0.f, -0.f, -0.f, -0.f))); }
+		bool operator==(const Vector3<float>& aVector) const
+		{
+			return (_mm_movemask_ps(_mm_cmpeq_ps(myValue, aVector.myValue)) & 7) == 7;
+		}
+		bool operator!=(const Vector3<float>& aVector) const { return !(*this == aVector); }
+		~Vector3() = default;
+		float LengthSqr() const { return _mm_cvtss_f32(DotLanes(myValue, myValue)); }
+		float Length() const { return std::sqrt(LengthSqr()); }
+		// Scales by a reciprocal square root estimate refined with one Newton-Raphson step, close to full float precision
+		Vector3<float> GetNormalized() const
+		{
+			const __m128 lengthSqr = DotLanes(myValue, myValue);
+			if (_mm_cvtss_f32(lengthSqr) == 0.f)
+				return Vector3<float>();
+
+			const __m128 estimate = _mm_rsqrt_ps(lengthSqr);
+			const __m128 halfLengthSqr = _mm_mul_ps(_mm_set1_ps(0.5f), lengthSqr);
+			const __m128 refined = _mm_mul_ps(estimate, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(halfLengthSqr, _mm_mul_ps(estimate, estimate))));
+			return Vector3<float>(_mm_mul_ps(myValue, refined));
+		}
+		void Normalize() { *this = GetNormalized(); }
+		float Dot(const Vector3<float>& aVector) const { return _mm_cvtss_f32(DotLanes(myValue, aVector.myValue)); }
+		Vector3<float> Cross(const Vector3<float>& aVector) const
+		{
+			// a * b.yzx - a.yzx * b holds the cross product in zxy order
+			const __m128 leftYZX = _mm_shuffle_ps(myValue, myValue, _MM_SHUFFLE(3, 0, 2, 1));
+			const __m128 rightYZX = _mm_shuffle_ps(aVector.myValue, aVector.myValue, _MM_SHUFFLE(3, 0, 2, 1));
+			const __m128 cross = _mm_sub_ps(_mm_mul_ps(myValue, rightYZX), _mm_mul_ps(leftYZX, aVector.myValue));
+			return Vector3<float>(_mm_shuffle_ps(cross, cross, _MM_SHUFFLE(3, 0, 2, 1)));
+		}
+
+	private:
+		// The dot product of the xyz lanes in every lane, summed in the same order as the generic Vector3
+		static inline __m128 DotLanes(const __m128 aLeft, const __m128 aRight)
+		{
+#if defined(__SSE4_1__) || defined(__AVX__)
+			return _mm_dp_ps(aLeft, aRight, 0x7F);
+#else
+			const __m128 products = _mm_mul_ps(aLeft, aRight);
+			__m128 sum = _mm_add_ss(products, _mm_shuffle_ps(products, products, _MM_SHUFFLE(1, 1, 1, 1)));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(products, products, _MM_SHUFFLE(2, 2, 2, 2)));
+			return _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(0, 0, 0, 0));
+#endif
+		}
+	};
+
+	inline Vector3<float> operator+(const Vector3<float>& aVector0, const Vector3<float>& aVector1) { return Vector3<float>(_mm_add_ps(aVector0.myValue, aVector1.myValue)); }
+	inline Vector3<float> operator-(const Vector3<float>& aVector0, const Vector3<float>& aVector1) { return Vector3<float>(_mm_sub_ps(aVector0.myValue, aVector1.myValue)); }
+	inline Vector3<float> operator*(const Vector3<float>& aVector, const float& aScalar) { return Vector3<float>(_mm_mul_ps(aVector.myValue, _mm_set1_ps(aScalar))); }
+	inline Vector3<float> operator*(const float& aScalar, const Vector3<float>& aVector) { return aVector * aScalar; }
+	inline Vector3<float> operator*(const Vector3<float>& aLVector, const Vector3<float>& aRVector) { return Vector3<float>(_mm_mul_ps(aLVector.myValue, aRVector.myValue)); }
+	inline Vector3<float> operator/(const Vector3<float>& aVector, const float& aScalar) { return aVector * (1.f / aScalar); }
+	// The fourth lane is masked back to zero after dividing by it
+	inline Vector3<float> operator/(const Vector3<float>& aLVector, const Vector3<float>& aRVector)
+	{
+		const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+		return Vector3<float>(_mm_and_ps(_mm_div_ps(aLVector.myValue, aRVector.myValue), xyzMask));
+	}
+	inline void operator+=(Vector3<float>& aVector0, const Vector3<float>& aVector1) { aVector0.myValue = _mm_add_ps(aVector0.myValue, aVector1.myValue); }
+	inline void operator-=(Vector3<float>& aVector0, const Vector3<float>& aVector1) { aVector0.myValue = _mm_sub_ps(aVector0.myValue, aVector1.myValue); }
+	inline void operator*=(Vector3<float>& aVector, const float& aScalar) { aVector.myValue = _mm_mul_ps(aVector.myValue, _mm_set1_ps(aScalar)); }
+	inline void operator/=(Vector3<float>& aVector, const float& aScalar) { aVector *= (1.f / aScalar); }
 }
\ No newline at end of file
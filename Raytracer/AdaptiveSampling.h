@@ -0,0 +1,102 @@
+#pragma once
+
+#include "CScene.h"
+#include "Film.h"
+#include "ThreadPool.h"
+#include "Sampler.h"
+
+// stdlib
+#include <vector>
+#include <algorithm>
+
+// Renders in passes: every pixel first gets myMinSamples, then each pass doubles the samples of the pixels that are still too noisy.
+// A pixel's own variance estimate is unreliable after few samples of bright, rare paths,
+// so a pixel keeps sampling while either its own error or the average error of its 3x3 neighbourhood is above myThreshold.
+namespace AdaptiveSampling
+{
+	struct Settings
+	{
+		int myMinSamples = 16;
+		int myMaxSamples = 400;
+		// Largest accepted width of a pixel's 95% confidence interval, in displayed 0-1 units
+		float myThreshold = 0.15f;
+		SamplerType mySamplerType = SamplerType::Sobol;
+	};
+
+	inline float GetNeighbourhoodError(const std::vector<float>& someErrors, int aWidth, int aHeight, int aX, int aY)
+	{
+		float sum = 0.f;
+		int count = 0;
+		for (int y = std::max(aY - 1, 0); y <= std::min(aY + 1, aHeight - 1); ++y)
+		{
+			for (int x = std::max(aX - 1, 0); x <= std::min(aX + 1, aWidth - 1); ++x)
+			{
+				sum += someErrors[y * aWidth + x];
+				++count;
+			}
+		}
+		return sum / count;
+	}
+
+	// Returns the total number of samples taken
+	inline long long Render(CScene& aScene, ThreadPool& aThreadPool, Film& aFilm, const Settings& someSettings, int aTileSize)
+	{
+		const int width = aFilm.GetWidth();
+		const int height = aFilm.GetHeight();
+
+		// Samples each pixel still gets in the current pass
+		std::vector<int> passSamples(width * height, someSettings.myMinSamples);
+		std::vector<float> errors(width * height);
+		long long totalSamples = 0;
+
+		std::vector<std::unique_ptr<Sampler>> samplers;
+		for (int i = 0; i < aThreadPool.GetWorkerCount(); ++i)
+			samplers.push_back(CreateSampler(someSettings.mySamplerType));
+
+		while (true)
+		{
+			long long passTotal = 0;
+			for (int samples : passSamples)
+				passTotal += samples;
+			if (passTotal == 0)
+				break;
+			totalSamples += passTotal;
+
+			aThreadPool.ForEachTile(width, height, aTileSize, [&](const Tile& aTile, int aWorkerIndex)
+			{
+				Sampler& sampler = *samplers[aWorkerIndex];
+				for (int y = aTile.myY; y < aTile.myY + aTile.myHeight; ++y)
+				{
+					for (int x = aTile.myX; x < aTile.myX + aTile.myWidth; ++x)
+					{
+						// Continues the pixel's sample sequence where the previous pass stopped
+						for (int i = 0; i < passSamples[y * width + x]; ++i)
+						{
+							FeatureSample features;
+							const Vector3f color = aScene.Sample(x, y, aFilm.GetSampleCount(x, y), sampler, &features);
+							aFilm.AddSample(x, y, color, features);
+						}
+					}
+				}
+			});
+
+			for (int y = 0; y < height; ++y)
+			{
+				for (int x = 0; x < width; ++x)
+					errors[y * width + x] = aFilm.GetDisplayedError(x, y);
+			}
+
+			for (int y = 0; y < height; ++y)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					const int count = aFilm.GetSampleCount(x, y);
+					const float error = std::max(errors[y * width + x], GetNeighbourhoodError(errors, width, height, x, y));
+					passSamples[y * width + x] = error > someSettings.myThreshold ? std::min(count, someSettings.myMaxSamples - count) : 0;
+				}
+			}
+		}
+
+		return totalSamples;
+	}
+}
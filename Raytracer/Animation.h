@@ -0,0 +1,77 @@
+#pragma once
+
+#include "SceneGeometry.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+
+// Rigid motion of primitives over a sequence of frames. A scene file lists "frames count" and, after a sphere or aabb,
+// "keyframe frame cx cy cz" lines that put its center somewhere at that frame. Frames between keyframes interpolate
+// linearly, frames past the last one hold its position.
+// Moving primitives only refits the BVH, until its surface area cost has grown past a threshold and it is rebuilt.
+namespace Animation
+{
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	struct Settings
+	{
+		// A refit BVH is rebuilt once its surface area cost is this many times what it was after the last build
+		float myRebuildThreshold = 1.3f;
+	};
+
+	struct Keyframe
+	{
+		int myFrame;
+		Vector3f myCenter;
+	};
+
+	// The keyframes of one primitive, sorted by frame. The first is where the scene file declared it, at frame 0.
+	struct Track
+	{
+		PrimitiveShape myShape;
+		int myIndex; // into the scene's spheres or AABBs
+		std::vector<Keyframe> myKeyframes;
+	};
+
+	// How the acceleration structures followed a frame's motion
+	struct FrameUpdate
+	{
+		bool myIsRebuilt = false;
+		float mySAHCost = 0.f;
+		double mySeconds = 0.0;
+	};
+
+	// Replaces the keyframe at the same frame, if there is one
+	inline void AddKeyframe(Track& aTrack, const Keyframe& aKeyframe)
+	{
+		auto it = aTrack.myKeyframes.begin();
+		while (it != aTrack.myKeyframes.end() && it->myFrame < aKeyframe.myFrame)
+			++it;
+		if (it != aTrack.myKeyframes.end() && it->myFrame == aKeyframe.myFrame)
+			*it = aKeyframe;
+		else
+			aTrack.myKeyframes.insert(it, aKeyframe);
+	}
+
+	inline Vector3f GetCenter(const Track& aTrack, int aFrame)
+	{
+		const std::vector<Keyframe>& keyframes = aTrack.myKeyframes;
+		if (aFrame <= keyframes.front().myFrame)
+			return keyframes.front().myCenter;
+
+		for (size_t i = 1; i < keyframes.size(); ++i)
+		{
+			if (aFrame <= keyframes[i].myFrame)
+			{
+				const Keyframe& from = keyframes[i - 1];
+				const Keyframe& to = keyframes[i];
+				const float t = (float)(aFrame - from.myFrame) / (float)(to.myFrame - from.myFrame);
+				return from.myCenter + (to.myCenter - from.myCenter) * t;
+			}
+		}
+		return keyframes.back().myCenter;
+	}
+}
@@ -0,0 +1,650 @@
+#pragma once
+
+#include "SceneGeometry.h"
+#include "ThreadPool.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+#include "AABB3D.hpp"
+#include "Intersection.hpp"
+#include "Ray.hpp"
+#include "UtilityFunctions.hpp"
+
+// stdlib
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+// Bounding volume hierarchy built top-down with the surface area heuristic, evaluated on bins of the primitive centroids.
+// Every leaf holds a single primitive shape, as a range into the shape's arrays in SceneGeometry.
+// With a thread pool the top levels bin their primitives in parallel, and the subtrees below them are built by the workers
+// at once, each into the worker's own arena of nodes. They are copied into place in a fixed order, so the tree doesn't
+// depend on the number of threads.
+class BVH
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+	using AABB3Df = CommonUtilities::AABB3D<float>;
+	using Ray = CommonUtilities::Ray<float>;
+
+	static constexpr int ourMaxDepth = 60;
+
+	struct BuildPrimitive
+	{
+		AABB3Df myBounds;
+		PrimitiveShape myShape;
+		int myIndex; // reported back through GetOrder
+	};
+
+	struct Node
+	{
+		AABB3Df myBounds;
+		int myFirst = 0; // first primitive of myShape for leaves, left child for inner nodes (the right child follows it)
+		int myCount = 0; // 0 for inner nodes
+		PrimitiveShape myShape = PrimitiveShape::Sphere;
+
+		inline bool IsLeaf() const { return myCount > 0; }
+	};
+
+	void Build(const std::vector<BuildPrimitive>& somePrimitives, ThreadPool* aThreadPool = nullptr);
+	// Fits the bounds of every node to the primitives Build was given, moved, keeping the tree and the primitive order
+	void Refit(const std::vector<BuildPrimitive>& somePrimitives);
+	// Expected cost of tracing a ray that hits the root through the tree, by the surface area heuristic
+	float GetSAHCost() const;
+	// Closest hit within the ray's [minT, maxT], only the distance is calculated
+	bool Hit(const Ray& aRay, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const;
+	// Any hit within the ray's [minT, maxT], stops at the first one found
+	bool Occluded(const Ray& aRay, const SceneGeometry& aGeometry) const;
+
+	inline size_t GetNodeCount() const { return myNodes.size(); }
+	inline const std::vector<Node>& GetNodes() const { return myNodes; }
+	// The BuildPrimitive::myIndex of every primitive of aShape, in the order the leaves expect them in SceneGeometry
+	inline const std::vector<int>& GetOrder(PrimitiveShape aShape) const { return aShape == PrimitiveShape::Sphere ? mySphereOrder : myAABBOrder; }
+
+private:
+	static constexpr int ourMaxLeafSize = 8;
+	static constexpr float ourTraversalCost = 1.f;
+	static constexpr float ourIntersectionCost = 1.f;
+
+	static constexpr int ourBinCount = 16;
+	// Nodes with at least this many items bin them on the thread pool, smaller ones are built with their whole subtree by one worker
+	static constexpr int ourParallelItemCount = 1 << 14;
+	// Items per task when binning on the thread pool
+	static constexpr int ourBinningChunkSize = 1 << 12;
+
+	struct BuildItem
+	{
+		AABB3Df myBounds;
+		Vector3f myCentroid;
+		PrimitiveShape myShape;
+		int myIndex;
+	};
+
+	struct Bin
+	{
+		AABB3Df myBounds;
+		int myCount;
+	};
+
+	// The items of a node sorted into ourBinCount equally wide bins of their centroids along every axis
+	struct Binning
+	{
+		AABB3Df myBounds;
+		AABB3Df myCentroidBounds;
+		Bin myBins[3][ourBinCount];
+
+		inline void Reset();
+		inline void Merge(const Binning& aBinning);
+	};
+
+	// A node built with its subtree by one worker, into the worker's arena
+	struct Subtree
+	{
+		int myNode;
+		int myDepth;
+		int myWorker;
+		int myBegin; // range of its nodes in the arena, the first is the subtree's root
+		int myEnd;
+	};
+
+	// Which bin a centroid falls in along every axis, axes the centroids don't spread along put them all in the first
+	struct BinMapping
+	{
+		float myMin[3];
+		float myScale[3];
+
+		inline explicit BinMapping(const AABB3Df& aCentroidBounds);
+		inline int GetBin(const BuildItem& anItem, int anAxis) const;
+	};
+
+	static inline AABB3Df GetEmptyBounds();
+	// Bins the items of aNode, on aThreadPool if it has enough of them to be worth it
+	static void BinItems(const Node& aNode, const std::vector<BuildItem>& someItems, ThreadPool* aThreadPool, Binning& aOutBinning);
+	// Makes the node a leaf, or splits its items at the cheapest bin boundary between two new children.
+	// Returns the index of the left child, or -1 for a leaf.
+	static int Split(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems, const Binning& aBinning, int aDepth);
+	static void Subdivide(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems, int aDepth);
+	static void MakeLeaf(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems);
+	void BuildParallel(std::vector<BuildItem>& someItems, ThreadPool& aThreadPool);
+
+	std::vector<Node> myNodes;
+	std::vector<int> mySphereOrder;
+	std::vector<int> myAABBOrder;
+};
+
+namespace
+{
+	// Node bounds are grown slightly so that a primitive hit on its own bounds is never culled by rounding in the slab test
+	inline CommonUtilities::AABB3D<float> PadBounds(const CommonUtilities::AABB3D<float>& aBounds)
+	{
+		auto min = aBounds.GetMin();
+		auto max = aBounds.GetMax();
+		float largest = 1.f;
+		largest = CommonUtilities::Max(largest, CommonUtilities::Max(std::fabs(min.x), std::fabs(max.x)));
+		largest = CommonUtilities::Max(largest, CommonUtilities::Max(std::fabs(min.y), std::fabs(max.y)));
+		largest = CommonUtilities::Max(largest, CommonUtilities::Max(std::fabs(min.z), std::fabs(max.z)));
+		CommonUtilities::Vector3<float> pad(largest * 1e-5f, largest * 1e-5f, largest * 1e-5f);
+		return CommonUtilities::AABB3D<float>(min - pad, max + pad);
+	}
+}
+
+void BVH::Build(const std::vector<BuildPrimitive>& somePrimitives, ThreadPool* aThreadPool)
+{
+	myNodes.clear();
+	mySphereOrder.clear();
+	myAABBOrder.clear();
+
+	if (somePrimitives.empty())
+		return;
+
+	std::vector<BuildItem> items;
+	items.reserve(somePrimitives.size());
+	for (const auto& primitive : somePrimitives)
+		items.push_back({ primitive.myBounds, primitive.myBounds.GetCenter(), primitive.myShape, primitive.myIndex });
+
+	myNodes.reserve(2 * items.size());
+	myNodes.emplace_back();
+	myNodes[0].myFirst = 0;
+	myNodes[0].myCount = (int)items.size();
+
+	// One worker would only pay for the handing out
+	if (aThreadPool && aThreadPool->GetWorkerCount() > 1)
+		BuildParallel(items, *aThreadPool);
+	else
+		Subdivide(myNodes, 0, items, 0);
+
+	// Leaves cover consecutive items and hold one shape each, so each shape's items are already in leaf order
+	std::vector<int> shapeIndices(items.size());
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		std::vector<int>& order = items[i].myShape == PrimitiveShape::Sphere ? mySphereOrder : myAABBOrder;
+		shapeIndices[i] = (int)order.size();
+		order.push_back(items[i].myIndex);
+	}
+
+	for (auto& node : myNodes)
+	{
+		if (node.IsLeaf())
+			node.myFirst = shapeIndices[node.myFirst];
+	}
+}
+
+void BVH::BuildParallel(std::vector<BuildItem>& someItems, ThreadPool& aThreadPool)
+{
+	// Split the top levels here, with their binning spread over the workers, until the nodes are small enough to hand out whole
+	std::vector<Subtree> subtrees;
+	std::vector<std::pair<int, int>> pending = { { 0, 0 } };
+	Binning binning;
+	while (!pending.empty())
+	{
+		const int node = pending.back().first;
+		const int depth = pending.back().second;
+		pending.pop_back();
+
+		if (myNodes[node].myCount < ourParallelItemCount)
+		{
+			subtrees.push_back({ node, depth, 0, 0, 0 });
+			continue;
+		}
+
+		BinItems(myNodes[node], someItems, &aThreadPool, binning);
+		const int left = Split(myNodes, node, someItems, binning, depth);
+		if (left < 0)
+			continue;
+		pending.push_back({ left + 1, depth + 1 });
+		pending.push_back({ left, depth + 1 });
+	}
+
+	// Subtrees cover disjoint ranges of the items, so the workers only share the nodes they read their roots from
+	std::vector<std::vector<Node>> arenas(aThreadPool.GetWorkerCount());
+	aThreadPool.ForEachTile((int)subtrees.size(), 1, 1, [&](const Tile& aTile, int aWorkerIndex)
+	{
+		Subtree& subtree = subtrees[aTile.myX];
+		std::vector<Node>& arena = arenas[aWorkerIndex];
+		subtree.myWorker = aWorkerIndex;
+		subtree.myBegin = (int)arena.size();
+		arena.push_back(myNodes[subtree.myNode]);
+		Subdivide(arena, subtree.myBegin, someItems, subtree.myDepth);
+		subtree.myEnd = (int)arena.size();
+	});
+
+	// The root of a subtree replaces its node, the rest are appended in the order they were made, which keeps siblings next to each other
+	for (const Subtree& subtree : subtrees)
+	{
+		const std::vector<Node>& arena = arenas[subtree.myWorker];
+		const int offset = (int)myNodes.size() - (subtree.myBegin + 1);
+		for (int i = subtree.myBegin; i < subtree.myEnd; ++i)
+		{
+			Node node = arena[i];
+			if (!node.IsLeaf())
+				node.myFirst += offset;
+			if (i == subtree.myBegin)
+				myNodes[subtree.myNode] = node;
+			else
+				myNodes.push_back(node);
+		}
+	}
+}
+
+BVH::AABB3Df BVH::GetEmptyBounds()
+{
+	const float inf = std::numeric_limits<float>::infinity();
+	return AABB3Df(Vector3f(inf, inf, inf), Vector3f(-inf, -inf, -inf));
+}
+
+void BVH::Binning::Reset()
+{
+	myBounds = GetEmptyBounds();
+	myCentroidBounds = GetEmptyBounds();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (Bin& bin : myBins[axis])
+			bin = { GetEmptyBounds(), 0 };
+	}
+}
+
+void BVH::Binning::Merge(const Binning& aBinning)
+{
+	myBounds.ExpandToInclude(aBinning.myBounds);
+	myCentroidBounds.ExpandToInclude(aBinning.myCentroidBounds);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (int i = 0; i < ourBinCount; ++i)
+		{
+			myBins[axis][i].myBounds.ExpandToInclude(aBinning.myBins[axis][i].myBounds);
+			myBins[axis][i].myCount += aBinning.myBins[axis][i].myCount;
+		}
+	}
+}
+
+BVH::BinMapping::BinMapping(const AABB3Df& aCentroidBounds)
+{
+	const Vector3f min = aCentroidBounds.GetMin();
+	const Vector3f max = aCentroidBounds.GetMax();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float extent = (&max.x)[axis] - (&min.x)[axis];
+		myMin[axis] = (&min.x)[axis];
+		myScale[axis] = extent > 0.f ? ourBinCount / extent : 0.f;
+	}
+}
+
+int BVH::BinMapping::GetBin(const BuildItem& anItem, int anAxis) const
+{
+	const int bin = (int)(((&anItem.myCentroid.x)[anAxis] - myMin[anAxis]) * myScale[anAxis]);
+	return bin < ourBinCount ? bin : ourBinCount - 1;
+}
+
+void BVH::BinItems(const Node& aNode, const std::vector<BuildItem>& someItems, ThreadPool* aThreadPool, Binning& aOutBinning)
+{
+	const int first = aNode.myFirst;
+	const int count = aNode.myCount;
+
+	// The bins depend on the centroid bounds, so those are found in a pass of their own
+	auto addBounds = [&](int aBegin, int anEnd, Binning& aBinning)
+	{
+		for (int i = aBegin; i < anEnd; ++i)
+		{
+			aBinning.myBounds.ExpandToInclude(someItems[i].myBounds);
+			aBinning.myCentroidBounds.ExpandToInclude(AABB3Df(someItems[i].myCentroid, someItems[i].myCentroid));
+		}
+	};
+	auto addBins = [&](int aBegin, int anEnd, const BinMapping& aMapping, Binning& aBinning)
+	{
+		for (int i = aBegin; i < anEnd; ++i)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				Bin& bin = aBinning.myBins[axis][aMapping.GetBin(someItems[i], axis)];
+				bin.myBounds.ExpandToInclude(someItems[i].myBounds);
+				++bin.myCount;
+			}
+		}
+	};
+
+	aOutBinning.Reset();
+	if (!aThreadPool || count < ourParallelItemCount)
+	{
+		addBounds(first, first + count, aOutBinning);
+		addBins(first, first + count, BinMapping(aOutBinning.myCentroidBounds), aOutBinning);
+		return;
+	}
+
+	// Every chunk fills its own binning, they are merged in order afterwards
+	const int chunkCount = (count + ourBinningChunkSize - 1) / ourBinningChunkSize;
+	std::vector<Binning> chunks(chunkCount);
+	aThreadPool->ForEachTile(chunkCount, 1, 1, [&](const Tile& aTile, int)
+	{
+		const int begin = first + aTile.myX * ourBinningChunkSize;
+		chunks[aTile.myX].Reset();
+		addBounds(begin, std::min(begin + ourBinningChunkSize, first + count), chunks[aTile.myX]);
+	});
+	for (const Binning& chunk : chunks)
+	{
+		aOutBinning.myBounds.ExpandToInclude(chunk.myBounds);
+		aOutBinning.myCentroidBounds.ExpandToInclude(chunk.myCentroidBounds);
+	}
+
+	const BinMapping mapping(aOutBinning.myCentroidBounds);
+	aThreadPool->ForEachTile(chunkCount, 1, 1, [&](const Tile& aTile, int)
+	{
+		const int begin = first + aTile.myX * ourBinningChunkSize;
+		chunks[aTile.myX].Reset();
+		addBins(begin, std::min(begin + ourBinningChunkSize, first + count), mapping, chunks[aTile.myX]);
+	});
+	for (const Binning& chunk : chunks)
+		aOutBinning.Merge(chunk);
+}
+
+void BVH::MakeLeaf(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems)
+{
+	const int first = someNodes[aNodeIndex].myFirst;
+	const int count = someNodes[aNodeIndex].myCount;
+	auto begin = someItems.begin() + first;
+	auto end = begin + count;
+
+	auto split = std::stable_partition(begin, end, [](const BuildItem& anItem) { return anItem.myShape == PrimitiveShape::Sphere; });
+	const int sphereCount = (int)(split - begin);
+	if (sphereCount == 0 || sphereCount == count)
+	{
+		someNodes[aNodeIndex].myShape = begin->myShape;
+		return;
+	}
+
+	// Mixed shapes get one leaf per shape
+	const int leftIndex = (int)someNodes.size();
+	someNodes.emplace_back();
+	someNodes.emplace_back();
+
+	for (int child = 0; child < 2; ++child)
+	{
+		Node& node = someNodes[leftIndex + child];
+		node.myFirst = child == 0 ? first : first + sphereCount;
+		node.myCount = child == 0 ? sphereCount : count - sphereCount;
+		node.myShape = child == 0 ? PrimitiveShape::Sphere : PrimitiveShape::AABB;
+
+		AABB3Df bounds = someItems[node.myFirst].myBounds;
+		for (int i = node.myFirst; i < node.myFirst + node.myCount; ++i)
+			bounds.ExpandToInclude(someItems[i].myBounds);
+		node.myBounds = PadBounds(bounds);
+	}
+
+	someNodes[aNodeIndex].myFirst = leftIndex;
+	someNodes[aNodeIndex].myCount = 0;
+}
+
+int BVH::Split(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems, const Binning& aBinning, int aDepth)
+{
+	const int first = someNodes[aNodeIndex].myFirst;
+	const int count = someNodes[aNodeIndex].myCount;
+	someNodes[aNodeIndex].myBounds = PadBounds(aBinning.myBounds);
+
+	if (count == 1 || aDepth >= ourMaxDepth - 1)
+	{
+		MakeLeaf(someNodes, aNodeIndex, someItems);
+		return -1;
+	}
+
+	// Sweep the bin boundaries of every axis for the split with the lowest surface area cost
+	int bestAxis = -1;
+	int bestBin = 0;
+	float bestCost = std::numeric_limits<float>::infinity();
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const Bin* bins = aBinning.myBins[axis];
+
+		float rightAreas[ourBinCount];
+		int rightCounts[ourBinCount];
+		AABB3Df right = GetEmptyBounds();
+		int rightCount = 0;
+		for (int i = ourBinCount - 1; i > 0; --i)
+		{
+			right.ExpandToInclude(bins[i].myBounds);
+			rightCount += bins[i].myCount;
+			rightAreas[i] = rightCount > 0 ? right.GetSurfaceArea() : 0.f;
+			rightCounts[i] = rightCount;
+		}
+
+		AABB3Df left = GetEmptyBounds();
+		int leftCount = 0;
+		for (int i = 1; i < ourBinCount; ++i)
+		{
+			left.ExpandToInclude(bins[i - 1].myBounds);
+			leftCount += bins[i - 1].myCount;
+			if (leftCount == 0 || rightCounts[i] == 0)
+				continue;
+
+			const float cost = left.GetSurfaceArea() * leftCount + rightAreas[i] * rightCounts[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	auto begin = someItems.begin() + first;
+	auto end = begin + count;
+	int leftCount = count / 2;
+	if (bestAxis >= 0)
+	{
+		const float area = aBinning.myBounds.GetSurfaceArea();
+		const float splitCost = ourTraversalCost + ourIntersectionCost * (area > 0.f ? bestCost / area : (float)count);
+		const float leafCost = ourIntersectionCost * count;
+		if (splitCost >= leafCost && count <= ourMaxLeafSize)
+		{
+			MakeLeaf(someNodes, aNodeIndex, someItems);
+			return -1;
+		}
+
+		const BinMapping mapping(aBinning.myCentroidBounds);
+		auto split = std::partition(begin, end, [&](const BuildItem& anItem) { return mapping.GetBin(anItem, bestAxis) < bestBin; });
+		leftCount = (int)(split - begin);
+	}
+	else if (count <= ourMaxLeafSize)
+	{
+		// Every centroid is in the same place, nothing separates them
+		MakeLeaf(someNodes, aNodeIndex, someItems);
+		return -1;
+	}
+
+	const int leftIndex = (int)someNodes.size();
+	someNodes.emplace_back();
+	someNodes.emplace_back();
+
+	someNodes[leftIndex].myFirst = first;
+	someNodes[leftIndex].myCount = leftCount;
+	someNodes[leftIndex + 1].myFirst = first + leftCount;
+	someNodes[leftIndex + 1].myCount = count - leftCount;
+
+	someNodes[aNodeIndex].myFirst = leftIndex;
+	someNodes[aNodeIndex].myCount = 0;
+	return leftIndex;
+}
+
+void BVH::Subdivide(std::vector<Node>& someNodes, int aNodeIndex, std::vector<BuildItem>& someItems, int aDepth)
+{
+	Binning binning;
+	BinItems(someNodes[aNodeIndex], someItems, nullptr, binning);
+	const int left = Split(someNodes, aNodeIndex, someItems, binning, aDepth);
+	if (left < 0)
+		return;
+
+	Subdivide(someNodes, left, someItems, aDepth + 1);
+	Subdivide(someNodes, left + 1, someItems, aDepth + 1);
+}
+
+void BVH::Refit(const std::vector<BuildPrimitive>& somePrimitives)
+{
+	if (myNodes.empty())
+		return;
+
+	// Leaves refer to the primitives by their position in the order of their shape
+	std::vector<AABB3Df> sphereBounds(mySphereOrder.size());
+	std::vector<AABB3Df> aabbBounds(myAABBOrder.size());
+	std::vector<int> sphereSlots(mySphereOrder.size());
+	std::vector<int> aabbSlots(myAABBOrder.size());
+	for (size_t i = 0; i < mySphereOrder.size(); ++i)
+		sphereSlots[mySphereOrder[i]] = (int)i;
+	for (size_t i = 0; i < myAABBOrder.size(); ++i)
+		aabbSlots[myAABBOrder[i]] = (int)i;
+	for (const BuildPrimitive& primitive : somePrimitives)
+	{
+		if (primitive.myShape == PrimitiveShape::Sphere)
+			sphereBounds[sphereSlots[primitive.myIndex]] = primitive.myBounds;
+		else
+			aabbBounds[aabbSlots[primitive.myIndex]] = primitive.myBounds;
+	}
+
+	// Children always come after their parent, so going backwards finishes them first
+	for (int i = (int)myNodes.size() - 1; i >= 0; --i)
+	{
+		Node& node = myNodes[i];
+		AABB3Df bounds;
+		if (node.IsLeaf())
+		{
+			const std::vector<AABB3Df>& shapeBounds = node.myShape == PrimitiveShape::Sphere ? sphereBounds : aabbBounds;
+			bounds = shapeBounds[node.myFirst];
+			for (int primitive = node.myFirst + 1; primitive < node.myFirst + node.myCount; ++primitive)
+				bounds.ExpandToInclude(shapeBounds[primitive]);
+		}
+		else
+		{
+			bounds = myNodes[node.myFirst].myBounds;
+			bounds.ExpandToInclude(myNodes[node.myFirst + 1].myBounds);
+		}
+		node.myBounds = PadBounds(bounds);
+	}
+}
+
+float BVH::GetSAHCost() const
+{
+	if (myNodes.empty())
+		return 0.f;
+
+	const double rootArea = myNodes[0].myBounds.GetSurfaceArea();
+	if (rootArea <= 0.0)
+		return 0.f;
+
+	// Every node costs its traversal or intersections times the probability a ray through the root also passes through it
+	double cost = 0.0;
+	for (const Node& node : myNodes)
+	{
+		const double probability = node.myBounds.GetSurfaceArea() / rootArea;
+		cost += probability * (node.IsLeaf() ? ourIntersectionCost * node.myCount : ourTraversalCost);
+	}
+	return (float)cost;
+}
+
+bool BVH::Hit(const Ray& aRay, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const
+{
+	if (myNodes.empty())
+		return false;
+
+	struct StackEntry
+	{
+		int myNode;
+		float myNearT;
+	};
+	StackEntry stack[ourMaxDepth + 2];
+	int stackSize = 0;
+
+	Ray ray = aRay;
+	bool isHit = false;
+
+	float nearT, farT;
+	if (!CommonUtilities::IntersectionAABBRay(myNodes[0].myBounds, ray, nearT, farT))
+		return false;
+	stack[stackSize++] = { 0, nearT };
+
+	while (stackSize > 0)
+	{
+		const StackEntry entry = stack[--stackSize];
+		if (entry.myNearT > ray.GetMaxT())
+			continue;
+
+		const Node& node = myNodes[entry.myNode];
+		if (node.IsLeaf())
+		{
+			isHit |= aGeometry.Hit(node.myShape, node.myFirst, node.myCount, ray, aOutHit);
+			continue;
+		}
+
+		// Push the farther child first so the nearer one is visited first
+		float leftT, rightT;
+		bool hitLeft = CommonUtilities::IntersectionAABBRay(myNodes[node.myFirst].myBounds, ray, leftT, farT);
+		bool hitRight = CommonUtilities::IntersectionAABBRay(myNodes[node.myFirst + 1].myBounds, ray, rightT, farT);
+		if (hitLeft && hitRight)
+		{
+			if (leftT <= rightT)
+			{
+				stack[stackSize++] = { node.myFirst + 1, rightT };
+				stack[stackSize++] = { node.myFirst, leftT };
+			}
+			else
+			{
+				stack[stackSize++] = { node.myFirst, leftT };
+				stack[stackSize++] = { node.myFirst + 1, rightT };
+			}
+		}
+		else if (hitLeft)
+			stack[stackSize++] = { node.myFirst, leftT };
+		else if (hitRight)
+			stack[stackSize++] = { node.myFirst + 1, rightT };
+	}
+
+	return isHit;
+}
+
+bool BVH::Occluded(const Ray& aRay, const SceneGeometry& aGeometry) const
+{
+	if (myNodes.empty())
+		return false;
+
+	int stack[ourMaxDepth + 2];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		const Node& node = myNodes[stack[--stackSize]];
+
+		float nearT, farT;
+		if (!CommonUtilities::IntersectionAABBRay(node.myBounds, aRay, nearT, farT))
+			continue;
+
+		if (node.IsLeaf())
+		{
+			if (aGeometry.Occluded(node.myShape, node.myFirst, node.myCount, aRay))
+				return true;
+			continue;
+		}
+
+		stack[stackSize++] = node.myFirst + 1;
+		stack[stackSize++] = node.myFirst;
+	}
+
+	return false;
+}
@@ -0,0 +1,440 @@
+#pragma once
+
+#include "CScene.h"
+#include "Film.h"
+
+// stdlib
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cmath>
+#include <memory>
+#include <utility>
+
+// Run with "--benchmark [scene.txt]" to time the ray queries of the scalar and the wide BVH on the same rays,
+// tracing camera and shadow rays one at a time and as packets, incoherent rays one at a time and interleaved, the BVH build serially
+// and on every hardware thread, the camera ray setup with scalar and SSE vector math, and rendering with every light selection as the number of lights grows
+namespace Benchmark
+{
+	struct TraversalResult
+	{
+		double mySeconds = 0.0;
+		int myHitCount = 0;
+		double myDistanceSum = 0.0;
+	};
+
+	// Primary rays through random pixels plus one diffuse bounce from every primary hit
+	inline std::vector<Ray> CreateRays(CScene& aScene, int aWidth, int aHeight, int aCount)
+	{
+		std::vector<Ray> rays;
+		rays.reserve(aCount * 2);
+		for (int i = 0; i < aCount; ++i)
+		{
+			const float x = RandomFloat() * aWidth;
+			const float y = RandomFloat() * aHeight;
+			const float lensU = RandomFloat();
+			const float lensV = RandomFloat();
+			Ray ray = aScene.CreateCameraRay(x, y, { lensU, lensV });
+			rays.push_back(ray);
+
+			SurfaceHit hit;
+			if (aScene.Hit(ray, hit))
+			{
+				Ray bounce;
+				bounce.InitWithOriginAndDirection(hit.myPoint + hit.myNormal * 0.001f, hit.myNormal + RandomUnitVector3());
+				rays.push_back(bounce);
+			}
+		}
+		return rays;
+	}
+
+	inline TraversalResult TimeTraversal(CScene& aScene, const std::vector<Ray>& someRays)
+	{
+		TraversalResult result;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (const Ray& ray : someRays)
+		{
+			SurfaceHit hit;
+			if (aScene.Hit(ray, hit))
+			{
+				++result.myHitCount;
+				result.myDistanceSum += (hit.myPoint - ray.GetOrigin()).Length();
+			}
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		result.mySeconds = std::chrono::duration<double>(end - start).count();
+		return result;
+	}
+
+	inline void RunTraversal(CScene& aScene, const std::string& aLabel, int aWidth, int aHeight)
+	{
+		const int rayCount = 200000;
+
+		aScene.SetUseWideBVH(false);
+		std::vector<Ray> rays = CreateRays(aScene, aWidth, aHeight, rayCount);
+
+		TraversalResult scalar = TimeTraversal(aScene, rays);
+		aScene.SetUseWideBVH(true);
+		TraversalResult wide = TimeTraversal(aScene, rays);
+
+		std::cout << aLabel << ": " << rays.size() << " rays\n"
+			<< "  scalar BVH: " << rays.size() / scalar.mySeconds / 1e6 << " Mrays/s, " << scalar.myHitCount << " hits\n"
+			<< "  wide BVH:   " << rays.size() / wide.mySeconds / 1e6 << " Mrays/s, " << wide.myHitCount << " hits\n"
+			<< "  speedup:    " << scalar.mySeconds / wide.mySeconds << "x\n";
+
+		if (scalar.myHitCount != wide.myHitCount)
+			std::cout << "  WARNING: hit counts differ, summed distances " << scalar.myDistanceSum << " vs " << wide.myDistanceSum << "\n";
+	}
+
+	// Camera rays of every pixel of a 4x coarser grid, a packet of them per pixel, and a shadow ray from every hit towards one direction,
+	// traced one at a time and in packets
+	inline void RunPackets(CScene& aScene, int aWidth, int aHeight)
+	{
+		const int packetSize = RayPacket::ourLaneCount;
+		std::unique_ptr<Sampler> sampler = CreateSampler(SamplerType::Sobol);
+		std::vector<Ray> cameraRays;
+		for (int y = 0; y < aHeight; y += 4)
+			for (int x = 0; x < aWidth; x += 4)
+				for (int i = 0; i < packetSize; ++i)
+					cameraRays.push_back(aScene.CreatePixelRay(x, y, i, *sampler));
+
+		const int count = (int)cameraRays.size();
+		std::vector<SurfaceHit> hits(count);
+		std::unique_ptr<bool[]> isHit(new bool[count]);
+		std::unique_ptr<bool[]> isPacketHit(new bool[count]);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; ++i)
+			isHit[i] = aScene.Hit(cameraRays[i], hits[i]);
+		const double singleSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		std::vector<SurfaceHit> packetHits(count);
+		start = std::chrono::high_resolution_clock::now();
+		aScene.Hit(cameraRays.data(), count, packetHits.data(), isPacketHit.get());
+		const double packetSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		int mismatches = 0;
+		std::vector<Ray> shadowRays;
+		std::vector<float> shadowMaxTs;
+		const Vector3f toLight = Vector3f(-1.5f, 1.f, -0.5f).GetNormalized();
+		for (int i = 0; i < count; ++i)
+		{
+			if (isHit[i] != isPacketHit[i] || (isHit[i] && (hits[i].myPoint - packetHits[i].myPoint).LengthSqr() > 1e-6f))
+				++mismatches;
+			Ray shadowRay;
+			shadowRay.InitWithOriginAndDirection(isHit[i] ? hits[i].myPoint + hits[i].myNormal * 0.001f : cameraRays[i].GetOrigin(), toLight);
+			shadowRays.push_back(shadowRay);
+			shadowMaxTs.push_back(std::numeric_limits<float>::infinity());
+		}
+
+		std::unique_ptr<bool[]> isOccluded(new bool[count]);
+		std::unique_ptr<bool[]> isPacketOccluded(new bool[count]);
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; ++i)
+			isOccluded[i] = aScene.Occluded(shadowRays[i], shadowMaxTs[i]);
+		const double singleShadowSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		aScene.Occluded(shadowRays.data(), shadowMaxTs.data(), count, isPacketOccluded.get());
+		const double packetShadowSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		for (int i = 0; i < count; ++i)
+		{
+			if (isOccluded[i] != isPacketOccluded[i])
+				++mismatches;
+		}
+
+		std::cout << "  " << packetSize << "-ray packets, " << count << " camera and shadow rays\n"
+			<< "  camera rays, single: " << count / singleSeconds / 1e6 << " Mrays/s, packets: " << count / packetSeconds / 1e6 << " Mrays/s, speedup " << singleSeconds / packetSeconds << "x\n"
+			<< "  shadow rays, single: " << count / singleShadowSeconds / 1e6 << " Mrays/s, packets: " << count / packetShadowSeconds / 1e6 << " Mrays/s, speedup " << singleShadowSeconds / packetShadowSeconds << "x\n";
+		if (mismatches > 0)
+			std::cout << "  WARNING: " << mismatches << " rays found different hits\n";
+	}
+
+	// The rays of CreateRays point every way, so the batch queries trace almost all of them interleaved instead of in packets
+	inline void RunInterleaved(CScene& aScene, int aWidth, int aHeight)
+	{
+		std::vector<Ray> rays = CreateRays(aScene, aWidth, aHeight, 200000);
+		const int count = (int)rays.size();
+
+		std::vector<SurfaceHit> hits(count);
+		std::unique_ptr<bool[]> isHit(new bool[count]);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; ++i)
+			isHit[i] = aScene.Hit(rays[i], hits[i]);
+		const double singleSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		aScene.SetUseInterleavedTraversal(true);
+		std::vector<SurfaceHit> interleavedHits(count);
+		std::unique_ptr<bool[]> isInterleavedHit(new bool[count]);
+		start = std::chrono::high_resolution_clock::now();
+		aScene.Hit(rays.data(), count, interleavedHits.data(), isInterleavedHit.get());
+		const double interleavedSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		aScene.SetUseInterleavedTraversal(false);
+
+		// The same nodes are visited in the same order, the hits have to match exactly
+		int mismatches = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			if (isHit[i] != isInterleavedHit[i] || (isHit[i] && !(hits[i].myPoint == interleavedHits[i].myPoint)))
+				++mismatches;
+		}
+
+		std::cout << "  " << WideBVH::ourInterleavedRayCount << " rays interleaved, " << count << " incoherent rays\n"
+			<< "  single: " << count / singleSeconds / 1e6 << " Mrays/s, interleaved: " << count / interleavedSeconds / 1e6 << " Mrays/s, speedup " << singleSeconds / interleavedSeconds << "x\n";
+		if (mismatches > 0)
+			std::cout << "  WARNING: " << mismatches << " rays found different hits\n";
+	}
+
+	// Builds the BVH over the bounds of random spheres and boxes, like those of GenerateScene, serially and on a thread pool
+	inline void RunBuild()
+	{
+		ThreadPool threadPool(0, false);
+		for (int primitiveCount : { 100000, 1000000 })
+		{
+			std::vector<BVH::BuildPrimitive> primitives;
+			primitives.reserve(primitiveCount);
+			for (int i = 0; i < primitiveCount; ++i)
+			{
+				const Vector3f center(RandomFloat() * 16.f - 8.f, RandomFloat() * 20.f - 10.f, RandomFloat() * 20.f);
+				const float size = 0.02f + RandomFloat() * 0.2f;
+				const float halfSize = i % 2 == 0 ? size : size * 0.5f; // sphere radius or half a box side
+				const Vector3f extent(halfSize, halfSize, halfSize);
+				primitives.push_back({ BVH::AABB3Df(center - extent, center + extent), i % 2 == 0 ? PrimitiveShape::Sphere : PrimitiveShape::AABB, i });
+			}
+
+			BVH serial;
+			auto start = std::chrono::high_resolution_clock::now();
+			serial.Build(primitives);
+			const double serialSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+			BVH parallel;
+			start = std::chrono::high_resolution_clock::now();
+			parallel.Build(primitives, &threadPool);
+			const double parallelSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+			std::cout << "BVH build over " << primitiveCount << " primitives: " << parallel.GetNodeCount() << " nodes, SAH cost " << parallel.GetSAHCost() << "\n"
+				<< "  serial: " << serialSeconds * 1e3 << " ms, " << threadPool.GetWorkerCount() << " threads: " << parallelSeconds * 1e3 << " ms, speedup " << serialSeconds / parallelSeconds << "x\n";
+			if (serial.GetNodeCount() != parallel.GetNodeCount() || serial.GetSAHCost() != parallel.GetSAHCost())
+				std::cout << "  WARNING: the trees differ, " << serial.GetNodeCount() << " nodes with SAH cost " << serial.GetSAHCost() << " serially\n";
+		}
+	}
+
+	// Plain three float vector math, as Vector3<float> was before it got an SSE register, kept to compare against
+	struct ScalarVector3
+	{
+		float x, y, z;
+	};
+
+	inline ScalarVector3 operator+(const ScalarVector3& aLeft, const ScalarVector3& aRight) { return { aLeft.x + aRight.x, aLeft.y + aRight.y, aLeft.z + aRight.z }; }
+	inline ScalarVector3 operator-(const ScalarVector3& aLeft, const ScalarVector3& aRight) { return { aLeft.x - aRight.x, aLeft.y - aRight.y, aLeft.z - aRight.z }; }
+	inline ScalarVector3 operator*(const ScalarVector3& aVector, float aScalar) { return { aVector.x * aScalar, aVector.y * aScalar, aVector.z * aScalar }; }
+
+	inline ScalarVector3 GetNormalized(const ScalarVector3& aVector)
+	{
+		auto length = [&aVector]() { return std::sqrt(aVector.x * aVector.x + aVector.y * aVector.y + aVector.z * aVector.z); };
+		if (aVector.x == 0 && aVector.y == 0 && aVector.z == 0)
+			return ScalarVector3{ 0.f, 0.f, 0.f };
+		return { aVector.x / length(), aVector.y / length(), aVector.z / length() };
+	}
+
+	// Sets up camera rays the way CScene::CreateCameraRay and Ray do, once with ScalarVector3 and once with Vector3<float>
+	inline void RunVectorMath()
+	{
+		const int rayCount = 10000000;
+		std::vector<float> coordinates(2 * 1024);
+		for (float& coordinate : coordinates)
+			coordinate = RandomFloat() * 2.f - 1.f;
+
+		const ScalarVector3 scalarPos = { 0.f, 1.5f, -3.f }, scalarRight = { 1.f, 0.f, 0.f }, scalarUp = { 0.f, 1.f, 0.f }, scalarForward = { 0.f, 0.f, 1.f };
+		ScalarVector3 scalarSum = { 0.f, 0.f, 0.f };
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < rayCount; ++i)
+		{
+			const float x = coordinates[(2 * i) & 2047];
+			const float y = coordinates[(2 * i + 1) & 2047];
+			ScalarVector3 pointOnDof = scalarPos + (scalarForward + scalarRight * x + scalarUp * y) * 3.f;
+			ScalarVector3 direction = GetNormalized(pointOnDof - scalarPos);
+			ScalarVector3 inverseDirection = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+			scalarSum = scalarSum + (direction + inverseDirection);
+		}
+		const double scalarSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		const Vector3f pos(0.f, 1.5f, -3.f), right(1.f, 0.f, 0.f), up(0.f, 1.f, 0.f), forward(0.f, 0.f, 1.f);
+		Vector3f simdSum;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < rayCount; ++i)
+		{
+			const float x = coordinates[(2 * i) & 2047];
+			const float y = coordinates[(2 * i + 1) & 2047];
+			Ray ray(pos, pos + (forward + right * x + up * y) * 3.f);
+			simdSum += ray.GetDirection() + ray.GetInverseDirection();
+		}
+		const double simdSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		// The sums keep the loops from being optimized away, they only differ by the rounding of the reciprocal square root
+		std::cout << "camera ray setup: " << rayCount << " rays\n"
+			<< "  scalar Vector3: " << scalarSeconds / rayCount * 1e9 << " ns/ray (sum " << scalarSum.x + scalarSum.y + scalarSum.z << ")\n"
+			<< "  SSE Vector3:    " << simdSeconds / rayCount * 1e9 << " ns/ray (sum " << simdSum.x + simdSum.y + simdSum.z << ")\n"
+			<< "  speedup:        " << scalarSeconds / simdSeconds << "x\n";
+	}
+
+	// The room of the sample scene filled with randomly placed small spheres and boxes
+	// aSizeScale shrinks the primitives, small ones let rays travel through much more of the BVH before they hit
+	inline std::string GenerateScene(int aPrimitiveCount, float aSizeScale = 1.f)
+	{
+		std::stringstream scene;
+		scene << "camera 0 1.5 -3 1 0 0 0 1 0 0 0 1\n";
+		scene << "directional_light 1.5 -1 0.5 1.0 0.9 0.5\n";
+		scene << "sky 0.4 0.6 0.8 0.02 0.1 0.5\n";
+		scene << "material wall normal 0.6 0.6 0.6\n";
+		scene << "material warm normal 0.8 0.5 0.3\n";
+		scene << "material cold normal 0.3 0.6 0.8\n";
+		scene << "aabb wall 0 15  0 100 1 100\n";
+		scene << "aabb wall 0 -15 0 100 1 100\n";
+
+		for (int i = 0; i < aPrimitiveCount; ++i)
+		{
+			float x = RandomFloat() * 16.f - 8.f;
+			float y = RandomFloat() * 20.f - 10.f;
+			float z = RandomFloat() * 20.f;
+			float size = (0.02f + RandomFloat() * 0.2f) * aSizeScale;
+			if (i % 2 == 0)
+				scene << "sphere warm " << x << " " << y << " " << z << " " << size << "\n";
+			else
+				scene << "aabb cold " << x << " " << y << " " << z << " " << size << " " << size << " " << size << "\n";
+		}
+		return scene.str();
+	}
+
+	// A floor lit by a layer of small emissive spheres above the camera, which looks down so none of them is in view.
+	// Their total power is the same for any count, and their colors come from a few shades so they share materials.
+	inline std::string GenerateLightScene(int aLightCount)
+	{
+		std::stringstream scene;
+		scene << "camera 0 1.5 -3 1 0 0 0 0.8 0.6 0 -0.6 0.8\n";
+		scene << "sky 0 0 0 0 0 0\n";
+		scene << "material wall normal 0.6 0.6 0.6\n";
+		scene << "aabb wall 0 -1 10 40 1 40\n";
+
+		const float radiance = 100000.f / aLightCount;
+		const Vector3f shades[] = { { 1.f, 0.9f, 0.7f }, { 1.f, 0.4f, 0.2f }, { 0.3f, 0.6f, 1.f }, { 0.6f, 1.f, 0.5f } };
+		for (int i = 0; i < aLightCount; ++i)
+		{
+			float x = RandomFloat() * 30.f - 15.f;
+			float y = RandomFloat() * 2.f + 2.f;
+			float z = RandomFloat() * 30.f - 2.f;
+			const Vector3f color = shades[i % 4] * radiance;
+			scene << "sphere emissive " << x << " " << y << " " << z << " 0.03 " << color.x << " " << color.y << " " << color.z << "\n";
+		}
+		return scene.str();
+	}
+
+	// Renders a small image of the generated light scenes on one thread with every light selection.
+	// Time per sample should stay nearly flat with the light count, while the error shows how good the picked lights are.
+	inline void RunLightSelection(int aWidth, int aHeight)
+	{
+		const int width = aWidth / 4;
+		const int height = aHeight / 4;
+		const int samplesPerPixel = 8;
+		const std::pair<LightSelectionType, const char*> types[] = { { LightSelectionType::Uniform, "uniform" }, { LightSelectionType::Power, "power  " }, { LightSelectionType::Tree, "tree   " } };
+
+		for (int lightCount : { 100, 1000, 10000, 100000 })
+		{
+			const std::string sceneText = GenerateLightScene(lightCount);
+			std::cout << "generated scene with " << lightCount << " lights: " << width << "x" << height << ", " << samplesPerPixel << " samples per pixel\n";
+			for (const auto& type : types)
+			{
+				RenderSettings settings;
+				settings.myLightSelection = type.first;
+				CScene scene(width, height);
+				scene.SetRenderSettings(settings);
+
+				std::stringstream sceneStream(sceneText);
+				auto coutBuffer = std::cout.rdbuf(nullptr);
+				const auto loadStart = std::chrono::high_resolution_clock::now();
+				scene.Load(sceneStream);
+				const double loadSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - loadStart).count();
+				std::cout.rdbuf(coutBuffer);
+				std::cout.clear();
+
+				Film film(width, height);
+				std::unique_ptr<Sampler> sampler = CreateSampler(SamplerType::Sobol);
+				const auto start = std::chrono::high_resolution_clock::now();
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+						for (int i = 0; i < samplesPerPixel; ++i)
+							film.AddSample(x, y, scene.Sample(x, y, i, *sampler));
+				const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+				// Standard error of the image's pixels relative to its mean luminance
+				double luminanceSum = 0.0;
+				double varianceSum = 0.0;
+				for (int y = 0; y < height; ++y)
+				{
+					for (int x = 0; x < width; ++x)
+					{
+						const Vector3f color = film.GetColor(x, y);
+						luminanceSum += 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+						varianceSum += film.GetMeanVariance(x, y);
+					}
+				}
+
+				std::cout << "  " << type.second << ": " << seconds / (width * height * samplesPerPixel) * 1e6 << " us/sample, relative error "
+					<< std::sqrt(varianceSum * width * height) / luminanceSum << ", load " << loadSeconds * 1e3 << " ms\n";
+			}
+		}
+	}
+
+	inline void Run(const std::string& aSceneFile, int aWidth, int aHeight)
+	{
+		RunVectorMath();
+
+		{
+			CScene scene(aWidth, aHeight);
+			if (scene.Load(aSceneFile.c_str()))
+			{
+				RunTraversal(scene, aSceneFile, aWidth, aHeight);
+				RunPackets(scene, aWidth, aHeight);
+				RunInterleaved(scene, aWidth, aHeight);
+			}
+			else
+				std::cout << "Coudn't open: " << aSceneFile << "\n";
+		}
+
+		for (int primitiveCount : { 1000, 10000, 100000 })
+		{
+			std::stringstream sceneText(GenerateScene(primitiveCount));
+			CScene scene(aWidth, aHeight);
+
+			// Loading prints every primitive, keep the benchmark output readable
+			auto coutBuffer = std::cout.rdbuf(nullptr);
+			scene.Load(sceneText);
+			std::cout.rdbuf(coutBuffer);
+			std::cout.clear();
+
+			RunTraversal(scene, "generated scene with " + std::to_string(primitiveCount) + " primitives", aWidth, aHeight);
+			RunPackets(scene, aWidth, aHeight);
+			RunInterleaved(scene, aWidth, aHeight);
+		}
+
+		{
+			// Far larger than the cache, where interleaving hides the latency of the node loads
+			const int primitiveCount = 1000000;
+			std::stringstream sceneText(GenerateScene(primitiveCount, 0.05f));
+			CScene scene(aWidth, aHeight);
+			auto coutBuffer = std::cout.rdbuf(nullptr);
+			scene.Load(sceneText);
+			std::cout.rdbuf(coutBuffer);
+			std::cout.clear();
+
+			std::cout << "generated scene with " << primitiveCount << " small primitives\n";
+			RunInterleaved(scene, aWidth, aHeight);
+		}
+
+		RunBuild();
+		RunLightSelection(aWidth, aHeight);
+	}
+}
@@ -1,6 +1,19 @@
 #pragma once
 
 #include "Util.h"
+#include "Material.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "Lights.h"
+#include "Sampler.h"
+#include "Film.h"
+#include "PathGuide.h"
+#include "RadianceCache.h"
+#include "CausticPhotonMap.h"
+#include "DirectLightResampling.h"
+#include "LightSelection.h"
+#include "ThreadPool.h"
+#include "Animation.h"
 
 // CommonUtilities
 #include "Vector3.hpp"
@@ -20,120 +33,98 @@
 #include <vector>
 #include <limits>
 #include <iostream>
-
-constexpr float PI = 3.14159265358979323846f;
+#include <algorithm>
+#include <memory>
+#include <chrono>
 
 using Vector3f = CommonUtilities::Vector3<float>;
 using Vector2f = CommonUtilities::Vector2<float>;
 using Ray = CommonUtilities::Ray<float>;
+// Rays traced together, 4, 8 or 16 of them with the lanes of the widest instruction set the build targets
+using RayPacket = CommonUtilities::RayPacket<CommonUtilities::FloatLanes>;
 
-Vector2f RandomVector2OnDisc()
+// Maps a uniform sample in [0, 1)^2 to the unit disc, preserving area
+Vector2f SampleDisc(const Vector2f& aSample)
 {
-	float randomRadian = RandomFloat() * 2.f * PI;
-	float randomRadius = std::sqrtf(RandomFloat());
-	return { randomRadius * std::cosf(randomRadian), randomRadius * std::sinf(randomRadian) };
+	float radian = aSample.x * 2.f * PI;
+	float radius = std::sqrtf(aSample.y);
+	return { radius * std::cosf(radian), radius * std::sinf(radian) };
 }
 
-Vector3f RandomUnitVector3()
+// Maps a uniform sample in [0, 1)^2 to the unit sphere, preserving area
+Vector3f SampleUnitVector3(const Vector2f& aSample)
 {
-	float z = RandomFloat() * 2.0f - 1.0f;
-	float a = RandomFloat() * 2.0f * PI;
+	float z = aSample.x * 2.0f - 1.0f;
+	float a = aSample.y * 2.0f * PI;
 	float r = sqrtf(1.0f - z * z);
 	float x = r * cosf(a);
 	float y = r * sinf(a);
 	return Vector3f(x, y, z);
 }
 
-enum class MaterialType
-{
-	Normal,
-	Mirror,
-	Emissive,
-	Glass
-};
-
-struct Primitive
+Vector3f RandomUnitVector3()
 {
-	virtual ~Primitive() = default;
-
-	virtual bool Hit(const Ray& aRay, Vector3f& hit, Vector3f& normal) const = 0;
-
-	virtual Vector3f GetColor() const = 0;
-	virtual MaterialType GetMaterialType() const = 0;
-	virtual void SetMaterialType(const MaterialType) = 0;
-	virtual float GetRefractiveIndex() const = 0;
-	virtual void SetRefractionIndex(const float) = 0;
-};
+	float u = RandomFloat();
+	float v = RandomFloat();
+	return SampleUnitVector3({ u, v });
+}
 
-struct Sphere : public Primitive
+struct Sphere
 {
-	virtual Vector3f GetColor() const override
-	{
-		return myColor;
-	}
-	virtual MaterialType GetMaterialType() const override
+	CommonUtilities::AABB3D<float> GetBounds() const
 	{
-		return myType;
-	}
-	virtual void SetMaterialType(const MaterialType aType)
-	{
-		myType = aType;
-	}
-	virtual float GetRefractiveIndex() const override
-	{
-		return myRefractiveIndex;
-	}
-	virtual void SetRefractionIndex(const float aRefrIndex)
-	{
-		myRefractiveIndex = aRefrIndex;
-	}
-
-	virtual bool Hit(const Ray& aRay, Vector3f& hit, Vector3f& normal) const
-	{
-		if (!CommonUtilities::IntersectionSphereRay(mySphere, aRay, hit))
-			return false;
-		normal = (hit - mySphere.GetCenter()).GetNormalized();
-		return true;
+		Vector3f radius(mySphere.GetRadius(), mySphere.GetRadius(), mySphere.GetRadius());
+		return CommonUtilities::AABB3D<float>(mySphere.GetCenter() - radius, mySphere.GetCenter() + radius);
 	}
 
 	CommonUtilities::Sphere<float> mySphere;
-	Vector3f myColor;
-	MaterialType myType;
-	float myRefractiveIndex = 1.f;
+	MaterialID myMaterial = 0;
 };
 
-struct AABB : public Primitive
+struct AABB
 {
-	virtual Vector3f GetColor() const override
-	{
-		return myColor;
-	}
-	virtual MaterialType GetMaterialType() const override
-	{
-		return myType;
-	}
-	virtual float GetRefractiveIndex() const override
-	{
-		return myRefractiveIndex;
-	}
-	virtual void SetMaterialType(const MaterialType aType)
-	{
-		myType = aType;
-	}
-	virtual void SetRefractionIndex(const float aRefrIndex)
-	{
-		myRefractiveIndex = aRefrIndex;
-	}
+	CommonUtilities::AABB3D<float> myAABB;
+	MaterialID myMaterial = 0;
+};
 
-	virtual bool Hit(const Ray& aRay, Vector3f& hit, Vector3f& normal) const
-	{
-		return CommonUtilities::IntersectionAABBRay(myAABB, aRay, hit, normal);
-	}
+// The closest hit along a ray, its attributes are only calculated once traversal is done
+struct SurfaceHit
+{
+	Vector3f myPoint;
+	Vector3f myNormal;
+	MaterialID myMaterial;
+	int myLight; // index into the scene's area lights for emissive primitives, else -1
+};
 
-	CommonUtilities::AABB3D<float> myAABB;
-	Vector3f myColor;
-	MaterialType myType;
-	float myRefractiveIndex = 1.f;
+// The shadow ray of a light sample and the light it brings if nothing is in the way
+struct ShadowQuery
+{
+	Ray myRay;
+	float myMaxT;
+	Vector3f myRadiance;
+};
+
+// A path between two bounces
+struct PathState
+{
+	Ray myRay;
+	Vector3f myThroughput = Vector3f(1.f, 1.f, 1.f); // what the path so far multiplies the light found along myRay with
+	Vector3f myRadiance; // light gathered so far, already multiplied by the throughput it was found with
+	float myDiffusePdf = 0.f; // solid angle density a diffuse bounce picked myRay with, 0 for camera rays and specular bounces
+	Vector3f myDiffuseNormal; // at the diffuse vertex myRay left from, light selection there depended on it
+	int myDepth = 0;
+	bool myIsDone = false;
+	FeatureSample* myFeatures = nullptr; // filled in at the first vertex that isn't a mirror or glass, then cleared
+	PathGuide::TrainingBuffer* myTraining = nullptr; // records the path's diffuse bounces for the path guide
+	RadianceCache::PathRecord* myCacheRecord = nullptr; // the path's diffuse vertices, added to the radiance cache when it ends
+	bool myCanEndAtCache = false;
+	bool myHasDiffuseVertex = false;
+	int myPixel = -1; // y * width + x of the camera sample, -1 for paths that don't start at a pixel
+	bool myIsLightResampled = false; // area lights the next hit finds were already accounted for by resampled direct light
+	// Where ShadeHit leaves its shadow rays for the caller to trace, with their light already times the throughput, room for 2.
+	// Null traces them right away.
+	ShadowQuery* myDeferredShadows = nullptr;
+	int myDeferredShadowCount = 0;
 };
 
 struct Camera
@@ -156,29 +147,143 @@ struct Light
 	Vector3f myColor;
 };
 
+// Paths always continue for myMinBounces, after that Russian roulette ends them with a probability based on their throughput.
+// Surviving paths are weighted up by one over their survival probability, so the estimate stays unbiased.
+struct RenderSettings
+{
+	int myRaysPerPixel = 100;
+	int myMaxBounces = 16;
+	int myMinBounces = 3;
+	bool myUseRussianRoulette = true;
+	// The survival probability is the largest throughput component times myThroughputScale, clamped to this range.
+	// The sky is brighter than 1, so paths are still worth following a while after their throughput drops below it.
+	float myThroughputScale = 4.f;
+	float myMinSurvival = 0.05f;
+	float myMaxSurvival = 0.95f;
+	// How light samples pick one of the area lights, built by Load
+	LightSelectionType myLightSelection = LightSelectionType::Uniform;
+};
 
 class CScene
 {
 public:
 	CScene(int width, int height);
-	bool Load(const char* filename);
-	inline SRGB Raytrace(int x, int y);
-	inline Vector3f Raytrace(const Ray& aRay, int aRemainingBounces);
+	// The BVH is built on aThreadPool when given, serially otherwise
+	bool Load(const char* filename, ThreadPool* aThreadPool = nullptr);
+	bool Load(std::istream& aStream, ThreadPool* aThreadPool = nullptr);
+	inline SRGB Raytrace(int x, int y, Sampler& aSampler);
+	// Anti-aliased camera sample aSampleIndex of the pixel, Raytrace(x, y) averages RenderSettings::myRaysPerPixel of them
+	inline Vector3f Sample(int x, int y, int aSampleIndex, Sampler& aSampler, FeatureSample* anOutFeatures = nullptr, PathGuide::TrainingBuffer* aTraining = nullptr);
+	// Samples aFirstSample to aFirstSample + aCount - 1 of the pixel, like Sample, with the first hits of their camera rays found a packet at a time
+	inline void SampleBatch(int x, int y, int aFirstSample, int aCount, Sampler& aSampler, Vector3f* someOutColors, FeatureSample* someOutFeatures = nullptr, PathGuide::TrainingBuffer* aTraining = nullptr);
+	// Starts aSampler on the pixel sample and returns its anti-aliased camera ray
+	inline Ray CreatePixelRay(int x, int y, int aSampleIndex, Sampler& aSampler);
+	// aLensSample in [0, 1)^2 picks the ray origin on the lens
+	inline Ray CreateCameraRay(float aX, float aY, const Vector2f& aLensSample);
+	// Follows the path from aRay bounce by bounce until it leaves the scene, runs out of bounces or is ended by Russian roulette
+	inline Vector3f Raytrace(const Ray& aRay, const Sampler& aSampler, FeatureSample* anOutFeatures = nullptr, PathGuide::TrainingBuffer* aTraining = nullptr, int aPixel = -1);
+	// The start and the end of Raytrace, for integrators that advance many paths a bounce at a time.
+	// aCacheRecord holds the path's radiance cache vertices until FinishPath, it is only used with the cache enabled.
+	inline void InitializePath(PathState& aPath, const Ray& aRay, int aPixel, FeatureSample* anOutFeatures, PathGuide::TrainingBuffer* aTraining, RadianceCache::PathRecord* aCacheRecord);
+	inline void FinishPath(const PathState& aPath);
+	inline MaterialType GetMaterialType(const SurfaceHit& aHit) const { return myMaterials[aHit.myMaterial].myType; }
+	// One bounce of aPath: adds the light found at aHit and replaces the path's ray with the next one, or marks the path done
+	inline void ShadeHit(PathState& aPath, const SurfaceHit& aHit, const Sampler& aSampler);
+	// aPath left the scene, adds the sky and marks the path done
+	inline void ShadeMiss(PathState& aPath);
 	inline Vector3f CalculateSkyColor(const float anY);
-	inline bool Hit(const Ray& aRay, Primitive*& aOutPrimitive, Vector3f& aOutHit, Vector3f& anOutNormal);
+	inline bool Hit(const Ray& aRay, SurfaceHit& aOutHit);
+	// Any hit closer than aMaxT, no hit point or normal is calculated
+	inline bool Occluded(const Ray& aRay, float aMaxT);
+	// The same for aCount rays. Packets of rays that point into the same octant are traced together through the wide BVH,
+	// rays that diverge more than that fall back to being traced one at a time, or to interleaved traversal for closest hits.
+	inline void Hit(const Ray* someRays, int aCount, SurfaceHit* someOutHits, bool* someOutIsHit);
+	inline void Occluded(const Ray* someRays, const float* someMaxTs, int aCount, bool* someOutIsOccluded);
+
+	inline void SetUseWideBVH(const bool aUseWideBVH) { myUseWideBVH = aUseWideBVH; }
+	// Traces the rays of batch closest hit queries that don't fit a packet a group at a time, switching between them at every step to hide cache misses.
+	// Only pays off on scenes larger than the cache, and shadow rays end at their first hit too soon to gain from it.
+	inline void SetUseInterleavedTraversal(const bool aUseInterleavedTraversal) { myUseInterleavedTraversal = aUseInterleavedTraversal; }
+	inline void SetRenderSettings(const RenderSettings& someSettings) { mySettings = someSettings; }
+	// Fits the path guide's grid to where camera rays and their first bounce hit the scene, call after Load
+	void InitializePathGuide(const PathGuide::Settings& someSettings);
+	inline PathGuide& GetPathGuide() { return myPathGuide; }
+	inline void InitializeRadianceCache(const RadianceCache::Settings& someSettings) { myRadianceCache.Initialize(someSettings, myCamera.myPos); }
+	inline const RadianceCache& GetRadianceCache() const { return myRadianceCache; }
+	// Traces photons from the lights through mirrors and glass, diffuse surfaces then take caustics from them instead of from paths that hit a light
+	void BuildCausticPhotonMap(const CausticPhotonMap::Settings& someSettings, ThreadPool& aThreadPool);
+	inline const CausticPhotonMap& GetCausticPhotonMap() const { return myCausticPhotons; }
+	// Per pixel reservoirs for the direct light of the first diffuse hit, reused across neighbouring pixels and passes
+	inline void InitializeDirectLightResampling(const DirectLightResampling::Settings& someSettings) { myDirectLightResampling.Initialize(myWidth, myHeight, someSettings); }
+	inline DirectLightResampling& GetDirectLightResampling() { return myDirectLightResampling; }
+	inline const RenderSettings& GetRenderSettings() const { return mySettings; }
+	// 1 unless the scene file animates its primitives
+	inline int GetFrameCount() const { return myFrameCount; }
+	// Moves the animated primitives to where they are at aFrame, and refits or rebuilds the BVH around them.
+	// Builds serially, it is meant to run beside the rendering of another copy of the scene.
+	Animation::FrameUpdate SetFrame(int aFrame, const Animation::Settings& someSettings);
 
 private:
+	void BuildAccelerationStructures(ThreadPool* aThreadPool);
+	std::vector<BVH::BuildPrimitive> GetBuildPrimitives() const;
+	// Copies the spheres and AABBs into myGeometry in the order of the BVH's leaves
+	void FillGeometry();
+	// Bounces aPath until it leaves the scene, runs out of bounces or is ended by Russian roulette
+	inline void TracePath(PathState& aPath, const Sampler& aSampler);
+	inline void GetSurfaceHit(const Ray& aRay, const GeometryHit& aHit, SurfaceHit& aOutHit) const;
+	// Fills aOutPacket with up to RayPacket::ourLaneCount rays, false if they don't point into the same octant
+	static inline bool CreatePacket(const Ray* someRays, int aCount, RayPacket& aOutPacket);
+	// Traces the rays of someRays at someIndices interleaved through the wide BVH, up to WideBVH::ourInterleavedRayCount of them
+	inline void HitInterleaved(const Ray* someRays, const int* someIndices, int aCount, SurfaceHit* someOutHits, bool* someOutIsHit);
+	void BuildAreaLights();
+	// Follows a photon through mirrors and glass, and stores it where it lands on a diffuse surface after at least one of them
+	void TracePhoton(Ray aRay, Vector3f aPower, const Sampler& aSampler, std::vector<CausticPhotonMap::Photon>& someOutPhotons);
+	// Light a surface of anAlbedo at aPoint reflects from one sampled area light, weighted against finding it with a diffuse bounce,
+	// and the shadow ray it needs. False if the sample can't bring any light.
+	// aGuideCell is the trained path guide cell the bounce samples, or -1.
+	inline bool SampleAreaLight(const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, bool aCanBounceToLight, const Sampler& aSampler, int aDepth, int aGuideCell, ShadowQuery& aOutQuery);
+	// The light of aQuery if its shadow ray is unoccluded. A path that defers its shadow rays keeps the query instead, and gets 0.
+	inline Vector3f TraceShadow(PathState& aPath, const ShadowQuery& aQuery);
+	// Solid angle density of a diffuse bounce picking aDirection, mixing the cosine and the path guide distribution in trained cells
+	inline float GetDiffusePdf(const Vector3f& aNormal, const Vector3f& aDirection, int aGuideCell) const;
+	// Light arriving at aPoint from the area lights, picked from the pixel's reservoir of candidates merged with those of its neighbours
+	inline Vector3f ResampleDirectLight(int aPixel, const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, const Sampler& aSampler);
+	// Luminance of the unshadowed light reaching aPoint from aLightPoint, the area density the reservoirs resample towards
+	inline float GetResamplingTarget(const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, int aLight, const Vector3f& aLightPoint) const;
+	inline void CaptureFeatures(PathState& aPath, const SurfaceHit& aHit, const Material& aMaterial);
+	// Probability the path continues past aDepth, 0 when Russian roulette ended it
+	inline float GetSurvivalProbability(int aDepth, const Vector3f& aThroughput, const Sampler& aSampler) const;
+
 	int myWidth;
 	int myHeight;
-	int myRaysPerPixel = 100;
-	int myMaxBounces = 2;
+	RenderSettings mySettings;
 
 	bool myHasDirectionalLight = false;
 
 	// Add member variables to store scene here
-	std::vector<Primitive*> myPrimitives;
+	MaterialTable myMaterials;
 	std::vector<Sphere> mySpheres;
 	std::vector<AABB> myAABBs;
+	SceneGeometry myGeometry;
+	BVH myBVH;
+	WideBVH myWideBVH;
+	float myBuildSAHCost = 0.f; // of the BVH right after it was last built, refits are measured against it
+
+	int myFrameCount = 1;
+	std::vector<Animation::Track> myTracks;
+	PrimitiveShape myLastShape = PrimitiveShape::Sphere; // of the last sphere or aabb line, while loading
+	bool myUseWideBVH = true;
+	bool myUseInterleavedTraversal = false;
+
+	PathGuide myPathGuide;
+	RadianceCache myRadianceCache;
+	CausticPhotonMap myCausticPhotons;
+	DirectLightResampling myDirectLightResampling;
+
+	std::vector<AreaLight> myAreaLights;
+	LightSelection myLightSelection;
+	std::vector<int> mySphereLights; // area light of every sphere, -1 when not emissive
+	std::vector<int> myAABBLights;
 
 	Camera myCamera;
 	Sky mySky;
@@ -248,14 +353,19 @@ namespace
 		return aStream;
 	}
 
+	inline std::ostream& operator<<(std::ostream& aStream, const Material& aMaterial)
+	{
+		std::cout << "and color: " << aMaterial.myColor << std::endl;
+		std::cout << "and material: " << aMaterial.myType << std::endl;
+		if (aMaterial.myType == MaterialType::Glass)
+			std::cout << "and refraction index: " << aMaterial.myRefractiveIndex << std::endl;
+		return aStream;
+	}
+
 	inline std::ostream& operator<<(std::ostream& aStream, const Sphere& aSphere)
 	{
 		std::cout << "Sphere at center " << aSphere.mySphere.GetCenter() << std::endl;
 		std::cout << "With radius: " << aSphere.mySphere.GetRadius() << std::endl;
-		std::cout << "and color: " << aSphere.myColor << std::endl;
-		std::cout << "and material: " << aSphere.GetMaterialType() << std::endl;
-		if (aSphere.myType == MaterialType::Glass)
-			std::cout << "and refraction index: " << aSphere.myRefractiveIndex << std::endl;
 		return aStream;
 	}
 
@@ -267,31 +377,47 @@ namespace
 		auto size = max - min;
 		std::cout << "AABB at center " << center << std::endl;
 		std::cout << "With width: " << size << std::endl;
-		std::cout << "and color: " << anAABB.myColor << std::endl;
-		std::cout << "and material: " << anAABB.GetMaterialType() << std::endl;
-		if (anAABB.myType == MaterialType::Glass)
-			std::cout << "and refraction index: " << anAABB.myRefractiveIndex << std::endl;
 		return aStream;
 	}
 
-	inline std::ostream& operator<<(std::ostream& aStream, Primitive* aPrimitive)
+	inline bool IsMaterialType(const std::string& aName)
 	{
-		if (auto sphere = dynamic_cast<Sphere*>(aPrimitive))
-			std::cout << *sphere << std::endl;
-		else if (auto aabb = dynamic_cast<AABB*>(aPrimitive))
-			std::cout << *aabb << std::endl;
-		return aStream;
+		return aName == "normal" || aName == "mirror" || aName == "emissive" || aName == "glass";
+	}
+
+	// Reads the color, and the refraction index of glass, that follow a material type
+	inline Material ReadMaterial(std::stringstream& aStream, const std::string& aMaterialType)
+	{
+		Material material;
+		aStream >> material.myColor;
+
+		if (aMaterialType == "mirror") material.myType = MaterialType::Mirror;
+		else if (aMaterialType == "emissive") material.myType = MaterialType::Emissive;
+		else if (aMaterialType == "glass")
+		{
+			material.myType = MaterialType::Glass;
+			aStream >> material.myRefractiveIndex;
+		}
+		else material.myType = MaterialType::Normal;
+
+		return material;
 	}
 }
 
-bool CScene::Load(const char* aFilename)
+bool CScene::Load(const char* aFilename, ThreadPool* aThreadPool)
 {
 	std::ifstream file(aFilename);
 	if (!file.is_open())
 		return false;
 
+	return Load(file, aThreadPool);
+}
+
+bool CScene::Load(std::istream& aStream, ThreadPool* aThreadPool)
+{
+	bool hasFrameCount = false;
 	std::string str;
-	while (std::getline(file, str))
+	while (std::getline(aStream, str))
 	{
 		if (str.size() < 2 || str.substr(0, 2) == "//")
 			continue;
@@ -320,88 +446,193 @@ bool CScene::Load(const char* aFilename)
 			std::cout << mySky << std::endl;
 		}
 
+		if (objectType == "material")
+		{
+			std::string name;
+			std::string materialType;
+			ss >> name >> materialType;
+			if (IsMaterialType(name))
+			{
+				std::cout << "Material name " << name << " is taken by a material type" << std::endl;
+				continue;
+			}
+
+			MaterialID material;
+			if (!myMaterials.AddNamed(name, ReadMaterial(ss, materialType), material))
+			{
+				std::cout << "More than " << MaterialTable::ourMaxCount << " materials" << std::endl;
+				return false;
+			}
+			std::cout << "Material " << name << std::endl << myMaterials[material] << std::endl;
+		}
+
+		if (objectType == "frames")
+		{
+			ss >> myFrameCount;
+			myFrameCount = std::max(1, myFrameCount);
+			hasFrameCount = true;
+		}
+
+		if (objectType == "keyframe")
+		{
+			Animation::Keyframe keyframe;
+			ss >> keyframe.myFrame;
+			ss >> keyframe.myCenter;
+			if (mySpheres.empty() && myAABBs.empty())
+			{
+				std::cout << "A keyframe has to follow the sphere or aabb it moves" << std::endl;
+				continue;
+			}
+
+			// Moves the primitive declared last, the lines of each shape are parsed in order
+			const PrimitiveShape shape = myLastShape;
+			const int index = shape == PrimitiveShape::Sphere ? (int)mySpheres.size() - 1 : (int)myAABBs.size() - 1;
+			if (myTracks.empty() || myTracks.back().myShape != shape || myTracks.back().myIndex != index)
+			{
+				const Vector3f center = shape == PrimitiveShape::Sphere ? mySpheres[index].mySphere.GetCenter() : myAABBs[index].myAABB.GetCenter();
+				myTracks.push_back({ shape, index, { { 0, center } } });
+			}
+			Animation::AddKeyframe(myTracks.back(), keyframe);
+			if (!hasFrameCount)
+				myFrameCount = std::max(myFrameCount, keyframe.myFrame + 1);
+		}
+
 		if (objectType != "sphere" && objectType != "aabb")
 			continue;
 
-		Primitive* primitive = nullptr;
-		std::string materialType;
-		ss >> materialType;
+		// Either the name of a declared material, or a material type followed by the material after the shape
+		std::string materialName;
+		ss >> materialName;
+		MaterialID material = 0;
+		const bool isNamedMaterial = myMaterials.Find(materialName, material);
 
 		if (objectType == "sphere")
 		{
-			Sphere sphere;
 			Vector3f center;
 			float radius;
-
 			ss >> center >> radius;
-			ss >> sphere.myColor >> sphere.myRefractiveIndex;
-
-			sphere.mySphere.InitWithCenterAndRadius(center, radius);
-			mySpheres.emplace_back(sphere);
 
-			primitive = &mySpheres.back();
+			mySpheres.emplace_back();
+			mySpheres.back().mySphere.InitWithCenterAndRadius(center, radius);
 		}
 
 		if (objectType == "aabb")
 		{
-			AABB aabb;
 			Vector3f center;
 			Vector3f width;
+			ss >> center >> width;
 
-			ss >> center >> width >> aabb.myColor;
-
-			aabb.myAABB.InitWithMinAndMax(center - width / 2.f, center + width / 2.f);
-			myAABBs.emplace_back(aabb);
-
-			primitive = &myAABBs.back();
+			myAABBs.emplace_back();
+			myAABBs.back().myAABB.InitWithMinAndMax(center - width / 2.f, center + width / 2.f);
 		}
 
-		if (materialType == "normal") primitive->SetMaterialType(MaterialType::Normal);
-		else if (materialType == "mirror") primitive->SetMaterialType(MaterialType::Mirror);
-		else if (materialType == "emissive") primitive->SetMaterialType(MaterialType::Emissive);
-		else if (materialType == "glass")
+		if (!isNamedMaterial && !myMaterials.Add(ReadMaterial(ss, materialName), material))
 		{
-			primitive->SetMaterialType(MaterialType::Glass);
-			float refractionIndex;
-			ss >> refractionIndex;
-			primitive->SetRefractionIndex(refractionIndex);
+			std::cout << "More than " << MaterialTable::ourMaxCount << " materials" << std::endl;
+			return false;
 		}
-		else primitive->SetMaterialType(MaterialType::Normal);
 
-		ss << primitive;
+		if (objectType == "sphere")
+		{
+			mySpheres.back().myMaterial = material;
+			myLastShape = PrimitiveShape::Sphere;
+			std::cout << mySpheres.back();
+		}
+		else
+		{
+			myAABBs.back().myMaterial = material;
+			myLastShape = PrimitiveShape::AABB;
+			std::cout << myAABBs.back();
+		}
+		std::cout << myMaterials[material] << std::endl;
 	}
 
-	for (auto& s : mySpheres)
-		myPrimitives.push_back(&s);
-
-	for (auto& a : myAABBs)
-		myPrimitives.push_back(&a);
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	BuildAccelerationStructures(aThreadPool);
+	const double buildSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - buildStart).count();
+	BuildAreaLights();
+	std::cout << "Built BVH with " << myBVH.GetNodeCount() << " nodes (" << myWideBVH.GetNodeCount() << " wide) over " << mySpheres.size() + myAABBs.size() << " primitives in "
+		<< buildSeconds * 1e3 << " ms, SAH cost " << myBVH.GetSAHCost() << ", " << myMaterials.GetCount() << " materials and " << myAreaLights.size() << " area lights" << std::endl;
 
 	return true;
 }
 
-SRGB CScene::Raytrace(int x, int y)
+SRGB CScene::Raytrace(int x, int y, Sampler& aSampler)
 {
 	Vector3f sum;
-	for (size_t i = 0; i < myRaysPerPixel; i++)
+	Vector3f colors[RayPacket::ourLaneCount];
+	const int raysPerPixel = mySettings.myRaysPerPixel;
+	for (int first = 0; first < raysPerPixel; first += RayPacket::ourLaneCount)
 	{
-		// anti-aliasing
-		auto aaX = x + RandomFloat();
-		auto aaY = y + RandomFloat();
+		const int count = raysPerPixel - first < RayPacket::ourLaneCount ? raysPerPixel - first : RayPacket::ourLaneCount;
+		SampleBatch(x, y, first, count, aSampler, colors);
+		for (int i = 0; i < count; i++)
+			sum += colors[i];
+	}
 
-		float newX = 2 * (aaX / (float)myWidth - 0.5f);
-		float newY = 2 * (aaY / (float)myHeight - 0.5f) * myHeight / (float)myWidth;
+	return { sum.x / raysPerPixel, sum.y / raysPerPixel, sum.z / raysPerPixel };
+}
+
+Vector3f CScene::Sample(int x, int y, int aSampleIndex, Sampler& aSampler, FeatureSample* anOutFeatures, PathGuide::TrainingBuffer* aTraining)
+{
+	return Raytrace(CreatePixelRay(x, y, aSampleIndex, aSampler), aSampler, anOutFeatures, aTraining, y * myWidth + x);
+}
 
-		Vector3f dir = myCamera.myForward + newX * myCamera.myRight + newY * myCamera.myUp;
-		Vector3f pointOnDof = myCamera.myPos + dir * myDepthOfField;
+void CScene::SampleBatch(int x, int y, int aFirstSample, int aCount, Sampler& aSampler, Vector3f* someOutColors, FeatureSample* someOutFeatures, PathGuide::TrainingBuffer* aTraining)
+{
+	for (int first = 0; first < aCount; first += RayPacket::ourLaneCount)
+	{
+		const int count = aCount - first < RayPacket::ourLaneCount ? aCount - first : RayPacket::ourLaneCount;
 
-		auto bokehOffset = RandomVector2OnDisc() * myLensRadius;
-		auto origin = myCamera.myPos + bokehOffset.x * myCamera.myRight + bokehOffset.y * myCamera.myUp; // bokeh
+		// The camera rays of a pixel start on a small lens and go through the same pixel, so they are nearly parallel
+		Ray rays[RayPacket::ourLaneCount];
+		SurfaceHit hits[RayPacket::ourLaneCount];
+		bool isHit[RayPacket::ourLaneCount];
+		for (int i = 0; i < count; ++i)
+			rays[i] = CreatePixelRay(x, y, aFirstSample + first + i, aSampler);
+		Hit(rays, count, hits, isHit);
 
-		sum += Raytrace(Ray(origin, pointOnDof), myMaxBounces);
+		for (int i = 0; i < count; ++i)
+		{
+			aSampler.StartPixelSample(x, y, aFirstSample + first + i);
+			PathState path;
+			RadianceCache::PathRecord cacheRecord;
+			InitializePath(path, rays[i], y * myWidth + x, someOutFeatures ? &someOutFeatures[first + i] : nullptr, aTraining, &cacheRecord);
+			if (isHit[i])
+				ShadeHit(path, hits[i], aSampler);
+			else
+				ShadeMiss(path);
+			TracePath(path, aSampler);
+			FinishPath(path);
+			someOutColors[first + i] = path.myRadiance;
+		}
 	}
+}
+
+Ray CScene::CreatePixelRay(int x, int y, int aSampleIndex, Sampler& aSampler)
+{
+	aSampler.StartPixelSample(x, y, aSampleIndex);
+
+	// anti-aliasing
+	auto jitter = aSampler.Get2D(SampleDimension::Pixel);
+	auto aaX = x + jitter.x;
+	auto aaY = y + jitter.y;
 
-	return { sum.x / myRaysPerPixel, sum.y / myRaysPerPixel, sum.z / myRaysPerPixel };
+	return CreateCameraRay(aaX, aaY, aSampler.Get2D(SampleDimension::Lens));
+}
+
+Ray CScene::CreateCameraRay(float aX, float aY, const Vector2f& aLensSample)
+{
+	float newX = 2 * (aX / (float)myWidth - 0.5f);
+	float newY = 2 * (aY / (float)myHeight - 0.5f) * myHeight / (float)myWidth;
+
+	Vector3f dir = myCamera.myForward + newX * myCamera.myRight + newY * myCamera.myUp;
+	Vector3f pointOnDof = myCamera.myPos + dir * myDepthOfField;
+
+	auto bokehOffset = SampleDisc(aLensSample) * myLensRadius;
+	auto origin = myCamera.myPos + bokehOffset.x * myCamera.myRight + bokehOffset.y * myCamera.myUp; // bokeh
+
+	return Ray(origin, pointOnDof);
 }
 
 namespace
@@ -414,10 +645,10 @@ namespace
 		return reflectionRay;
 	}
 
-	inline Ray DiffuseRay(const Ray& aRay, const Vector3f& aHit, const Vector3f& normal)
+	inline Ray DiffuseRay(const Ray& aRay, const Vector3f& aHit, const Vector3f& normal, const Vector2f& aSample)
 	{
 		Ray ray;
-		ray.InitWithOriginAndDirection(aHit + normal * 0.001f, (normal + RandomUnitVector3()).GetNormalized());
+		ray.InitWithOriginAndDirection(aHit + normal * 0.001f, (normal + SampleUnitVector3(aSample)).GetNormalized());
 		return ray;
 	}
 
@@ -429,14 +660,15 @@ namespace
 		return R0 + (1.f - R0) * t * t * t * t * t;
 	}
 
-	inline Ray FresnelRay(const Ray& aRay, const Vector3f& aHit, const Vector3f& normal, const float aRefIndex)
+	// aSample in [0, 1) picks between reflection and refraction
+	inline Ray FresnelRay(const Ray& aRay, const Vector3f& aHit, const Vector3f& normal, const float aRefIndex, const float aSample)
 	{
 		float c = normal.Dot(-aRay.GetDirection());
 		float r = c > 0.f ? 1.f / aRefIndex : aRefIndex;
 		c = c > 0.f ? c : -c;
 		float radicand = 1.f - r * r * (1.f - c * c);
 
-		if (radicand < 0.f || RandomFloat() < CalcReflCoeff(aRefIndex, c))
+		if (radicand < 0.f || aSample < CalcReflCoeff(aRefIndex, c))
 			return ReflectRay(aRay, aHit, normal);
 		else
 		{
@@ -448,78 +680,828 @@ namespace
 	}
 }
 
-Vector3f CScene::Raytrace(const Ray& aRay, int aRemainingBounces)
+Vector3f CScene::Raytrace(const Ray& aRay, const Sampler& aSampler, FeatureSample* anOutFeatures, PathGuide::TrainingBuffer* aTraining, int aPixel)
 {
-	if (aRemainingBounces <= 0)
-		return Vector3f();
+	PathState path;
+	RadianceCache::PathRecord cacheRecord;
+	InitializePath(path, aRay, aPixel, anOutFeatures, aTraining, &cacheRecord);
+	TracePath(path, aSampler);
+	FinishPath(path);
+	return path.myRadiance;
+}
+
+void CScene::TracePath(PathState& aPath, const Sampler& aSampler)
+{
+	while (!aPath.myIsDone && aPath.myDepth < mySettings.myMaxBounces)
+	{
+		SurfaceHit surface;
+		if (Hit(aPath.myRay, surface))
+			ShadeHit(aPath, surface, aSampler);
+		else
+			ShadeMiss(aPath);
+	}
+}
+
+void CScene::InitializePath(PathState& aPath, const Ray& aRay, int aPixel, FeatureSample* anOutFeatures, PathGuide::TrainingBuffer* aTraining, RadianceCache::PathRecord* aCacheRecord)
+{
+	aPath = PathState();
+	aPath.myRay = aRay;
+	aPath.myTraining = aTraining;
+	aPath.myPixel = aPixel;
+
+	if (myRadianceCache.IsEnabled())
+	{
+		aCacheRecord->myCount = 0;
+		aPath.myCacheRecord = aCacheRecord;
+		aPath.myCanEndAtCache = RandomFloat() >= myRadianceCache.GetTrainingFraction();
+	}
+	if (anOutFeatures)
+	{
+		*anOutFeatures = FeatureSample();
+		anOutFeatures->myAlbedo = Vector3f(1.f, 1.f, 1.f);
+		aPath.myFeatures = anOutFeatures;
+	}
+}
+
+void CScene::FinishPath(const PathState& aPath)
+{
+	if (aPath.myTraining)
+		myPathGuide.FinishPath(*aPath.myTraining, aPath.myRadiance);
+	if (aPath.myCacheRecord)
+		myRadianceCache.FinishPath(*aPath.myCacheRecord, aPath.myRadiance);
+}
+
+void CScene::ShadeMiss(PathState& aPath)
+{
+	const Vector3f sky = CalculateSkyColor(aPath.myRay.GetDirection().y);
+	aPath.myRadiance += aPath.myThroughput * sky;
+	aPath.myIsDone = true;
 
-	Primitive* primitive = nullptr;
-	Vector3f hit;
-	Vector3f normal;
+	if (FeatureSample* features = aPath.myFeatures)
+	{
+		features->myAlbedo = features->myAlbedo * Vector3f(std::fmin(sky.x, 1.f), std::fmin(sky.y, 1.f), std::fmin(sky.z, 1.f));
+		features->myNormal = -aPath.myRay.GetDirection();
+		features->myDepth += FeatureSample::ourMissDepth;
+		aPath.myFeatures = nullptr;
+	}
+}
 
-	if (!Hit(aRay, primitive, hit, normal))
-		return CalculateSkyColor(aRay.GetDirection().y);
+void CScene::CaptureFeatures(PathState& aPath, const SurfaceHit& aHit, const Material& aMaterial)
+{
+	FeatureSample& features = *aPath.myFeatures;
+	features.myDepth += (aHit.myPoint - aPath.myRay.GetOrigin()).Length();
 
-	--aRemainingBounces;
-	auto matColor = primitive->GetColor();
+	const Vector3f& color = aMaterial.myColor;
+	switch (aMaterial.myType)
+	{
+	case MaterialType::Glass:
+		return;
+	case MaterialType::Mirror:
+		features.myAlbedo = features.myAlbedo * color;
+		return;
+	case MaterialType::Emissive:
+		features.myAlbedo = features.myAlbedo * Vector3f(std::fmin(color.x, 1.f), std::fmin(color.y, 1.f), std::fmin(color.z, 1.f));
+		break;
+	case MaterialType::Normal:
+		features.myAlbedo = features.myAlbedo * color;
+		break;
+	}
+	features.myNormal = aHit.myNormal;
+	aPath.myFeatures = nullptr;
+}
 
-	switch (primitive->GetMaterialType())
+void CScene::ShadeHit(PathState& aPath, const SurfaceHit& aHit, const Sampler& aSampler)
+{
+	const Ray& ray = aPath.myRay;
+	const Vector3f& hit = aHit.myPoint;
+	const Vector3f& normal = aHit.myNormal;
+	const Material& material = myMaterials[aHit.myMaterial];
+	const Vector3f& matColor = material.myColor;
+	const int depth = aPath.myDepth++;
+	if (aPath.myFeatures)
+		CaptureFeatures(aPath, aHit, material);
+
+	const bool isLightResampled = aPath.myIsLightResampled;
+	aPath.myIsLightResampled = false;
+
+	switch (material.myType)
 	{
 	case MaterialType::Emissive:
-		return matColor;
+	{
+		aPath.myIsDone = true;
+		if (isLightResampled && aHit.myLight >= 0)
+			return;
+
+		// Light reached through mirrors and glass from a diffuse surface is in the caustic photon map
+		if (aPath.myHasDiffuseVertex && aPath.myDiffusePdf <= 0.f && aHit.myLight >= 0 && myCausticPhotons.IsEnabled())
+			return;
+
+		if (aPath.myDiffusePdf <= 0.f || aHit.myLight < 0)
+		{
+			aPath.myRadiance += aPath.myThroughput * matColor;
+			return;
+		}
+
+		// The light was also sampled directly from where the ray left
+		float lightPdf = myAreaLights[aHit.myLight].GetPdf(ray.GetOrigin(), hit, normal) * myLightSelection.GetProbability(ray.GetOrigin(), aPath.myDiffuseNormal, aHit.myLight);
+		aPath.myRadiance += aPath.myThroughput * matColor * PowerHeuristic(aPath.myDiffusePdf, lightPdf);
+		return;
+	}
 	case MaterialType::Mirror:
-		return matColor * Raytrace(ReflectRay(aRay, hit, normal), aRemainingBounces);
+	{
+		const Vector3f throughput = aPath.myThroughput * matColor;
+		const float survival = GetSurvivalProbability(depth, throughput, aSampler);
+		if (survival <= 0.f)
+		{
+			aPath.myIsDone = true;
+			return;
+		}
+
+		aPath.myThroughput = throughput / survival;
+		aPath.myRay = ReflectRay(ray, hit, normal);
+		aPath.myDiffusePdf = 0.f;
+		return;
+	}
 	case MaterialType::Glass:
-		return Raytrace(FresnelRay(aRay, hit, normal, primitive->GetRefractiveIndex()), aRemainingBounces);
+	{
+		const float survival = GetSurvivalProbability(depth, aPath.myThroughput, aSampler);
+		if (survival <= 0.f)
+		{
+			aPath.myIsDone = true;
+			return;
+		}
+
+		const float fresnelSample = aSampler.Get1D(SampleDimension::GetBounce(depth, SampleDimension::Fresnel));
+		aPath.myThroughput = aPath.myThroughput / survival;
+		aPath.myRay = FresnelRay(ray, hit, normal, material.myRefractiveIndex, fresnelSample);
+		aPath.myDiffusePdf = 0.f;
+		return;
+	}
 	case MaterialType::Normal:
 	{
-		auto color = matColor * Raytrace(DiffuseRay(aRay, hit, normal), aRemainingBounces);
+		if (aPath.myCacheRecord)
+		{
+			// Past the first bounce the cached light is close enough, nearer the camera it would show the cells
+			const uint32_t cacheKey = myRadianceCache.GetKey(hit, normal);
+			Vector3f cached;
+			if (depth > 0 && aPath.myCanEndAtCache && myRadianceCache.Find(cacheKey, cached))
+			{
+				aPath.myRadiance += aPath.myThroughput * cached;
+				aPath.myIsDone = true;
+				return;
+			}
+			myRadianceCache.AddVertex(*aPath.myCacheRecord, cacheKey, aPath.myThroughput, aPath.myRadiance);
+		}
+
+		const int guideCell = myPathGuide.IsEnabled() ? myPathGuide.GetCell(hit, normal) : -1;
+		const bool isGuided = guideCell >= 0 && myPathGuide.IsTrained(guideCell);
+
+		// Resampled direct light takes the full weight, so the next hit doesn't add the area lights it finds
+		const bool resampleLight = depth == 0 && aPath.myPixel >= 0 && myDirectLightResampling.IsEnabled();
+		Vector3f color;
+		ShadowQuery shadow;
+		if (!myAreaLights.empty() && resampleLight)
+			color += matColor * ResampleDirectLight(aPath.myPixel, hit + normal * 0.001f, normal, matColor, aSampler);
+		else if (!myAreaLights.empty() && SampleAreaLight(hit + normal * 0.001f, normal, matColor, depth + 1 < mySettings.myMaxBounces, aSampler, depth, isGuided ? guideCell : -1, shadow))
+			color += TraceShadow(aPath, shadow);
+		aPath.myIsLightResampled = resampleLight;
+
+		if (myHasDirectionalLight)
+		{
+			float lambertFactor = normal.Dot(-myLight.myDir);
+			if (lambertFactor > 0.f)
+			{
+				shadow.myRay.InitWithOriginAndDirection(hit + normal * 0.001f, -myLight.myDir);
+				shadow.myMaxT = std::numeric_limits<float>::infinity();
+				shadow.myRadiance = matColor * myLight.myColor * lambertFactor;
+				color += TraceShadow(aPath, shadow);
+			}
+		}
+
+		if (myCausticPhotons.IsEnabled())
+			color += matColor * myCausticPhotons.GetIrradiance(hit, normal) / PI;
+		aPath.myRadiance += aPath.myThroughput * color;
+		aPath.myHasDiffuseVertex = true;
+
+		if (!isGuided)
+		{
+			// The cosine weighted bounce leaves only the material color as the path's weight
+			const Vector3f throughput = aPath.myThroughput * matColor;
+			const float survival = GetSurvivalProbability(depth, throughput, aSampler);
+			if (survival <= 0.f)
+			{
+				aPath.myIsDone = true;
+				return;
+			}
 
-		if (!myHasDirectionalLight)
-			return color;
+			aPath.myRay = DiffuseRay(ray, hit, normal, aSampler.Get2D(SampleDimension::GetBounce(depth, SampleDimension::Diffuse)));
+			aPath.myDiffusePdf = myAreaLights.empty() ? 0.f : normal.Dot(aPath.myRay.GetDirection()) / PI;
+			aPath.myDiffuseNormal = normal;
+			aPath.myThroughput = throughput / survival;
+		}
 		else
 		{
-			Primitive* other = nullptr;
-			Vector3f dummyHit;
-			Vector3f dummyNormal;
+			const Vector2f directionSample = aSampler.Get2D(SampleDimension::GetBounce(depth, SampleDimension::Diffuse));
+			const bool useGuide = aSampler.Get1D(SampleDimension::GetBounce(depth, SampleDimension::GuideSelection)) < myPathGuide.GetGuideProbability();
+			const Vector3f direction = useGuide ? myPathGuide.Sample(guideCell, directionSample) : (normal + SampleUnitVector3(directionSample)).GetNormalized();
+			const float cosine = normal.Dot(direction);
+			if (cosine <= 0.f)
+			{
+				aPath.myIsDone = true;
+				return;
+			}
 
-			if (!Hit(Ray(hit, hit - myLight.myDir), other, dummyHit, dummyNormal) || other == primitive)
+			// Lambertian BRDF times cosine over the density of the mixture
+			const float pdf = GetDiffusePdf(normal, direction, guideCell);
+			const Vector3f throughput = aPath.myThroughput * matColor * (cosine / PI / pdf);
+			const float survival = GetSurvivalProbability(depth, throughput, aSampler);
+			if (survival <= 0.f)
 			{
-				float lambertFactor = CommonUtilities::Max((normal.Dot(-myLight.myDir)), 0.0f);
-				color += matColor * myLight.myColor * lambertFactor;
+				aPath.myIsDone = true;
+				return;
 			}
+
+			aPath.myRay.InitWithOriginAndDirection(hit + normal * 0.001f, direction);
+			aPath.myDiffusePdf = pdf;
+			aPath.myDiffuseNormal = normal;
+			aPath.myThroughput = throughput / survival;
 		}
 
-		return color;
+		if (aPath.myTraining && guideCell >= 0)
+		{
+			const Vector3f& direction = aPath.myRay.GetDirection();
+			const float cosine = std::max(normal.Dot(direction), 1e-6f);
+			const float pdf = isGuided ? aPath.myDiffusePdf : cosine / PI;
+			myPathGuide.AddVertex(*aPath.myTraining, guideCell, direction, cosine, pdf, aPath.myThroughput, aPath.myRadiance);
+		}
+		return;
 	}
 	}
 }
 
+float CScene::GetSurvivalProbability(int aDepth, const Vector3f& aThroughput, const Sampler& aSampler) const
+{
+	if (!mySettings.myUseRussianRoulette || aDepth + 1 < mySettings.myMinBounces)
+		return 1.f;
+
+	const float largest = std::max(aThroughput.x, std::max(aThroughput.y, aThroughput.z));
+	const float survival = std::min(std::max(largest * mySettings.myThroughputScale, mySettings.myMinSurvival), mySettings.myMaxSurvival);
+	return aSampler.Get1D(SampleDimension::GetBounce(aDepth, SampleDimension::Roulette)) < survival ? survival : 0.f;
+}
+
+bool CScene::SampleAreaLight(const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, bool aCanBounceToLight, const Sampler& aSampler, int aDepth, int aGuideCell, ShadowQuery& aOutQuery)
+{
+	float selectionProbability;
+	const int lightIndex = myLightSelection.Sample(aPoint, aNormal, aSampler.Get1D(SampleDimension::GetBounce(aDepth, SampleDimension::LightSelection)), selectionProbability);
+	if (lightIndex < 0)
+		return false;
+	const AreaLight& light = myAreaLights[lightIndex];
+
+	LightSample sample;
+	const Vector2f position = aSampler.Get2D(SampleDimension::GetBounce(aDepth, SampleDimension::LightPosition));
+	if (!light.Sample(aPoint, position.x, position.y, sample))
+		return false;
+
+	const float cosine = aNormal.Dot(sample.myDirection);
+	if (cosine <= 0.f)
+		return false;
+
+	aOutQuery.myRay.InitWithOriginAndDirection(aPoint, sample.myDirection);
+	aOutQuery.myMaxT = sample.myDistance * 0.999f;
+
+	// Lambertian BRDF of anAlbedo / PI.
+	// Without bounces left a diffuse ray can't reach the light, so the light sample takes the full weight.
+	const float lightPdf = sample.myPdf * selectionProbability;
+	const float diffusePdf = aGuideCell >= 0 ? GetDiffusePdf(aNormal, sample.myDirection, aGuideCell) : cosine / PI;
+	const float weight = aCanBounceToLight ? PowerHeuristic(lightPdf, diffusePdf) : 1.f;
+	aOutQuery.myRadiance = anAlbedo * (light.GetRadiance() * (cosine / PI / lightPdf * weight));
+	return true;
+}
+
+Vector3f CScene::TraceShadow(PathState& aPath, const ShadowQuery& aQuery)
+{
+	if (aPath.myDeferredShadows)
+	{
+		ShadowQuery& deferred = aPath.myDeferredShadows[aPath.myDeferredShadowCount++];
+		deferred = aQuery;
+		deferred.myRadiance = aPath.myThroughput * aQuery.myRadiance;
+		return Vector3f();
+	}
+	return Occluded(aQuery.myRay, aQuery.myMaxT) ? Vector3f() : aQuery.myRadiance;
+}
+
+Vector3f CScene::ResampleDirectLight(int aPixel, const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, const Sampler& aSampler)
+{
+	const DirectLightResampling::Settings& settings = myDirectLightResampling.GetSettings();
+
+	LightReservoir reservoir;
+	reservoir.myShadingPoint = aPoint;
+	reservoir.myShadingNormal = aNormal;
+
+	// Candidates from lights picked by the light selection, weighted by target over the area density they were picked with.
+	// Every candidate reads 4 dimensions: the point on the light, the light and the reservoir update.
+	for (int i = 0; i < settings.myCandidateCount; ++i)
+	{
+		const int dimension = SampleDimension::Resampling + i * 4;
+		float selectionProbability;
+		const int lightIndex = myLightSelection.Sample(aPoint, aNormal, aSampler.Get1D(dimension + 2), selectionProbability);
+		const Vector2f position = aSampler.Get2D(dimension);
+		LightSample sample;
+		if (lightIndex < 0 || !myAreaLights[lightIndex].Sample(aPoint, position.x, position.y, sample) || sample.myDirection.Dot(aNormal) <= 0.f)
+		{
+			reservoir.Update(-1, Vector3f(), 0.f, 0.f, 1, 0.f);
+			continue;
+		}
+
+		const Vector3f lightPoint = aPoint + sample.myDirection * sample.myDistance;
+		const float target = GetResamplingTarget(aPoint, aNormal, anAlbedo, lightIndex, lightPoint);
+		const float lightCosine = std::fabs(myAreaLights[lightIndex].GetNormal(lightPoint).Dot(sample.myDirection));
+		const float areaPdf = sample.myPdf * lightCosine / (sample.myDistance * sample.myDistance) * selectionProbability;
+		reservoir.Update(lightIndex, lightPoint, target, areaPdf > 0.f ? target / areaPdf : 0.f, 1, aSampler.Get1D(dimension + 3));
+	}
+
+	// Reservoirs of the previous pass, this pixel's own and a few neighbours', each re-weighted by the target at this shading point.
+	// Neighbours looking at a different surface would bring light from the wrong side, so they are skipped.
+	// Without tracing shadow rays for the reused samples the result is slightly biased, the variant Bitterli et al. call biased reuse.
+	const int maxCount = settings.myMaxHistory * settings.myCandidateCount;
+	const float cameraDistance = (aPoint - myCamera.myPos).Length();
+	auto reuse = [&](const LightReservoir& aReservoir, float aSample)
+	{
+		if (aReservoir.myCount == 0 || aReservoir.myShadingNormal.Dot(aNormal) < 0.9f ||
+			std::fabs((aReservoir.myShadingPoint - myCamera.myPos).Length() - cameraDistance) > 0.1f * cameraDistance)
+			return;
+
+		// A reservoir whose sample was occluded still counts its candidates, it found no light for them
+		const int count = std::min(aReservoir.myCount, maxCount);
+		const float target = aReservoir.myWeight > 0.f ? GetResamplingTarget(aPoint, aNormal, anAlbedo, aReservoir.myLight, aReservoir.myLightPoint) : 0.f;
+		reservoir.Update(aReservoir.myLight, aReservoir.myLightPoint, target, target * aReservoir.myWeight * count, count, aSample);
+	};
+
+	const int width = myDirectLightResampling.GetWidth();
+	const int height = myDirectLightResampling.GetHeight();
+	const int reuseDimension = SampleDimension::Resampling + settings.myCandidateCount * 4;
+	reuse(myDirectLightResampling.GetPrevious(aPixel), aSampler.Get1D(reuseDimension));
+	for (int i = 0; i < settings.mySpatialNeighbours; ++i)
+	{
+		const int dimension = reuseDimension + (i + 1) * 4;
+		const Vector2f offset = SampleDisc(aSampler.Get2D(dimension)) * (float)settings.mySpatialRadius;
+		const int x = aPixel % width + (int)std::floor(offset.x + 0.5f);
+		const int y = aPixel / width + (int)std::floor(offset.y + 0.5f);
+		if (x >= 0 && y >= 0 && x < width && y < height)
+			reuse(myDirectLightResampling.GetPrevious(y * width + x), aSampler.Get1D(dimension + 2));
+	}
+
+	// Only the picked sample is tested for visibility, an occluded one is kept with no weight so neighbours don't reuse it
+	Vector3f radiance;
+	if (reservoir.myLight >= 0 && reservoir.myTargetPdf > 0.f)
+	{
+		const Vector3f toLight = reservoir.myLightPoint - aPoint;
+		const float distance = toLight.Length();
+		const Vector3f direction = toLight / distance;
+
+		Ray shadowRay;
+		shadowRay.InitWithOriginAndDirection(aPoint, direction);
+		if (!Occluded(shadowRay, distance * 0.999f))
+		{
+			reservoir.myWeight = reservoir.myWeightSum / (reservoir.myCount * reservoir.myTargetPdf);
+
+			// Lambertian BRDF of 1 / PI times both cosines over the squared distance, the material color is applied by the caller
+			const AreaLight& light = myAreaLights[reservoir.myLight];
+			const float geometry = direction.Dot(aNormal) * -light.GetNormal(reservoir.myLightPoint).Dot(direction) / (distance * distance);
+			radiance = light.GetRadiance() * (geometry / PI * reservoir.myWeight);
+		}
+	}
+
+	myDirectLightResampling.GetCurrent(aPixel) = reservoir;
+	return radiance;
+}
+
+float CScene::GetResamplingTarget(const Vector3f& aPoint, const Vector3f& aNormal, const Vector3f& anAlbedo, int aLight, const Vector3f& aLightPoint) const
+{
+	const AreaLight& light = myAreaLights[aLight];
+	const Vector3f toLight = aLightPoint - aPoint;
+	const float distanceSqr = toLight.LengthSqr();
+	const float distance = std::sqrt(distanceSqr);
+	const float cosine = aNormal.Dot(toLight) / distance;
+	const float lightCosine = -light.GetNormal(aLightPoint).Dot(toLight) / distance;
+	// Points on the very silhouette of a light get none, their sampled positions are too imprecise for the tiny density they were picked with,
+	// and a reused one would come with a huge contribution weight
+	if (cosine <= 0.f || lightCosine <= 0.01f)
+		return 0.f;
+
+	const Vector3f radiance = light.GetRadiance() * anAlbedo;
+	const float luminance = 0.2126f * radiance.x + 0.7152f * radiance.y + 0.0722f * radiance.z;
+	return luminance * cosine * lightCosine / (PI * distanceSqr);
+}
+
+float CScene::GetDiffusePdf(const Vector3f& aNormal, const Vector3f& aDirection, int aGuideCell) const
+{
+	const float cosinePdf = std::max(aNormal.Dot(aDirection), 0.f) / PI;
+	if (aGuideCell < 0)
+		return cosinePdf;
+
+	const float guideProbability = myPathGuide.GetGuideProbability();
+	return guideProbability * myPathGuide.GetPdf(aGuideCell, aDirection) + (1.f - guideProbability) * cosinePdf;
+}
+
 Vector3f CScene::CalculateSkyColor(const float anY)
 {
 	return (1.0f - anY) * mySky.myHorizonColor + anY * mySky.myZenithColor;
 }
 
-bool CScene::Hit(const Ray& aRay, Primitive*& aOutPrimitive, Vector3f& aOutHit, Vector3f& anOutNormal)
+std::vector<BVH::BuildPrimitive> CScene::GetBuildPrimitives() const
+{
+	std::vector<BVH::BuildPrimitive> buildPrimitives;
+	buildPrimitives.reserve(mySpheres.size() + myAABBs.size());
+	for (size_t i = 0; i < mySpheres.size(); ++i)
+		buildPrimitives.push_back({ mySpheres[i].GetBounds(), PrimitiveShape::Sphere, (int)i });
+	for (size_t i = 0; i < myAABBs.size(); ++i)
+		buildPrimitives.push_back({ myAABBs[i].myAABB, PrimitiveShape::AABB, (int)i });
+	return buildPrimitives;
+}
+
+void CScene::BuildAccelerationStructures(ThreadPool* aThreadPool)
+{
+	myBVH.Build(GetBuildPrimitives(), aThreadPool);
+	myBuildSAHCost = myBVH.GetSAHCost();
+	myWideBVH.Build(myBVH);
+	FillGeometry();
+}
+
+void CScene::FillGeometry()
+{
+	myGeometry.Clear();
+	for (int sphere : myBVH.GetOrder(PrimitiveShape::Sphere))
+		myGeometry.AddSphere(mySpheres[sphere].mySphere, mySpheres[sphere].myMaterial, sphere);
+	for (int aabb : myBVH.GetOrder(PrimitiveShape::AABB))
+		myGeometry.AddAABB(myAABBs[aabb].myAABB, myAABBs[aabb].myMaterial, aabb);
+	myGeometry.Finalize();
+}
+
+Animation::FrameUpdate CScene::SetFrame(int aFrame, const Animation::Settings& someSettings)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (const Animation::Track& track : myTracks)
+	{
+		const Vector3f center = Animation::GetCenter(track, aFrame);
+		if (track.myShape == PrimitiveShape::Sphere)
+		{
+			CommonUtilities::Sphere<float>& sphere = mySpheres[track.myIndex].mySphere;
+			sphere.InitWithCenterAndRadius(center, sphere.GetRadius());
+		}
+		else
+		{
+			CommonUtilities::AABB3D<float>& aabb = myAABBs[track.myIndex].myAABB;
+			const Vector3f halfSize = (aabb.GetMax() - aabb.GetMin()) * 0.5f;
+			aabb.InitWithMinAndMax(center - halfSize, center + halfSize);
+		}
+	}
+
+	Animation::FrameUpdate update;
+	if (!myTracks.empty())
+	{
+		myBVH.Refit(GetBuildPrimitives());
+		if (myBVH.GetSAHCost() > myBuildSAHCost * someSettings.myRebuildThreshold)
+		{
+			BuildAccelerationStructures(nullptr);
+			update.myIsRebuilt = true;
+		}
+		else
+		{
+			// Collapsing is a single pass over the nodes, cheap next to building
+			myWideBVH.Build(myBVH);
+			FillGeometry();
+		}
+		BuildAreaLights();
+	}
+
+	update.mySAHCost = myBVH.GetSAHCost();
+	update.mySeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	return update;
+}
+
+void CScene::BuildAreaLights()
+{
+	myAreaLights.clear();
+	mySphereLights.assign(mySpheres.size(), -1);
+	myAABBLights.assign(myAABBs.size(), -1);
+
+	for (size_t i = 0; i < mySpheres.size(); ++i)
+	{
+		const Material& material = myMaterials[mySpheres[i].myMaterial];
+		if (material.myType != MaterialType::Emissive)
+			continue;
+
+		mySphereLights[i] = (int)myAreaLights.size();
+		myAreaLights.push_back(AreaLight::CreateSphere(mySpheres[i].mySphere, material.myColor));
+	}
+
+	for (size_t i = 0; i < myAABBs.size(); ++i)
+	{
+		const Material& material = myMaterials[myAABBs[i].myMaterial];
+		if (material.myType != MaterialType::Emissive)
+			continue;
+
+		myAABBLights[i] = (int)myAreaLights.size();
+		myAreaLights.push_back(AreaLight::CreateAABB(myAABBs[i].myAABB, material.myColor));
+	}
+
+	myLightSelection.Build(myAreaLights, mySettings.myLightSelection);
+}
+
+void CScene::InitializePathGuide(const PathGuide::Settings& someSettings)
+{
+	// Hit points of a coarse grid of camera rays and one diffuse bounce from each, enough to find where the paths spend their bounces
+	constexpr int columns = 64;
+	constexpr int rows = 48;
+	std::unique_ptr<Sampler> sampler = CreateSampler(SamplerType::Sobol);
+	std::vector<Vector3f> points;
+	for (int y = 0; y < rows; ++y)
+	{
+		for (int x = 0; x < columns; ++x)
+		{
+			sampler->StartPixelSample(x, y, 0);
+			Ray ray = CreateCameraRay((x + 0.5f) * myWidth / columns, (y + 0.5f) * myHeight / rows, Vector2f(0.5f, 0.5f));
+			for (int depth = 0; depth < 2; ++depth)
+			{
+				SurfaceHit hit;
+				if (!Hit(ray, hit))
+					break;
+
+				points.push_back(hit.myPoint);
+				ray.InitWithOriginAndDirection(hit.myPoint + hit.myNormal * 0.001f, (hit.myNormal + SampleUnitVector3(sampler->Get2D(SampleDimension::GetBounce(depth, SampleDimension::Diffuse)))).GetNormalized());
+			}
+		}
+	}
+	if (points.empty())
+		return;
+
+	// Far away floors and walls would spread the cells thin, so a few percent of the points on every side are left outside the grid
+	Vector3f boundsMin;
+	Vector3f boundsMax;
+	std::vector<float> coordinates(points.size());
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		for (size_t i = 0; i < points.size(); ++i)
+			coordinates[i] = axis == 0 ? points[i].x : axis == 1 ? points[i].y : points[i].z;
+		std::sort(coordinates.begin(), coordinates.end());
+
+		const float low = coordinates[coordinates.size() * 2 / 100];
+		const float high = coordinates[coordinates.size() * 98 / 100];
+		const float margin = (high - low) * 0.05f + 0.01f;
+		(axis == 0 ? boundsMin.x : axis == 1 ? boundsMin.y : boundsMin.z) = low - margin;
+		(axis == 0 ? boundsMax.x : axis == 1 ? boundsMax.y : boundsMax.z) = high + margin;
+	}
+
+	myPathGuide.Initialize(CommonUtilities::AABB3D<float>(boundsMin, boundsMax), someSettings);
+}
+
+void CScene::BuildCausticPhotonMap(const CausticPhotonMap::Settings& someSettings, ThreadPool& aThreadPool)
+{
+	// Bounds of the whole scene and of its mirrors and glass
+	const float infinity = std::numeric_limits<float>::infinity();
+	Vector3f sceneMin(infinity, infinity, infinity);
+	Vector3f sceneMax = -sceneMin;
+	Vector3f specularMin = sceneMin;
+	Vector3f specularMax = sceneMax;
+	auto addBounds = [&](const CommonUtilities::AABB3D<float>& someBounds, int aMaterial)
+	{
+		auto grow = [&](Vector3f& aMin, Vector3f& aMax)
+		{
+			aMin = Vector3f(std::min(aMin.x, someBounds.GetMin().x), std::min(aMin.y, someBounds.GetMin().y), std::min(aMin.z, someBounds.GetMin().z));
+			aMax = Vector3f(std::max(aMax.x, someBounds.GetMax().x), std::max(aMax.y, someBounds.GetMax().y), std::max(aMax.z, someBounds.GetMax().z));
+		};
+		grow(sceneMin, sceneMax);
+		const MaterialType type = myMaterials[aMaterial].myType;
+		if (type == MaterialType::Mirror || type == MaterialType::Glass)
+			grow(specularMin, specularMax);
+	};
+	for (const Sphere& sphere : mySpheres)
+		addBounds(sphere.GetBounds(), sphere.myMaterial);
+	for (const AABB& aabb : myAABBs)
+		addBounds(aabb.myAABB, aabb.myMaterial);
+
+	// The directional light and every area light get an equal share of the photons
+	std::vector<CausticPhotonMap::Photon> photons;
+	const int sourceCount = (int)myAreaLights.size() + (myHasDirectionalLight ? 1 : 0);
+	if (specularMin.x > specularMax.x || sourceCount == 0)
+	{
+		myCausticPhotons.Build(photons, someSettings.myGatherRadius);
+		return;
+	}
+
+	// Directional light photons start on a disc facing the light that covers the mirrors and glass, outside of the rest of the scene
+	const Vector3f specularCenter = (specularMin + specularMax) * 0.5f;
+	const float specularRadius = (specularMax - specularMin).Length() * 0.5f;
+	const float sceneRadius = (sceneMax - sceneMin).Length();
+	const Vector3f discCenter = specularCenter - myLight.myDir * sceneRadius;
+	const Vector3f discRight = (std::fabs(myLight.myDir.x) > 0.9f ? Vector3f(0.f, 1.f, 0.f) : Vector3f(1.f, 0.f, 0.f)).Cross(myLight.myDir).GetNormalized();
+	const Vector3f discUp = myLight.myDir.Cross(discRight);
+
+	const int photonsPerSource = someSettings.myPhotonCount / sourceCount;
+	constexpr int batchSize = 4096;
+	const int batchCount = (photonsPerSource + batchSize - 1) / batchSize;
+
+	std::vector<std::unique_ptr<Sampler>> samplers;
+	std::vector<std::vector<CausticPhotonMap::Photon>> workerPhotons(aThreadPool.GetWorkerCount());
+	for (int i = 0; i < aThreadPool.GetWorkerCount(); ++i)
+		samplers.push_back(CreateSampler(SamplerType::Sobol));
+
+	// One tile per batch of photons of one light
+	aThreadPool.ForEachTile(batchCount, sourceCount, 1, [&](const Tile& aTile, int aWorkerIndex)
+	{
+		Sampler& sampler = *samplers[aWorkerIndex];
+		const int source = aTile.myY;
+		const int end = std::min((aTile.myX + 1) * batchSize, photonsPerSource);
+		for (int i = aTile.myX * batchSize; i < end; ++i)
+		{
+			sampler.StartPixelSample(0, source, i);
+			const Vector2f positionSample = sampler.Get2D(0);
+			const Vector2f directionSample = sampler.Get2D(2);
+
+			Ray ray;
+			Vector3f power;
+			if (source < (int)myAreaLights.size())
+			{
+				// Cosine weighted from a point on the light, every photon carries radiance * area * pi / count
+				const AreaLight& light = myAreaLights[source];
+				Vector3f point;
+				Vector3f normal;
+				light.SamplePoint(positionSample.x, positionSample.y, point, normal);
+				ray.InitWithOriginAndDirection(point + normal * 0.001f, (normal + SampleUnitVector3(directionSample)).GetNormalized());
+				power = light.GetRadiance() * (light.GetArea() * PI / photonsPerSource);
+			}
+			else
+			{
+				const Vector2f offset = SampleDisc(positionSample) * specularRadius;
+				ray.InitWithOriginAndDirection(discCenter + discRight * offset.x + discUp * offset.y, myLight.myDir);
+				power = myLight.myColor * (PI * specularRadius * specularRadius / photonsPerSource);
+			}
+			TracePhoton(ray, power, sampler, workerPhotons[aWorkerIndex]);
+		}
+	});
+
+	size_t photonCount = 0;
+	for (const std::vector<CausticPhotonMap::Photon>& someWorkerPhotons : workerPhotons)
+		photonCount += someWorkerPhotons.size();
+	photons.reserve(photonCount);
+	for (const std::vector<CausticPhotonMap::Photon>& someWorkerPhotons : workerPhotons)
+		photons.insert(photons.end(), someWorkerPhotons.begin(), someWorkerPhotons.end());
+
+	myCausticPhotons.Build(photons, someSettings.myGatherRadius);
+}
+
+void CScene::TracePhoton(Ray aRay, Vector3f aPower, const Sampler& aSampler, std::vector<CausticPhotonMap::Photon>& someOutPhotons)
+{
+	// Sample dimensions 0 to 3 placed the photon on its light
+	constexpr int firstFresnelDimension = 4;
+
+	bool hasSpecularBounce = false;
+	for (int depth = 0; depth < mySettings.myMaxBounces; ++depth)
+	{
+		SurfaceHit hit;
+		if (!Hit(aRay, hit))
+			return;
+
+		// The same surface interactions as ShadeHit follows camera paths with
+		const Material& material = myMaterials[hit.myMaterial];
+		switch (material.myType)
+		{
+		case MaterialType::Mirror:
+			aPower = aPower * material.myColor;
+			aRay = ReflectRay(aRay, hit.myPoint, hit.myNormal);
+			hasSpecularBounce = true;
+			break;
+		case MaterialType::Glass:
+			aRay = FresnelRay(aRay, hit.myPoint, hit.myNormal, material.myRefractiveIndex, aSampler.Get1D(firstFresnelDimension + depth));
+			hasSpecularBounce = true;
+			break;
+		case MaterialType::Normal:
+			if (hasSpecularBounce)
+				someOutPhotons.push_back({ hit.myPoint, aPower, hit.myNormal });
+			return;
+		default:
+			return;
+		}
+	}
+}
+
+bool CScene::Hit(const Ray& aRay, SurfaceHit& aOutHit)
 {
-	bool isHit = false;
-	float distToNearest = std::numeric_limits<float>::infinity();
-	for (auto& primitive : myPrimitives)
+	GeometryHit hit;
+	bool isHit = myUseWideBVH ? myWideBVH.Hit(aRay, myGeometry, hit) : myBVH.Hit(aRay, myGeometry, hit);
+	if (!isHit)
+		return false;
+
+	GetSurfaceHit(aRay, hit, aOutHit);
+	return true;
+}
+
+void CScene::GetSurfaceHit(const Ray& aRay, const GeometryHit& aHit, SurfaceHit& aOutHit) const
+{
+	// Hit attributes are only calculated for the closest primitive
+	const int index = myGeometry.GetIndex(aHit);
+	aOutHit.myMaterial = myGeometry.GetMaterial(aHit);
+	aOutHit.myLight = aHit.myShape == PrimitiveShape::Sphere ? mySphereLights[index] : myAABBLights[index];
+	aOutHit.myPoint = aRay.GetPoint(aHit.myT);
+	aOutHit.myNormal = myGeometry.GetNormal(aHit, aOutHit.myPoint);
+}
+
+bool CScene::CreatePacket(const Ray* someRays, int aCount, RayPacket& aOutPacket)
+{
+	if (aCount < 2)
+		return false;
+	aOutPacket.Set(someRays, aCount);
+	return aOutPacket.HasCommonSigns(someRays, aCount);
+}
+
+void CScene::HitInterleaved(const Ray* someRays, const int* someIndices, int aCount, SurfaceHit* someOutHits, bool* someOutIsHit)
+{
+	Ray rays[WideBVH::ourInterleavedRayCount];
+	GeometryHit hits[WideBVH::ourInterleavedRayCount];
+	bool isHit[WideBVH::ourInterleavedRayCount];
+	for (int i = 0; i < aCount; ++i)
+		rays[i] = someRays[someIndices[i]];
+	myWideBVH.Hit(rays, aCount, myGeometry, hits, isHit);
+
+	for (int i = 0; i < aCount; ++i)
 	{
-		Vector3f nearestHit;
-		Vector3f nearestNormal;
-		if (primitive->Hit(aRay, nearestHit, nearestNormal))
+		someOutIsHit[someIndices[i]] = isHit[i];
+		if (isHit[i])
+			GetSurfaceHit(rays[i], hits[i], someOutHits[someIndices[i]]);
+	}
+}
+
+void CScene::Hit(const Ray* someRays, int aCount, SurfaceHit* someOutHits, bool* someOutIsHit)
+{
+	// Rays that don't fit a packet, waiting for a full group to trace interleaved
+	int leftovers[WideBVH::ourInterleavedRayCount];
+	int leftoverCount = 0;
+
+	for (int first = 0; first < aCount; first += RayPacket::ourLaneCount)
+	{
+		const int count = aCount - first < RayPacket::ourLaneCount ? aCount - first : RayPacket::ourLaneCount;
+		RayPacket packet;
+		if (!myUseWideBVH || !CreatePacket(someRays + first, count, packet))
 		{
-			isHit = true;
-			float dist = (nearestHit - aRay.GetOrigin()).LengthSqr();
-			if (dist < distToNearest)
+			for (int i = first; i < first + count; ++i)
 			{
-				aOutPrimitive = primitive;
-				aOutHit = nearestHit;
-				anOutNormal = nearestNormal;
-				distToNearest = dist;
+				if (!myUseWideBVH || !myUseInterleavedTraversal)
+				{
+					someOutIsHit[i] = Hit(someRays[i], someOutHits[i]);
+					continue;
+				}
+
+				leftovers[leftoverCount++] = i;
+				if (leftoverCount == WideBVH::ourInterleavedRayCount)
+				{
+					HitInterleaved(someRays, leftovers, leftoverCount, someOutHits, someOutIsHit);
+					leftoverCount = 0;
+				}
 			}
+			continue;
+		}
+
+		GeometryHit hits[RayPacket::ourLaneCount];
+		const int hitLanes = myWideBVH.Hit(packet, (1 << count) - 1, myGeometry, hits);
+		for (int lane = 0; lane < count; ++lane)
+		{
+			someOutIsHit[first + lane] = (hitLanes & (1 << lane)) != 0;
+			if (someOutIsHit[first + lane])
+				GetSurfaceHit(someRays[first + lane], hits[lane], someOutHits[first + lane]);
+		}
+	}
+
+	if (leftoverCount > 0)
+		HitInterleaved(someRays, leftovers, leftoverCount, someOutHits, someOutIsHit);
+}
+
+bool CScene::Occluded(const Ray& aRay, float aMaxT)
+{
+	Ray ray = aRay;
+	ray.SetMaxT(aMaxT);
+	if (myUseWideBVH)
+		return myWideBVH.Occluded(ray, myGeometry);
+	return myBVH.Occluded(ray, myGeometry);
+}
+
+void CScene::Occluded(const Ray* someRays, const float* someMaxTs, int aCount, bool* someOutIsOccluded)
+{
+	for (int first = 0; first < aCount; first += RayPacket::ourLaneCount)
+	{
+		const int count = aCount - first < RayPacket::ourLaneCount ? aCount - first : RayPacket::ourLaneCount;
+		RayPacket packet;
+		if (!myUseWideBVH || !CreatePacket(someRays + first, count, packet))
+		{
+			for (int i = first; i < first + count; ++i)
+				someOutIsOccluded[i] = Occluded(someRays[i], someMaxTs[i]);
+			continue;
 		}
+
+		for (int lane = 0; lane < count; ++lane)
+			packet.myMaxT[lane] = someMaxTs[first + lane];
+		const int occludedLanes = myWideBVH.Occluded(packet, (1 << count) - 1, myGeometry);
+		for (int lane = 0; lane < count; ++lane)
+			someOutIsOccluded[first + lane] = (occludedLanes & (1 << lane)) != 0;
 	}
-	return isHit;
 }
\ No newline at end of file
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "Util.h"
+#include "Sampler.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+// Photons that reached a diffuse surface from a light through mirrors and glass only, stored in a hash grid.
+// The grid's cells are twice the gather radius, so a lookup only visits the 2x2x2 cells the gather sphere can touch.
+// Cells are hashed into a table about twice the photon count, a counting sort then packs the photons of every bucket together.
+// Most shading points are nowhere near a caustic, a coarse bit grid over the photons' bounds lets those skip the hash grid.
+class CausticPhotonMap
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	struct Settings
+	{
+		// Photons traced from the lights, stored photons are a subset of them, so this bounds the map's memory
+		int myPhotonCount = 1000000;
+		float myGatherRadius = 0.1f;
+	};
+
+	struct Photon
+	{
+		Vector3f myPosition;
+		Vector3f myPower;
+		Vector3f myNormal; // of the surface it landed on
+	};
+
+	// Takes over somePhotons
+	void Build(std::vector<Photon>& somePhotons, float aGatherRadius);
+	inline bool IsEnabled() const { return !myCellStarts.empty(); }
+	inline size_t GetPhotonCount() const { return myPhotons.size(); }
+
+	// Caustic irradiance at aPoint on a surface facing aNormal, photons are weighted with an Epanechnikov kernel
+	inline Vector3f GetIrradiance(const Vector3f& aPoint, const Vector3f& aNormal) const;
+
+private:
+	inline uint32_t GetBucket(int aX, int aY, int aZ) const;
+	inline int GetCellCoordinate(float aValue) const { return (int)std::floor(aValue * myInverseCellSize); }
+	inline int GetOccupancyIndex(int aX, int aY, int aZ) const { return (aZ * ourOccupancyResolution + aY) * ourOccupancyResolution + aX; }
+
+	static constexpr int ourOccupancyResolution = 64;
+
+	std::vector<Photon> myPhotons;
+	// Photons of bucket i are myPhotons[myCellStarts[i], myCellStarts[i + 1])
+	std::vector<uint32_t> myCellStarts;
+	uint32_t myBucketMask = 0;
+	float myGatherRadius = 0.f;
+	float myInverseCellSize = 0.f;
+	// Bounds of the photons grown by the gather radius
+	Vector3f myMin;
+	Vector3f myMax;
+	Vector3f myOccupancyScale;
+	// One bit per cell of the coarse grid, set where a gather sphere could reach a photon
+	std::vector<uint64_t> myOccupancy;
+};
+
+void CausticPhotonMap::Build(std::vector<Photon>& somePhotons, float aGatherRadius)
+{
+	myGatherRadius = aGatherRadius;
+	myInverseCellSize = 1.f / (2.f * aGatherRadius);
+
+	uint32_t bucketCount = 1;
+	while (bucketCount < 2 * somePhotons.size())
+		bucketCount <<= 1;
+	myBucketMask = bucketCount - 1;
+
+	const float infinity = std::numeric_limits<float>::infinity();
+	myMin = Vector3f(infinity, infinity, infinity);
+	myMax = -myMin;
+	for (const Photon& photon : somePhotons)
+	{
+		myMin = Vector3f(std::min(myMin.x, photon.myPosition.x), std::min(myMin.y, photon.myPosition.y), std::min(myMin.z, photon.myPosition.z));
+		myMax = Vector3f(std::max(myMax.x, photon.myPosition.x), std::max(myMax.y, photon.myPosition.y), std::max(myMax.z, photon.myPosition.z));
+	}
+	myMin -= Vector3f(aGatherRadius, aGatherRadius, aGatherRadius);
+	myMax += Vector3f(aGatherRadius, aGatherRadius, aGatherRadius);
+
+	const int occupancyCells = ourOccupancyResolution * ourOccupancyResolution * ourOccupancyResolution;
+	myOccupancy.assign(occupancyCells / 64, 0);
+	myOccupancyScale = Vector3f((float)ourOccupancyResolution, (float)ourOccupancyResolution, (float)ourOccupancyResolution) / (myMax - myMin);
+	for (const Photon& photon : somePhotons)
+	{
+		// Every coarse cell the photon's gather sphere bounds touch
+		const Vector3f low = (photon.myPosition - Vector3f(aGatherRadius, aGatherRadius, aGatherRadius) - myMin) * myOccupancyScale;
+		const Vector3f high = (photon.myPosition + Vector3f(aGatherRadius, aGatherRadius, aGatherRadius) - myMin) * myOccupancyScale;
+		const int lowX = std::max((int)low.x, 0);
+		const int lowY = std::max((int)low.y, 0);
+		const int lowZ = std::max((int)low.z, 0);
+		const int highX = std::min((int)high.x, ourOccupancyResolution - 1);
+		const int highY = std::min((int)high.y, ourOccupancyResolution - 1);
+		const int highZ = std::min((int)high.z, ourOccupancyResolution - 1);
+		for (int z = lowZ; z <= highZ; ++z)
+		{
+			for (int y = lowY; y <= highY; ++y)
+			{
+				for (int x = lowX; x <= highX; ++x)
+				{
+					const int index = GetOccupancyIndex(x, y, z);
+					myOccupancy[index / 64] |= 1ull << (index % 64);
+				}
+			}
+		}
+	}
+
+	std::vector<uint32_t> buckets(somePhotons.size());
+	myCellStarts.assign(bucketCount + 1, 0);
+	for (size_t i = 0; i < somePhotons.size(); ++i)
+	{
+		const Vector3f& position = somePhotons[i].myPosition;
+		buckets[i] = GetBucket(GetCellCoordinate(position.x), GetCellCoordinate(position.y), GetCellCoordinate(position.z));
+		++myCellStarts[buckets[i] + 1];
+	}
+	for (uint32_t bucket = 0; bucket < bucketCount; ++bucket)
+		myCellStarts[bucket + 1] += myCellStarts[bucket];
+
+	std::vector<uint32_t> next(myCellStarts.begin(), myCellStarts.end() - 1);
+	myPhotons.resize(somePhotons.size());
+	for (size_t i = 0; i < somePhotons.size(); ++i)
+		myPhotons[next[buckets[i]]++] = somePhotons[i];
+
+	somePhotons.clear();
+	somePhotons.shrink_to_fit();
+}
+
+uint32_t CausticPhotonMap::GetBucket(int aX, int aY, int aZ) const
+{
+	return SamplerUtil::Hash(SamplerUtil::Hash((uint32_t)aX, (uint32_t)aY), (uint32_t)aZ) & myBucketMask;
+}
+
+CommonUtilities::Vector3<float> CausticPhotonMap::GetIrradiance(const Vector3f& aPoint, const Vector3f& aNormal) const
+{
+	if (!(aPoint.x >= myMin.x && aPoint.y >= myMin.y && aPoint.z >= myMin.z && aPoint.x <= myMax.x && aPoint.y <= myMax.y && aPoint.z <= myMax.z))
+		return Vector3f();
+
+	const Vector3f occupancyCell = (aPoint - myMin) * myOccupancyScale;
+	const int occupancyIndex = GetOccupancyIndex(std::min((int)occupancyCell.x, ourOccupancyResolution - 1), std::min((int)occupancyCell.y, ourOccupancyResolution - 1), std::min((int)occupancyCell.z, ourOccupancyResolution - 1));
+	if (!(myOccupancy[occupancyIndex / 64] & (1ull << (occupancyIndex % 64))))
+		return Vector3f();
+
+	// The gather sphere reaches into the neighbour cell on the side of the cell's center aPoint is on
+	const float radiusSqr = myGatherRadius * myGatherRadius;
+	int first[3];
+	const float point[3] = { aPoint.x, aPoint.y, aPoint.z };
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float cell = point[axis] * myInverseCellSize;
+		first[axis] = (int)std::floor(cell - 0.5f);
+	}
+
+	Vector3f sum;
+	uint32_t visited[8];
+	int visitedCount = 0;
+	for (int z = first[2]; z <= first[2] + 1; ++z)
+	{
+		for (int y = first[1]; y <= first[1] + 1; ++y)
+		{
+			for (int x = first[0]; x <= first[0] + 1; ++x)
+			{
+				// Two of the cells can share a bucket, which must only be counted once
+				const uint32_t bucket = GetBucket(x, y, z);
+				if (std::find(visited, visited + visitedCount, bucket) != visited + visitedCount)
+					continue;
+				visited[visitedCount++] = bucket;
+
+				for (uint32_t i = myCellStarts[bucket]; i < myCellStarts[bucket + 1]; ++i)
+				{
+					// Buckets can hold photons of other cells, so the distance test also filters those out
+					const Photon& photon = myPhotons[i];
+					const float distanceSqr = (photon.myPosition - aPoint).LengthSqr();
+					if (distanceSqr >= radiusSqr || photon.myNormal.Dot(aNormal) < 0.5f)
+						continue;
+
+					sum += photon.myPower * (1.f - distanceSqr / radiusSqr);
+				}
+			}
+		}
+	}
+
+	// The Epanechnikov kernel integrates to pi r^2 / 2 over the disc
+	return sum * (2.f / (PI * radiusSqr));
+}
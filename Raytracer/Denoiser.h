@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Film.h"
+#include "ThreadPool.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al.) with the variance guided luminance weight of SVGF (Schied et al.).
+// Every iteration blurs with a 5x5 B3 spline whose taps are spread 2^iteration pixels apart,
+// and weighs each tap down by how much its normal, depth, albedo and luminance differ from the center pixel.
+// Luminance differences are measured in standard deviations of the center pixel's mean, so noisy pixels are smoothed more than converged ones.
+namespace Denoiser
+{
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	struct Settings
+	{
+		int myIterations = 5;
+		float myLuminanceSigma = 4.f;
+		float myNormalPower = 128.f;
+		// Accepted depth difference relative to the center's depth, per pixel of distance
+		float myDepthSigma = 0.1f;
+		float myAlbedoSigma = 0.1f;
+	};
+
+	inline float GetLuminance(const Vector3f& aColor)
+	{
+		return 0.2126f * aColor.x + 0.7152f * aColor.y + 0.0722f * aColor.z;
+	}
+
+	// 3x3 gaussian of the variance around the pixel, the estimate of a single pixel is too noisy to steer the luminance weight
+	inline float GetBlurredVariance(const std::vector<float>& someVariances, int aWidth, int aHeight, int aX, int aY)
+	{
+		static const float kernel[2] = { 0.25f, 0.125f };
+		float sum = 0.f;
+		float weightSum = 0.f;
+		for (int y = std::max(aY - 1, 0); y <= std::min(aY + 1, aHeight - 1); ++y)
+		{
+			for (int x = std::max(aX - 1, 0); x <= std::min(aX + 1, aWidth - 1); ++x)
+			{
+				const float weight = kernel[std::abs(x - aX)] * kernel[std::abs(y - aY)];
+				sum += someVariances[y * aWidth + x] * weight;
+				weightSum += weight;
+			}
+		}
+		return sum / weightSum;
+	}
+
+	// The denoised color of every pixel of aFilm, indexed y * width + x in the film's coordinates
+	inline std::vector<Vector3f> Denoise(const Film& aFilm, ThreadPool& aThreadPool, const Settings& someSettings, int aTileSize)
+	{
+		static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+		const int width = aFilm.GetWidth();
+		const int height = aFilm.GetHeight();
+
+		std::vector<FeatureSample> features(width * height);
+		std::vector<Vector3f> colors(width * height);
+		std::vector<float> variances(width * height);
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				features[y * width + x] = aFilm.GetFeatures(x, y);
+				colors[y * width + x] = aFilm.GetColor(x, y);
+				variances[y * width + x] = aFilm.GetMeanVariance(x, y);
+			}
+		}
+
+		std::vector<Vector3f> nextColors(width * height);
+		std::vector<float> nextVariances(width * height);
+		const float albedoScale = 1.f / (someSettings.myAlbedoSigma * someSettings.myAlbedoSigma);
+		for (int iteration = 0; iteration < someSettings.myIterations; ++iteration)
+		{
+			const int step = 1 << iteration;
+			aThreadPool.ForEachTile(width, height, aTileSize, [&](const Tile& aTile, int)
+			{
+				for (int y = aTile.myY; y < aTile.myY + aTile.myHeight; ++y)
+				{
+					for (int x = aTile.myX; x < aTile.myX + aTile.myWidth; ++x)
+					{
+						const int center = y * width + x;
+						const FeatureSample& centerFeatures = features[center];
+						const float centerLuminance = GetLuminance(colors[center]);
+						const float luminanceScale = 1.f / (someSettings.myLuminanceSigma * std::sqrt(GetBlurredVariance(variances, width, height, x, y)) + 1e-4f);
+						const float depthScale = 1.f / (someSettings.myDepthSigma * centerFeatures.myDepth * step + 1e-4f);
+
+						Vector3f colorSum;
+						float varianceSum = 0.f;
+						float weightSum = 0.f;
+						for (int dy = -2; dy <= 2; ++dy)
+						{
+							const int tapY = y + dy * step;
+							if (tapY < 0 || tapY >= height)
+								continue;
+
+							for (int dx = -2; dx <= 2; ++dx)
+							{
+								const int tapX = x + dx * step;
+								if (tapX < 0 || tapX >= width)
+									continue;
+
+								const int tap = tapY * width + tapX;
+								float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+								if (tap != center)
+								{
+									const FeatureSample& tapFeatures = features[tap];
+
+									// pow(cos, 128) by squaring
+									float normalWeight = std::max(centerFeatures.myNormal.Dot(tapFeatures.myNormal), 0.f);
+									for (float power = 1.f; power < someSettings.myNormalPower; power *= 2.f)
+										normalWeight *= normalWeight;
+
+									const float distance = std::sqrt((float)(dx * dx + dy * dy));
+									const float depthDifference = std::fabs(centerFeatures.myDepth - tapFeatures.myDepth) * depthScale / distance;
+									const float albedoDifference = (centerFeatures.myAlbedo - tapFeatures.myAlbedo).LengthSqr() * albedoScale;
+									const float luminanceDifference = std::fabs(centerLuminance - GetLuminance(colors[tap])) * luminanceScale;
+									weight *= normalWeight * std::exp(-(depthDifference + albedoDifference + luminanceDifference));
+								}
+
+								colorSum += colors[tap] * weight;
+								varianceSum += variances[tap] * weight * weight;
+								weightSum += weight;
+							}
+						}
+
+						nextColors[center] = colorSum / weightSum;
+						nextVariances[center] = varianceSum / (weightSum * weightSum);
+					}
+				}
+			});
+
+			colors.swap(nextColors);
+			variances.swap(nextVariances);
+		}
+
+		return colors;
+	}
+}
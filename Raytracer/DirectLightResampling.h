@@ -0,0 +1,81 @@
+#pragma once
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+
+// A light sample picked by weighted reservoir sampling from a stream of candidates, after Bitterli et al., "Spatiotemporal reservoir resampling".
+// Only the picked sample, the weight sum and the candidate count are kept, so reservoirs from neighbouring pixels
+// and earlier passes merge in constant time however many candidates went into them.
+struct LightReservoir
+{
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	Vector3f myLightPoint;
+	Vector3f myShadingPoint; // the reservoir was built for, neighbours only reuse it if their shading point is similar
+	Vector3f myShadingNormal;
+	float myWeightSum = 0.f;
+	float myTargetPdf = 0.f; // of the picked sample at myShadingPoint
+	float myWeight = 0.f; // unbiased contribution weight of the picked sample, 0 if it turned out to be occluded
+	int myCount = 0;
+	int myLight = -1;
+
+	// Streams in a candidate that stands for aCount earlier ones, picked with probability aWeight / myWeightSum by aSample in [0, 1)
+	inline void Update(int aLight, const Vector3f& aLightPoint, float aTargetPdf, float aWeight, int aCount, float aSample)
+	{
+		myWeightSum += aWeight;
+		myCount += aCount;
+		if (aWeight > 0.f && aSample * myWeightSum < aWeight)
+		{
+			myLight = aLight;
+			myLightPoint = aLightPoint;
+			myTargetPdf = aTargetPdf;
+		}
+	}
+};
+
+// The reservoir of every pixel's first diffuse hit, for the pass being rendered and for the one before it.
+// A pass only writes its own pixels of the current buffer and only reads the previous one, so render threads never share a reservoir.
+class DirectLightResampling
+{
+public:
+	struct Settings
+	{
+		// Lights sampled at every shading point, the cost per pixel doesn't depend on the number of lights
+		int myCandidateCount = 8;
+		// Reservoirs of the previous pass reused from random pixels within mySpatialRadius
+		int mySpatialNeighbours = 3;
+		int mySpatialRadius = 16;
+		// Reused reservoirs count as at most this many times myCandidateCount, so old samples can't take over
+		int myMaxHistory = 5;
+	};
+
+	inline void Initialize(int aWidth, int aHeight, const Settings& someSettings)
+	{
+		mySettings = someSettings;
+		myWidth = aWidth;
+		myHeight = aHeight;
+		myCurrent.assign(aWidth * aHeight, LightReservoir());
+		myPrevious.assign(aWidth * aHeight, LightReservoir());
+	}
+
+	inline bool IsEnabled() const { return !myCurrent.empty(); }
+	inline const Settings& GetSettings() const { return mySettings; }
+	inline int GetWidth() const { return myWidth; }
+	inline int GetHeight() const { return myHeight; }
+
+	inline LightReservoir& GetCurrent(int aPixel) { return myCurrent[aPixel]; }
+	inline const LightReservoir& GetPrevious(int aPixel) const { return myPrevious[aPixel]; }
+
+	// The reservoirs just rendered become the ones the next pass reuses
+	inline void EndPass() { myPrevious.swap(myCurrent); }
+
+private:
+	Settings mySettings;
+	int myWidth = 0;
+	int myHeight = 0;
+	std::vector<LightReservoir> myCurrent;
+	std::vector<LightReservoir> myPrevious;
+};
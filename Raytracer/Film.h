@@ -0,0 +1,127 @@
+#pragma once
+
+#include "Util.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+
+// Where a camera path first reached a surface that isn't a mirror or glass, used to guide the denoiser
+struct FeatureSample
+{
+	CommonUtilities::Vector3<float> myAlbedo; // times the color of the mirrors on the way
+	CommonUtilities::Vector3<float> myNormal;
+	float myDepth = 0.f; // distance travelled along the path, ourMissDepth further if it left the scene
+
+	static constexpr float ourMissDepth = 10000.f;
+};
+
+// Accumulates the samples of every pixel, along with the running mean and variance of their luminance.
+// Pixels are addressed in scene coordinates, y up.
+class Film
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	Film(int aWidth, int aHeight) : myWidth(aWidth), myHeight(aHeight), myPixels(aWidth * aHeight) {}
+
+	// Not thread safe per pixel, every pixel is expected to be sampled by one thread at a time
+	inline void AddSample(int aX, int aY, const Vector3f& aColor);
+	inline void AddSample(int aX, int aY, const Vector3f& aColor, const FeatureSample& someFeatures);
+
+	inline Vector3f GetColor(int aX, int aY) const;
+	inline int GetSampleCount(int aX, int aY) const { return myPixels[aY * myWidth + aX].myCount; }
+	// Width of the 95% confidence interval of the pixel's mean luminance, tone mapped to the displayed 0-1 range
+	inline float GetDisplayedError(int aX, int aY) const;
+	// Variance of the pixel's mean luminance
+	inline float GetMeanVariance(int aX, int aY) const;
+
+	// Averages of the features added with the samples
+	inline FeatureSample GetFeatures(int aX, int aY) const;
+
+	inline int GetWidth() const { return myWidth; }
+	inline int GetHeight() const { return myHeight; }
+
+private:
+	struct Pixel
+	{
+		Vector3f mySum;
+		float myLuminanceMean = 0.f;
+		float myLuminanceSquaredDistances = 0.f;
+		int myCount = 0;
+		FeatureSample myFeatureSum;
+	};
+
+	int myWidth;
+	int myHeight;
+	std::vector<Pixel> myPixels;
+};
+
+void Film::AddSample(int aX, int aY, const Vector3f& aColor)
+{
+	Pixel& pixel = myPixels[aY * myWidth + aX];
+	pixel.mySum += aColor;
+	++pixel.myCount;
+
+	// Welford's running variance
+	const float luminance = 0.2126f * aColor.x + 0.7152f * aColor.y + 0.0722f * aColor.z;
+	const float delta = luminance - pixel.myLuminanceMean;
+	pixel.myLuminanceMean += delta / pixel.myCount;
+	pixel.myLuminanceSquaredDistances += delta * (luminance - pixel.myLuminanceMean);
+}
+
+void Film::AddSample(int aX, int aY, const Vector3f& aColor, const FeatureSample& someFeatures)
+{
+	AddSample(aX, aY, aColor);
+
+	FeatureSample& sum = myPixels[aY * myWidth + aX].myFeatureSum;
+	sum.myAlbedo += someFeatures.myAlbedo;
+	sum.myNormal += someFeatures.myNormal;
+	sum.myDepth += someFeatures.myDepth;
+}
+
+CommonUtilities::Vector3<float> Film::GetColor(int aX, int aY) const
+{
+	const Pixel& pixel = myPixels[aY * myWidth + aX];
+	if (pixel.myCount == 0)
+		return Vector3f();
+
+	return pixel.mySum / (float)pixel.myCount;
+}
+
+float Film::GetDisplayedError(int aX, int aY) const
+{
+	const Pixel& pixel = myPixels[aY * myWidth + aX];
+	if (pixel.myCount < 2)
+		return 1.f;
+
+	const float mean = pixel.myLuminanceMean;
+	const float interval = 1.96f * std::sqrt(pixel.myLuminanceSquaredDistances / ((pixel.myCount - 1.f) * pixel.myCount));
+	return LinearToSrgb(ACESFilm(mean + interval)) - LinearToSrgb(ACESFilm(std::fmax(mean - interval, 0.f)));
+}
+
+float Film::GetMeanVariance(int aX, int aY) const
+{
+	const Pixel& pixel = myPixels[aY * myWidth + aX];
+	if (pixel.myCount < 2)
+		return 0.f;
+
+	return pixel.myLuminanceSquaredDistances / ((pixel.myCount - 1.f) * pixel.myCount);
+}
+
+FeatureSample Film::GetFeatures(int aX, int aY) const
+{
+	const Pixel& pixel = myPixels[aY * myWidth + aX];
+	FeatureSample features;
+	if (pixel.myCount == 0)
+		return features;
+
+	const float scale = 1.f / pixel.myCount;
+	features.myAlbedo = pixel.myFeatureSum.myAlbedo * scale;
+	features.myNormal = pixel.myFeatureSum.myNormal.LengthSqr() > 0.f ? pixel.myFeatureSum.myNormal.GetNormalized() : Vector3f();
+	features.myDepth = pixel.myFeatureSum.myDepth * scale;
+	return features;
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+#include "Util.h"
+#include "Lights.h"
+#include "Sampler.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+#include "AABB3D.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+enum class LightSelectionType
+{
+	Uniform, // every light equally often
+	Power, // by emitted power
+	Tree // by an estimate of the light reaching the shading point
+};
+
+// Picks the area light a shading point takes its light sample from.
+// Power picks from an alias table in constant time, but still spends most samples on bright lights far away.
+// Tree walks a BVH over the lights from the root, every node holding the bounds and the total power of its lights,
+// and goes down each side with the chance of that side's power over the squared distance to it, times the largest cosine
+// the shading normal can make with a direction into its bounds. That takes log2 of the light count steps.
+// Spheres and boxes emit in every direction, so only the receiving side's orientation bounds the clusters.
+class LightSelection
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	void Build(const std::vector<AreaLight>& someLights, LightSelectionType aType);
+	inline LightSelectionType GetType() const { return myType; }
+
+	// The light for aPoint facing aNormal picked with aSample in [0, 1), and the probability it was picked with.
+	// -1 when no light can reach the point.
+	inline int Sample(const Vector3f& aPoint, const Vector3f& aNormal, float aSample, float& aOutProbability) const;
+	// Probability that Sample picks aLight for aPoint facing aNormal
+	inline float GetProbability(const Vector3f& aPoint, const Vector3f& aNormal, int aLight) const;
+
+	size_t GetNodeCount() const { return myNodes.size(); }
+
+private:
+	struct AliasBin
+	{
+		float myProbability; // of keeping the bin's own light
+		int myAlias; // the light taken otherwise
+	};
+
+	struct Node
+	{
+		Vector3f myMin;
+		Vector3f myMax;
+		float myPower;
+		int myIndex; // the first of the two children, or the light of a leaf
+		bool myIsLeaf;
+	};
+
+	void BuildNode(int aNode, int aFirst, int aLast, std::vector<int>& someOrder, const std::vector<CommonUtilities::AABB3D<float>>& someBounds, const std::vector<float>& somePowers, uint64_t aTrail, int aDepth);
+	inline float GetImportance(const Node& aNode, const Vector3f& aPoint, const Vector3f& aNormal) const;
+
+	LightSelectionType myType = LightSelectionType::Uniform;
+	int myLightCount = 0;
+
+	std::vector<float> myPowerProbabilities;
+	std::vector<AliasBin> myAliasTable;
+
+	std::vector<Node> myNodes;
+	// Path from the root to every light's leaf, bit i is set where it goes to the second child at depth i
+	std::vector<uint64_t> myTrails;
+};
+
+void LightSelection::Build(const std::vector<AreaLight>& someLights, LightSelectionType aType)
+{
+	myType = aType;
+	myLightCount = (int)someLights.size();
+	myPowerProbabilities.clear();
+	myAliasTable.clear();
+	myNodes.clear();
+	myTrails.clear();
+	if (someLights.empty() || aType == LightSelectionType::Uniform)
+		return;
+
+	std::vector<float> powers(someLights.size());
+	float totalPower = 0.f;
+	for (size_t i = 0; i < someLights.size(); ++i)
+	{
+		powers[i] = someLights[i].GetPower();
+		totalPower += powers[i];
+	}
+
+	// Lights that don't shine at all can't be found by selecting them either
+	if (!(totalPower > 0.f))
+	{
+		myType = LightSelectionType::Uniform;
+		return;
+	}
+
+	if (aType == LightSelectionType::Power)
+	{
+		// Vose's alias method: every bin keeps its own light with some probability and gives the rest to one light that has too much
+		myPowerProbabilities.resize(someLights.size());
+		myAliasTable.resize(someLights.size());
+		std::vector<float> scaled(someLights.size());
+		std::vector<int> small;
+		std::vector<int> large;
+		for (int i = 0; i < myLightCount; ++i)
+		{
+			myPowerProbabilities[i] = powers[i] / totalPower;
+			scaled[i] = myPowerProbabilities[i] * myLightCount;
+			(scaled[i] < 1.f ? small : large).push_back(i);
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			const int smallLight = small.back();
+			const int largeLight = large.back();
+			small.pop_back();
+			myAliasTable[smallLight] = { scaled[smallLight], largeLight };
+			scaled[largeLight] -= 1.f - scaled[smallLight];
+			if (scaled[largeLight] < 1.f)
+			{
+				large.pop_back();
+				small.push_back(largeLight);
+			}
+		}
+
+		// What is left is 1 up to rounding
+		for (int light : small)
+			myAliasTable[light] = { 1.f, light };
+		for (int light : large)
+			myAliasTable[light] = { 1.f, light };
+		return;
+	}
+
+	std::vector<CommonUtilities::AABB3D<float>> bounds(someLights.size());
+	std::vector<int> order(someLights.size());
+	for (int i = 0; i < myLightCount; ++i)
+	{
+		bounds[i] = someLights[i].GetBounds();
+		order[i] = i;
+	}
+
+	myNodes.reserve(2 * someLights.size() - 1);
+	myNodes.push_back(Node());
+	myTrails.assign(someLights.size(), 0);
+	BuildNode(0, 0, myLightCount, order, bounds, powers, 0, 0);
+}
+
+void LightSelection::BuildNode(int aNode, int aFirst, int aLast, std::vector<int>& someOrder, const std::vector<CommonUtilities::AABB3D<float>>& someBounds, const std::vector<float>& somePowers, uint64_t aTrail, int aDepth)
+{
+	const float infinity = std::numeric_limits<float>::infinity();
+	Vector3f min(infinity, infinity, infinity);
+	Vector3f max = -min;
+	Vector3f centerMin = min;
+	Vector3f centerMax = max;
+	float power = 0.f;
+	for (int i = aFirst; i < aLast; ++i)
+	{
+		const CommonUtilities::AABB3D<float>& lightBounds = someBounds[someOrder[i]];
+		const Vector3f center = (lightBounds.GetMin() + lightBounds.GetMax()) * 0.5f;
+		min = Vector3f(std::min(min.x, lightBounds.GetMin().x), std::min(min.y, lightBounds.GetMin().y), std::min(min.z, lightBounds.GetMin().z));
+		max = Vector3f(std::max(max.x, lightBounds.GetMax().x), std::max(max.y, lightBounds.GetMax().y), std::max(max.z, lightBounds.GetMax().z));
+		centerMin = Vector3f(std::min(centerMin.x, center.x), std::min(centerMin.y, center.y), std::min(centerMin.z, center.z));
+		centerMax = Vector3f(std::max(centerMax.x, center.x), std::max(centerMax.y, center.y), std::max(centerMax.z, center.z));
+		power += somePowers[someOrder[i]];
+	}
+
+	myNodes[aNode] = { min, max, power, someOrder[aFirst], aLast - aFirst == 1 };
+	if (aLast - aFirst == 1)
+	{
+		myTrails[someOrder[aFirst]] = aTrail;
+		return;
+	}
+
+	// Halves by count along the widest axis of the light centers, so the tree is never deeper than the 64 bits of a trail
+	const Vector3f extent = centerMax - centerMin;
+	const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	const int middle = (aFirst + aLast) / 2;
+	std::nth_element(someOrder.begin() + aFirst, someOrder.begin() + middle, someOrder.begin() + aLast, [&](int aLeft, int aRight)
+	{
+		const Vector3f left = someBounds[aLeft].GetMin() + someBounds[aLeft].GetMax();
+		const Vector3f right = someBounds[aRight].GetMin() + someBounds[aRight].GetMax();
+		return (&left.x)[axis] < (&right.x)[axis];
+	});
+
+	const int child = (int)myNodes.size();
+	myNodes.resize(child + 2);
+	myNodes[aNode].myIndex = child;
+	BuildNode(child, aFirst, middle, someOrder, someBounds, somePowers, aTrail, aDepth + 1);
+	BuildNode(child + 1, middle, aLast, someOrder, someBounds, somePowers, aTrail | (1ull << aDepth), aDepth + 1);
+}
+
+float LightSelection::GetImportance(const Node& aNode, const Vector3f& aPoint, const Vector3f& aNormal) const
+{
+	const Vector3f center = (aNode.myMin + aNode.myMax) * 0.5f;
+	const float radiusSqr = (aNode.myMax - center).LengthSqr();
+	const Vector3f toCenter = center - aPoint;
+	const float distanceSqr = toCenter.LengthSqr();
+
+	// Within the sphere around the bounds light can come from any direction, and the distance can't be bounded from below
+	if (distanceSqr <= radiusSqr)
+		return aNode.myPower / radiusSqr;
+
+	// The sphere around the bounds subtends a cone, the cosine of the angle between the normal and the cone's closest direction
+	const float distance = std::sqrt(distanceSqr);
+	const float cosine = aNormal.Dot(toCenter) / distance;
+	const float sinCone = std::sqrt(radiusSqr / distanceSqr);
+	const float cosCone = std::sqrt(1.f - sinCone * sinCone);
+	const float closestCosine = cosine >= cosCone ? 1.f : cosine * cosCone + std::sqrt(std::max(0.f, 1.f - cosine * cosine)) * sinCone;
+	if (closestCosine <= 0.f)
+		return 0.f;
+
+	return aNode.myPower * closestCosine / distanceSqr;
+}
+
+int LightSelection::Sample(const Vector3f& aPoint, const Vector3f& aNormal, float aSample, float& aOutProbability) const
+{
+	if (myType == LightSelectionType::Uniform)
+	{
+		aOutProbability = 1.f / myLightCount;
+		return std::min((int)(aSample * myLightCount), myLightCount - 1);
+	}
+
+	if (myType == LightSelectionType::Power)
+	{
+		const float scaled = aSample * myLightCount;
+		const int bin = std::min((int)scaled, myLightCount - 1);
+		const int light = scaled - bin < myAliasTable[bin].myProbability ? bin : myAliasTable[bin].myAlias;
+		aOutProbability = myPowerProbabilities[light];
+		return light;
+	}
+
+	// Every step rescales what is left of aSample to [0, 1) for the next one
+	float probability = 1.f;
+	const Node* node = &myNodes[0];
+	while (!node->myIsLeaf)
+	{
+		const float first = GetImportance(myNodes[node->myIndex], aPoint, aNormal);
+		const float second = GetImportance(myNodes[node->myIndex + 1], aPoint, aNormal);
+		if (!(first + second > 0.f))
+			return -1;
+
+		const float firstProbability = first / (first + second);
+		if (aSample < firstProbability)
+		{
+			aSample = std::min(aSample / firstProbability, SamplerUtil::OneMinusEpsilon);
+			probability *= firstProbability;
+			node = &myNodes[node->myIndex];
+		}
+		else
+		{
+			aSample = std::min((aSample - firstProbability) / (1.f - firstProbability), SamplerUtil::OneMinusEpsilon);
+			probability *= 1.f - firstProbability;
+			node = &myNodes[node->myIndex + 1];
+		}
+	}
+
+	aOutProbability = probability;
+	return node->myIndex;
+}
+
+float LightSelection::GetProbability(const Vector3f& aPoint, const Vector3f& aNormal, int aLight) const
+{
+	if (myType == LightSelectionType::Uniform)
+		return 1.f / myLightCount;
+	if (myType == LightSelectionType::Power)
+		return myPowerProbabilities[aLight];
+
+	float probability = 1.f;
+	uint64_t trail = myTrails[aLight];
+	const Node* node = &myNodes[0];
+	while (!node->myIsLeaf)
+	{
+		const float first = GetImportance(myNodes[node->myIndex], aPoint, aNormal);
+		const float second = GetImportance(myNodes[node->myIndex + 1], aPoint, aNormal);
+		if (!(first + second > 0.f))
+			return 0.f;
+
+		const bool isSecond = (trail & 1) != 0;
+		probability *= (isSecond ? second : first) / (first + second);
+		node = &myNodes[node->myIndex + (isSecond ? 1 : 0)];
+		trail >>= 1;
+	}
+	return probability;
+}
+
+// "uniform", "power" or "tree"
+inline bool ParseLightSelectionType(const char* aName, LightSelectionType& anOutType)
+{
+	if (std::strcmp(aName, "uniform") == 0)
+		anOutType = LightSelectionType::Uniform;
+	else if (std::strcmp(aName, "power") == 0)
+		anOutType = LightSelectionType::Power;
+	else if (std::strcmp(aName, "tree") == 0)
+		anOutType = LightSelectionType::Tree;
+	else
+		return false;
+	return true;
+}
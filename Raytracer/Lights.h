@@ -0,0 +1,301 @@
+#pragma once
+
+#include "Util.h"
+#include "SceneGeometry.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+#include "AABB3D.hpp"
+#include "Sphere.hpp"
+
+// stdlib
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// A direction from a shading point towards a point on a light
+struct LightSample
+{
+	CommonUtilities::Vector3<float> myDirection;
+	float myDistance;
+	float myPdf; // solid angle density of myDirection
+};
+
+// Multiple importance sampling weight of the strategy with density aPdf against one with anOtherPdf
+inline float PowerHeuristic(const float aPdf, const float anOtherPdf)
+{
+	const float pdfSqr = aPdf * aPdf;
+	return pdfSqr / (pdfSqr + anOtherPdf * anOtherPdf);
+}
+
+// An emissive sphere or box, sampled by solid angle as seen from the point being shaded.
+// Spheres sample the cone they subtend, boxes sample the area of the faces turned towards the point.
+class AreaLight
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	static AreaLight CreateSphere(const CommonUtilities::Sphere<float>& aSphere, const Vector3f& aRadiance);
+	static AreaLight CreateAABB(const CommonUtilities::AABB3D<float>& anAABB, const Vector3f& aRadiance);
+
+	// Picks a direction from aPoint towards the light with the random numbers anU and aV, false if aPoint is inside the light
+	bool Sample(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const;
+	// Solid angle density of Sample picking the direction from aPoint to aLightPoint, which has the surface normal aLightNormal
+	float GetPdf(const Vector3f& aPoint, const Vector3f& aLightPoint, const Vector3f& aLightNormal) const;
+
+	// A point on the surface of the light, uniform by area, and the outward normal there
+	void SamplePoint(float anU, float aV, Vector3f& aOutPoint, Vector3f& aOutNormal) const;
+	float GetArea() const;
+	// Luminance of the radiance times the area times pi, what the light sends out over all of its surface
+	float GetPower() const;
+	CommonUtilities::AABB3D<float> GetBounds() const;
+	// Outward normal at aLightPoint on the light's surface
+	Vector3f GetNormal(const Vector3f& aLightPoint) const;
+
+	inline const Vector3f& GetRadiance() const { return myRadiance; }
+
+private:
+	bool SampleSphere(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const;
+	bool SampleAABB(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const;
+	// 1 - cos of the half angle of the cone the sphere subtends from aPoint, 0 from inside it
+	float GetSphereConeWidth(const Vector3f& aPoint) const;
+	// Area of the box faces turned towards aPoint, and of each face with the ones turned away as 0
+	float GetVisibleArea(const Vector3f& aPoint, float someOutFaceAreas[6]) const;
+
+	PrimitiveShape myShape = PrimitiveShape::Sphere;
+	CommonUtilities::Sphere<float> mySphere;
+	CommonUtilities::AABB3D<float> myAABB;
+	Vector3f myRadiance;
+};
+
+AreaLight AreaLight::CreateSphere(const CommonUtilities::Sphere<float>& aSphere, const Vector3f& aRadiance)
+{
+	AreaLight light;
+	light.myShape = PrimitiveShape::Sphere;
+	light.mySphere = aSphere;
+	light.myRadiance = aRadiance;
+	return light;
+}
+
+AreaLight AreaLight::CreateAABB(const CommonUtilities::AABB3D<float>& anAABB, const Vector3f& aRadiance)
+{
+	AreaLight light;
+	light.myShape = PrimitiveShape::AABB;
+	light.myAABB = anAABB;
+	light.myRadiance = aRadiance;
+	return light;
+}
+
+bool AreaLight::Sample(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const
+{
+	if (myShape == PrimitiveShape::Sphere)
+		return SampleSphere(aPoint, anU, aV, aOutSample);
+	return SampleAABB(aPoint, anU, aV, aOutSample);
+}
+
+float AreaLight::GetPdf(const Vector3f& aPoint, const Vector3f& aLightPoint, const Vector3f& aLightNormal) const
+{
+	if (myShape == PrimitiveShape::Sphere)
+	{
+		const float coneWidth = GetSphereConeWidth(aPoint);
+		return coneWidth > 0.f ? 1.f / (2.f * PI * coneWidth) : 0.f;
+	}
+
+	float faceAreas[6];
+	const float visibleArea = GetVisibleArea(aPoint, faceAreas);
+	const Vector3f toLight = aLightPoint - aPoint;
+	const float distanceSqr = toLight.LengthSqr();
+	const float cosine = std::fabs(aLightNormal.Dot(toLight)) / std::sqrt(distanceSqr);
+	if (visibleArea <= 0.f || cosine <= 0.f)
+		return 0.f;
+
+	return distanceSqr / (cosine * visibleArea);
+}
+
+void AreaLight::SamplePoint(float anU, float aV, Vector3f& aOutPoint, Vector3f& aOutNormal) const
+{
+	if (myShape == PrimitiveShape::Sphere)
+	{
+		const float z = 1.f - 2.f * anU;
+		const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+		const float phi = 2.f * PI * aV;
+		aOutNormal = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+		aOutPoint = mySphere.GetCenter() + aOutNormal * mySphere.GetRadius();
+		return;
+	}
+
+	// Pick a face by area, and reuse what is left of anU as the first coordinate on it
+	const Vector3f min = myAABB.GetMin();
+	const Vector3f max = myAABB.GetMax();
+	const Vector3f size = max - min;
+	float faceAreas[6];
+	for (int face = 0; face < 6; ++face)
+		faceAreas[face] = (&size.x)[(face / 2 + 1) % 3] * (&size.x)[(face / 2 + 2) % 3];
+
+	float target = anU * GetArea();
+	int face = 0;
+	for (; face < 5 && target >= faceAreas[face]; ++face)
+		target -= faceAreas[face];
+	const float faceU = faceAreas[face] > 0.f ? std::min(target / faceAreas[face], 1.f) : 0.f;
+
+	const int axis = face / 2;
+	const int uAxis = (axis + 1) % 3;
+	const int vAxis = (axis + 2) % 3;
+	(&aOutPoint.x)[axis] = face % 2 == 1 ? (&max.x)[axis] : (&min.x)[axis];
+	(&aOutPoint.x)[uAxis] = (&min.x)[uAxis] + faceU * (&size.x)[uAxis];
+	(&aOutPoint.x)[vAxis] = (&min.x)[vAxis] + aV * (&size.x)[vAxis];
+	aOutNormal = Vector3f();
+	(&aOutNormal.x)[axis] = face % 2 == 1 ? 1.f : -1.f;
+}
+
+float AreaLight::GetArea() const
+{
+	if (myShape == PrimitiveShape::Sphere)
+		return 4.f * PI * mySphere.GetRadius() * mySphere.GetRadius();
+
+	const Vector3f size = myAABB.GetMax() - myAABB.GetMin();
+	return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+float AreaLight::GetPower() const
+{
+	const float luminance = 0.2126f * myRadiance.x + 0.7152f * myRadiance.y + 0.0722f * myRadiance.z;
+	return luminance * GetArea() * PI;
+}
+
+CommonUtilities::AABB3D<float> AreaLight::GetBounds() const
+{
+	if (myShape == PrimitiveShape::AABB)
+		return myAABB;
+
+	const Vector3f radius(mySphere.GetRadius(), mySphere.GetRadius(), mySphere.GetRadius());
+	return CommonUtilities::AABB3D<float>(mySphere.GetCenter() - radius, mySphere.GetCenter() + radius);
+}
+
+CommonUtilities::Vector3<float> AreaLight::GetNormal(const Vector3f& aLightPoint) const
+{
+	if (myShape == PrimitiveShape::Sphere)
+		return (aLightPoint - mySphere.GetCenter()).GetNormalized();
+
+	// The face whose plane the point is closest to
+	const Vector3f min = myAABB.GetMin();
+	const Vector3f max = myAABB.GetMax();
+	int closestFace = 0;
+	float closestDistance = std::numeric_limits<float>::max();
+	for (int face = 0; face < 6; ++face)
+	{
+		const int axis = face / 2;
+		const float distance = std::fabs((&aLightPoint.x)[axis] - (face % 2 == 1 ? (&max.x)[axis] : (&min.x)[axis]));
+		if (distance < closestDistance)
+		{
+			closestDistance = distance;
+			closestFace = face;
+		}
+	}
+
+	Vector3f normal;
+	(&normal.x)[closestFace / 2] = closestFace % 2 == 1 ? 1.f : -1.f;
+	return normal;
+}
+
+float AreaLight::GetSphereConeWidth(const Vector3f& aPoint) const
+{
+	const float distanceSqr = (mySphere.GetCenter() - aPoint).LengthSqr();
+	const float radiusSqr = mySphere.GetRadius() * mySphere.GetRadius();
+	if (distanceSqr <= radiusSqr)
+		return 0.f;
+
+	// 1 - cos written so it keeps its precision for small and distant spheres
+	const float sinSqr = radiusSqr / distanceSqr;
+	return sinSqr / (1.f + std::sqrt(1.f - sinSqr));
+}
+
+bool AreaLight::SampleSphere(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const
+{
+	const float coneWidth = GetSphereConeWidth(aPoint);
+	if (coneWidth <= 0.f)
+		return false;
+
+	const Vector3f toCenter = mySphere.GetCenter() - aPoint;
+	const Vector3f axis = toCenter.GetNormalized();
+	const Vector3f tangent = (std::fabs(axis.x) > 0.9f ? Vector3f(0.f, 1.f, 0.f) : Vector3f(1.f, 0.f, 0.f)).Cross(axis).GetNormalized();
+	const Vector3f bitangent = axis.Cross(tangent);
+
+	// Uniform in the cone, cos theta is uniform between cos theta max and 1
+	const float oneMinusCos = anU * coneWidth;
+	const float cosTheta = 1.f - oneMinusCos;
+	const float sinTheta = std::sqrt(std::max(0.f, oneMinusCos * (2.f - oneMinusCos)));
+	const float phi = 2.f * PI * aV;
+	aOutSample.myDirection = tangent * (std::cos(phi) * sinTheta) + bitangent * (std::sin(phi) * sinTheta) + axis * cosTheta;
+
+	// Nearest intersection with the sphere along the sampled direction
+	const float projection = aOutSample.myDirection.Dot(toCenter);
+	const float discriminant = projection * projection - toCenter.LengthSqr() + mySphere.GetRadius() * mySphere.GetRadius();
+	aOutSample.myDistance = projection - std::sqrt(std::max(0.f, discriminant));
+	aOutSample.myPdf = 1.f / (2.f * PI * coneWidth);
+	return true;
+}
+
+float AreaLight::GetVisibleArea(const Vector3f& aPoint, float someOutFaceAreas[6]) const
+{
+	const Vector3f min = myAABB.GetMin();
+	const Vector3f max = myAABB.GetMax();
+	const Vector3f size = max - min;
+
+	float visibleArea = 0.f;
+	for (int face = 0; face < 6; ++face)
+	{
+		const int axis = face / 2;
+		const bool isMaxFace = face % 2 == 1;
+		const bool isVisible = isMaxFace ? (&aPoint.x)[axis] > (&max.x)[axis] : (&aPoint.x)[axis] < (&min.x)[axis];
+		someOutFaceAreas[face] = isVisible ? (&size.x)[(axis + 1) % 3] * (&size.x)[(axis + 2) % 3] : 0.f;
+		visibleArea += someOutFaceAreas[face];
+	}
+	return visibleArea;
+}
+
+bool AreaLight::SampleAABB(const Vector3f& aPoint, float anU, float aV, LightSample& aOutSample) const
+{
+	float faceAreas[6];
+	const float visibleArea = GetVisibleArea(aPoint, faceAreas);
+	if (visibleArea <= 0.f)
+		return false;
+
+	// Pick a face by area, and reuse what is left of anU as the first coordinate on it
+	float target = anU * visibleArea;
+	int face = 0;
+	for (int i = 0; i < 6; ++i)
+	{
+		if (faceAreas[i] <= 0.f)
+			continue;
+
+		face = i;
+		if (target < faceAreas[i])
+			break;
+		target -= faceAreas[i];
+	}
+	const float faceU = std::min(target / faceAreas[face], 1.f);
+
+	const Vector3f min = myAABB.GetMin();
+	const Vector3f max = myAABB.GetMax();
+	const int axis = face / 2;
+	const int uAxis = (axis + 1) % 3;
+	const int vAxis = (axis + 2) % 3;
+
+	Vector3f lightPoint;
+	(&lightPoint.x)[axis] = face % 2 == 1 ? (&max.x)[axis] : (&min.x)[axis];
+	(&lightPoint.x)[uAxis] = (&min.x)[uAxis] + faceU * ((&max.x)[uAxis] - (&min.x)[uAxis]);
+	(&lightPoint.x)[vAxis] = (&min.x)[vAxis] + aV * ((&max.x)[vAxis] - (&min.x)[vAxis]);
+
+	const Vector3f toLight = lightPoint - aPoint;
+	const float distanceSqr = toLight.LengthSqr();
+	aOutSample.myDistance = std::sqrt(distanceSqr);
+	aOutSample.myDirection = toLight / aOutSample.myDistance;
+
+	const float cosine = std::fabs((&aOutSample.myDirection.x)[axis]);
+	if (cosine <= 0.f)
+		return false;
+
+	aOutSample.myPdf = distanceSqr / (cosine * visibleArea);
+	return true;
+}
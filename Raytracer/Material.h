@@ -0,0 +1,103 @@
+#pragma once
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+
+enum class MaterialType
+{
+	Normal,
+	Mirror,
+	Emissive,
+	Glass
+};
+
+// Index into a MaterialTable, small so primitives and hits stay compact
+using MaterialID = unsigned short;
+
+struct Material
+{
+	CommonUtilities::Vector3<float> myColor;
+	MaterialType myType = MaterialType::Normal;
+	float myRefractiveIndex = 1.f;
+};
+
+// Every material of a scene, primitives and hits refer to them by MaterialID.
+// Materials declared inline on primitives are shared between all primitives that declare the same one.
+class MaterialTable
+{
+public:
+	static constexpr size_t ourMaxCount = 65536;
+
+	void Clear();
+	// Returns false when the table is full
+	bool Add(const Material& aMaterial, MaterialID& aOutID);
+	// A later material with the same name replaces the earlier one for primitives declared after it
+	bool AddNamed(const std::string& aName, const Material& aMaterial, MaterialID& aOutID);
+	bool Find(const std::string& aName, MaterialID& aOutID) const;
+
+	inline const Material& operator[](const MaterialID anID) const { return myMaterials[anID]; }
+	inline size_t GetCount() const { return myMaterials.size(); }
+
+private:
+	using Key = std::tuple<float, float, float, int, float>;
+	static inline Key GetKey(const Material& aMaterial)
+	{
+		return Key(aMaterial.myColor.x, aMaterial.myColor.y, aMaterial.myColor.z, (int)aMaterial.myType, aMaterial.myRefractiveIndex);
+	}
+
+	std::vector<Material> myMaterials;
+	std::map<Key, MaterialID> myInlineMaterials;
+	std::map<std::string, MaterialID> myNamedMaterials;
+};
+
+void MaterialTable::Clear()
+{
+	myMaterials.clear();
+	myInlineMaterials.clear();
+	myNamedMaterials.clear();
+}
+
+bool MaterialTable::Add(const Material& aMaterial, MaterialID& aOutID)
+{
+	auto it = myInlineMaterials.find(GetKey(aMaterial));
+	if (it != myInlineMaterials.end())
+	{
+		aOutID = it->second;
+		return true;
+	}
+
+	if (myMaterials.size() >= ourMaxCount)
+		return false;
+
+	aOutID = (MaterialID)myMaterials.size();
+	myMaterials.push_back(aMaterial);
+	myInlineMaterials[GetKey(aMaterial)] = aOutID;
+	return true;
+}
+
+bool MaterialTable::AddNamed(const std::string& aName, const Material& aMaterial, MaterialID& aOutID)
+{
+	if (myMaterials.size() >= ourMaxCount)
+		return false;
+
+	aOutID = (MaterialID)myMaterials.size();
+	myMaterials.push_back(aMaterial);
+	myNamedMaterials[aName] = aOutID;
+	return true;
+}
+
+bool MaterialTable::Find(const std::string& aName, MaterialID& aOutID) const
+{
+	auto it = myNamedMaterials.find(aName);
+	if (it == myNamedMaterials.end())
+		return false;
+
+	aOutID = it->second;
+	return true;
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "Util.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+#include "Vector2.hpp"
+#include "AABB3D.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Learns where indirect light comes from with a uniform grid over the scene, each cell holding a histogram over the sphere of directions.
+// Every cell is split by which axis direction the surface normal is closest to, so floors and walls sharing a cell don't share a histogram.
+// Paths rendered while training add the light they found behind every diffuse bounce, times its cosine, to the histogram of the cell the bounce was in.
+// Every render thread records into its own TrainingBuffer, which are merged into the guide between passes,
+// so the guide is only read while rendering.
+// Diffuse bounces in trained cells then pick either a direction from the histogram or a cosine weighted one.
+class PathGuide
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+	using Vector2f = CommonUtilities::Vector2<float>;
+
+	struct Settings
+	{
+		int myGridResolution = 8;
+		// The histograms are myDirectionResolution x myDirectionResolution bins, equal area in (cos theta, phi)
+		int myDirectionResolution = 16;
+		// Share of diffuse bounces that sample the histogram in trained cells
+		float myGuideProbability = 0.3f;
+		// Bounces a cell needs to have recorded before it is trusted
+		int myMinCellSamples = 64;
+	};
+
+	class TrainingBuffer
+	{
+	private:
+		friend class PathGuide;
+
+		struct Vertex
+		{
+			Vector3f myRadianceBefore; // path radiance when the bounce was picked
+			Vector3f myThroughput; // path throughput after the bounce
+			int myCell;
+			int myBin;
+			float myWeight; // cosine over the density the bounce was picked with
+		};
+
+		std::vector<float> mySums;
+		std::vector<int> myCounts;
+		std::vector<Vertex> myPath;
+	};
+
+	// The grid covers someBounds, points outside of it are never guided
+	void Initialize(const CommonUtilities::AABB3D<float>& someBounds, const Settings& someSettings);
+	inline bool IsEnabled() const { return !myCounts.empty(); }
+	inline float GetGuideProbability() const { return mySettings.myGuideProbability; }
+
+	// -1 outside the grid
+	inline int GetCell(const Vector3f& aPoint, const Vector3f& aNormal) const;
+	inline bool IsTrained(int aCell) const { return myIsTrained[aCell] != 0; }
+
+	// A direction from the histogram of a trained cell
+	inline Vector3f Sample(int aCell, const Vector2f& aSample) const;
+	// Solid angle density of Sample picking aDirection
+	inline float GetPdf(int aCell, const Vector3f& aDirection) const;
+
+	TrainingBuffer CreateTrainingBuffer() const;
+	// A diffuse bounce in aCell of the path being recorded, aThroughput is the path's throughput after it
+	inline void AddVertex(TrainingBuffer& aBuffer, int aCell, const Vector3f& aDirection, float aCosine, float aPdf, const Vector3f& aThroughput, const Vector3f& aRadiance) const;
+	// The recorded path ended with aRadiance, every bounce of it records the light that was found behind it
+	inline void FinishPath(TrainingBuffer& aBuffer, const Vector3f& aRadiance) const;
+	// Adds what aBuffer recorded to the guide and empties it, the histograms only change on Update
+	void Merge(TrainingBuffer& aBuffer);
+	// Rebuilds the sampling distributions of every cell from everything merged so far
+	void Update();
+
+private:
+	inline int GetBin(const Vector3f& aDirection) const;
+
+	static constexpr int ourNormalClasses = 6;
+
+	Settings mySettings;
+	Vector3f myMin;
+	Vector3f myCellSize;
+	int myBinCount = 0;
+
+	// Everything merged so far, myBinCount per cell
+	std::vector<float> mySums;
+	std::vector<int> myCounts;
+
+	// What sampling uses, probability and running sum of every bin
+	std::vector<float> myProbabilities;
+	std::vector<float> myCdfs;
+	std::vector<char> myIsTrained;
+};
+
+void PathGuide::Initialize(const CommonUtilities::AABB3D<float>& someBounds, const Settings& someSettings)
+{
+	mySettings = someSettings;
+	myMin = someBounds.GetMin();
+	myCellSize = (someBounds.GetMax() - someBounds.GetMin()) / (float)mySettings.myGridResolution;
+	myBinCount = mySettings.myDirectionResolution * mySettings.myDirectionResolution;
+
+	const int cellCount = mySettings.myGridResolution * mySettings.myGridResolution * mySettings.myGridResolution * ourNormalClasses;
+	mySums.assign(cellCount * myBinCount, 0.f);
+	myCounts.assign(cellCount, 0);
+	myProbabilities.assign(cellCount * myBinCount, 0.f);
+	myCdfs.assign(cellCount * myBinCount, 0.f);
+	myIsTrained.assign(cellCount, 0);
+}
+
+int PathGuide::GetCell(const Vector3f& aPoint, const Vector3f& aNormal) const
+{
+	const Vector3f local = (aPoint - myMin) / myCellSize;
+	const int resolution = mySettings.myGridResolution;
+	if (!(local.x >= 0.f && local.y >= 0.f && local.z >= 0.f && local.x < resolution && local.y < resolution && local.z < resolution))
+		return -1;
+
+	const float absX = std::fabs(aNormal.x);
+	const float absY = std::fabs(aNormal.y);
+	const float absZ = std::fabs(aNormal.z);
+	int normalClass;
+	if (absX >= absY && absX >= absZ)
+		normalClass = aNormal.x > 0.f ? 0 : 1;
+	else if (absY >= absZ)
+		normalClass = aNormal.y > 0.f ? 2 : 3;
+	else
+		normalClass = aNormal.z > 0.f ? 4 : 5;
+
+	return (((int)local.z * resolution + (int)local.y) * resolution + (int)local.x) * ourNormalClasses + normalClass;
+}
+
+int PathGuide::GetBin(const Vector3f& aDirection) const
+{
+	const int resolution = mySettings.myDirectionResolution;
+	const float u = (aDirection.z + 1.f) * 0.5f;
+	const float v = (std::atan2(aDirection.y, aDirection.x) + PI) / (2.f * PI);
+	const int binU = std::min(std::max((int)(u * resolution), 0), resolution - 1);
+	const int binV = std::min(std::max((int)(v * resolution), 0), resolution - 1);
+	return binU * resolution + binV;
+}
+
+CommonUtilities::Vector3<float> PathGuide::Sample(int aCell, const Vector2f& aSample) const
+{
+	const float* cdf = &myCdfs[aCell * myBinCount];
+	const float* probabilities = &myProbabilities[aCell * myBinCount];
+	const int bin = std::min((int)(std::upper_bound(cdf, cdf + myBinCount, aSample.x) - cdf), myBinCount - 1);
+
+	// What is left of the first sample dimension places the direction within the bin
+	const float binStart = bin > 0 ? cdf[bin - 1] : 0.f;
+	const float inBinU = std::min(std::max((aSample.x - binStart) / probabilities[bin], 0.f), 1.f);
+
+	const int resolution = mySettings.myDirectionResolution;
+	const float u = (bin / resolution + inBinU) / resolution;
+	const float v = (bin % resolution + aSample.y) / resolution;
+	const float z = 2.f * u - 1.f;
+	const float phi = 2.f * PI * v - PI;
+	const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+	return Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+float PathGuide::GetPdf(int aCell, const Vector3f& aDirection) const
+{
+	// Every bin covers the same solid angle
+	return myProbabilities[aCell * myBinCount + GetBin(aDirection)] * myBinCount / (4.f * PI);
+}
+
+PathGuide::TrainingBuffer PathGuide::CreateTrainingBuffer() const
+{
+	TrainingBuffer buffer;
+	buffer.mySums.assign(mySums.size(), 0.f);
+	buffer.myCounts.assign(myCounts.size(), 0);
+	return buffer;
+}
+
+void PathGuide::AddVertex(TrainingBuffer& aBuffer, int aCell, const Vector3f& aDirection, float aCosine, float aPdf, const Vector3f& aThroughput, const Vector3f& aRadiance) const
+{
+	aBuffer.myPath.push_back({ aRadiance, aThroughput, aCell, GetBin(aDirection), aCosine / aPdf });
+}
+
+void PathGuide::FinishPath(TrainingBuffer& aBuffer, const Vector3f& aRadiance) const
+{
+	auto luminance = [](const Vector3f& aColor) { return 0.2126f * aColor.x + 0.7152f * aColor.y + 0.0722f * aColor.z; };
+
+	for (const TrainingBuffer::Vertex& vertex : aBuffer.myPath)
+	{
+		// The light found behind the bounce divided by the path's throughput there is the incident radiance from the bounce's direction.
+		// Weighing it by cosine over the density it was sampled with makes the bins' expected sums proportional to the cosine weighted light they cover.
+		const float throughput = luminance(vertex.myThroughput);
+		const float incident = throughput > 0.f ? std::max(luminance(aRadiance - vertex.myRadianceBefore), 0.f) / throughput : 0.f;
+		if (std::isfinite(incident))
+			aBuffer.mySums[vertex.myCell * myBinCount + vertex.myBin] += incident * vertex.myWeight;
+		++aBuffer.myCounts[vertex.myCell];
+	}
+	aBuffer.myPath.clear();
+}
+
+void PathGuide::Merge(TrainingBuffer& aBuffer)
+{
+	for (size_t i = 0; i < mySums.size(); ++i)
+		mySums[i] += aBuffer.mySums[i];
+	for (size_t i = 0; i < myCounts.size(); ++i)
+		myCounts[i] += aBuffer.myCounts[i];
+
+	std::fill(aBuffer.mySums.begin(), aBuffer.mySums.end(), 0.f);
+	std::fill(aBuffer.myCounts.begin(), aBuffer.myCounts.end(), 0);
+}
+
+void PathGuide::Update()
+{
+	// A tenth of every histogram is spread evenly, so directions a cell hasn't seen light from yet can still be found
+	constexpr float uniformShare = 0.1f;
+
+	for (size_t cell = 0; cell < myCounts.size(); ++cell)
+	{
+		const float* sums = &mySums[cell * myBinCount];
+		float total = 0.f;
+		for (int bin = 0; bin < myBinCount; ++bin)
+			total += sums[bin];
+
+		myIsTrained[cell] = myCounts[cell] >= mySettings.myMinCellSamples && total > 0.f;
+		if (!myIsTrained[cell])
+			continue;
+
+		float* probabilities = &myProbabilities[cell * myBinCount];
+		float* cdf = &myCdfs[cell * myBinCount];
+		float runningSum = 0.f;
+		for (int bin = 0; bin < myBinCount; ++bin)
+		{
+			probabilities[bin] = (1.f - uniformShare) * sums[bin] / total + uniformShare / myBinCount;
+			runningSum += probabilities[bin];
+			cdf[bin] = runningSum;
+		}
+		cdf[myBinCount - 1] = 1.f;
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "CScene.h"
+#include "Film.h"
+#include "ThreadPool.h"
+#include "Sampler.h"
+
+// stdlib
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+// Renders in passes of mySamplesPerPass samples per pixel into a film, until every pixel has myTargetSamples or the time budget runs out.
+// Once the budget is spent no new tiles are started, so the pass that is running finishes early with some pixels a few samples behind.
+// With path guiding the first passes also train the scene's path guide, which is updated between them.
+namespace ProgressiveRendering
+{
+	struct Settings
+	{
+		int mySamplesPerPass = 4;
+		int myTargetSamples = 100;
+		// Seconds of rendering, 0 for no limit
+		double myTimeBudget = 0.0;
+		// Passes between calls to the intermediate image callback, 0 for none
+		int mySaveInterval = 0;
+		SamplerType mySamplerType = SamplerType::Sobol;
+		// Train the path guide during the first myTrainingPasses passes, the scene's guide must be initialized
+		bool myUsePathGuiding = false;
+		int myTrainingPasses = 4;
+	};
+
+	using ImageCallback = std::function<void(const Film& aFilm, int aPassCount)>;
+
+	// Returns the total number of samples taken
+	inline long long Render(CScene& aScene, ThreadPool& aThreadPool, Film& aFilm, const Settings& someSettings, int aTileSize, const ImageCallback& anOnIntermediateImage = ImageCallback())
+	{
+		using Clock = std::chrono::steady_clock;
+		const Clock::time_point start = Clock::now();
+		const bool hasDeadline = someSettings.myTimeBudget > 0.0;
+		const Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(someSettings.myTimeBudget));
+
+		const int width = aFilm.GetWidth();
+		const int height = aFilm.GetHeight();
+
+		std::vector<std::unique_ptr<Sampler>> samplers;
+		for (int i = 0; i < aThreadPool.GetWorkerCount(); ++i)
+			samplers.push_back(CreateSampler(someSettings.mySamplerType));
+
+		std::vector<PathGuide::TrainingBuffer> trainingBuffers;
+		if (someSettings.myUsePathGuiding)
+		{
+			for (int i = 0; i < aThreadPool.GetWorkerCount(); ++i)
+				trainingBuffers.push_back(aScene.GetPathGuide().CreateTrainingBuffer());
+		}
+
+		std::vector<long long> workerSamples(aThreadPool.GetWorkerCount(), 0);
+		int passCount = 0;
+		for (int passStart = 0; passStart < someSettings.myTargetSamples; passStart += someSettings.mySamplesPerPass)
+		{
+			if (hasDeadline && Clock::now() >= deadline)
+				break;
+
+			const int passEnd = std::min(passStart + someSettings.mySamplesPerPass, someSettings.myTargetSamples);
+			const bool isTraining = someSettings.myUsePathGuiding && passCount < someSettings.myTrainingPasses;
+			aThreadPool.ForEachTile(width, height, aTileSize, [&](const Tile& aTile, int aWorkerIndex)
+			{
+				if (hasDeadline && Clock::now() >= deadline)
+					return;
+
+				Sampler& sampler = *samplers[aWorkerIndex];
+				PathGuide::TrainingBuffer* training = isTraining ? &trainingBuffers[aWorkerIndex] : nullptr;
+				for (int y = aTile.myY; y < aTile.myY + aTile.myHeight; ++y)
+				{
+					for (int x = aTile.myX; x < aTile.myX + aTile.myWidth; ++x)
+					{
+						for (int i = passStart; i < passEnd; ++i)
+						{
+							FeatureSample features;
+							const Vector3f color = aScene.Sample(x, y, i, sampler, &features, training);
+							aFilm.AddSample(x, y, color, features);
+						}
+					}
+				}
+				workerSamples[aWorkerIndex] += (long long)aTile.myWidth * aTile.myHeight * (passEnd - passStart);
+			});
+
+			if (isTraining)
+			{
+				for (PathGuide::TrainingBuffer& buffer : trainingBuffers)
+					aScene.GetPathGuide().Merge(buffer);
+				aScene.GetPathGuide().Update();
+			}
+
+			if (aScene.GetDirectLightResampling().IsEnabled())
+				aScene.GetDirectLightResampling().EndPass();
+
+			++passCount;
+			if (someSettings.mySaveInterval > 0 && passCount % someSettings.mySaveInterval == 0 && passEnd < someSettings.myTargetSamples && anOnIntermediateImage)
+				anOnIntermediateImage(aFilm, passCount);
+		}
+
+		long long totalSamples = 0;
+		for (long long samples : workerSamples)
+			totalSamples += samples;
+		return totalSamples;
+	}
+}
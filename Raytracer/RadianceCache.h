@@ -0,0 +1,195 @@
+#pragma once
+
+#include "Sampler.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+
+// stdlib
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// World space cache of the light leaving diffuse surfaces, a fixed size hash table keyed by quantized position and normal.
+// Cells grow with the distance from the camera, so they cover about the same number of pixels everywhere.
+// Every path adds what it found behind its diffuse vertices to their cells, and paths past their first bounce
+// end at a cell that has seen enough samples and take its mean instead of tracing on.
+// All render threads read and update the table at the same time: cells are claimed with a compare and swap on the key
+// and the sums are fixed point integers added with atomics, a full neighbourhood of the table just drops the update.
+class RadianceCache
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+
+	struct Settings
+	{
+		// The table has 2^myCapacityLog2 cells of 32 bytes
+		int myCapacityLog2 = 18;
+		// Cell size up to a distance of 2 from the camera, doubling with every doubling of the distance after that
+		float myCellSize = 0.05f;
+		// Samples a cell needs before paths end at it
+		int myMinSamples = 16;
+		// Share of paths that never end at the cache, they keep refining the cells paths end at
+		float myTrainingFraction = 0.125f;
+		// Clamp on single samples, so a rare bright path doesn't linger in a cell
+		float myMaxRadiance = 32.f;
+	};
+
+	// The diffuse vertices of the path being traced, past ourMaxVertices they aren't recorded
+	struct PathRecord
+	{
+		struct Vertex
+		{
+			Vector3f myThroughput; // path throughput arriving at the vertex
+			Vector3f myRadianceBefore; // path radiance before the vertex added its light
+			uint32_t myKey;
+		};
+
+		static constexpr int ourMaxVertices = 8;
+		Vertex myVertices[ourMaxVertices];
+		int myCount = 0;
+	};
+
+	void Initialize(const Settings& someSettings, const Vector3f& aCameraPosition);
+	inline bool IsEnabled() const { return myEntries != nullptr; }
+	inline float GetTrainingFraction() const { return mySettings.myTrainingFraction; }
+
+	// Never 0, which marks free cells
+	inline uint32_t GetKey(const Vector3f& aPoint, const Vector3f& aNormal) const;
+	// The mean outgoing radiance of the cell, if it has enough samples
+	inline bool Find(uint32_t aKey, Vector3f& aOutRadiance) const;
+
+	inline void AddVertex(PathRecord& aRecord, uint32_t aKey, const Vector3f& aThroughput, const Vector3f& aRadiance) const;
+	// The recorded path ended with aRadiance, adds the light every vertex reflected to its cell
+	inline void FinishPath(const PathRecord& aRecord, const Vector3f& aRadiance);
+
+	size_t GetCapacity() const { return (size_t)myMask + 1; }
+	size_t GetUsedCellCount() const;
+
+private:
+	struct Entry
+	{
+		std::atomic<uint32_t> myKey;
+		std::atomic<uint32_t> myCount;
+		std::atomic<uint64_t> mySums[3];
+	};
+
+	// Linear probing stops after this many cells
+	static constexpr int ourMaxProbes = 8;
+	static constexpr float ourFixedPointScale = 65536.f;
+
+	inline Entry* FindOrInsert(uint32_t aKey);
+
+	Settings mySettings;
+	Vector3f myCameraPosition;
+	std::unique_ptr<Entry[]> myEntries;
+	uint32_t myMask = 0;
+};
+
+void RadianceCache::Initialize(const Settings& someSettings, const Vector3f& aCameraPosition)
+{
+	mySettings = someSettings;
+	myCameraPosition = aCameraPosition;
+	myMask = (1u << mySettings.myCapacityLog2) - 1;
+
+	// Value initialized, so every key, count and sum starts at 0
+	myEntries.reset(new Entry[GetCapacity()]());
+}
+
+uint32_t RadianceCache::GetKey(const Vector3f& aPoint, const Vector3f& aNormal) const
+{
+	const int level = std::max(std::ilogb(std::max((aPoint - myCameraPosition).Length(), 1.f)), 0);
+	const float cellSize = std::ldexp(mySettings.myCellSize, level);
+
+	int normalClass;
+	const float absX = std::fabs(aNormal.x);
+	const float absY = std::fabs(aNormal.y);
+	const float absZ = std::fabs(aNormal.z);
+	if (absX >= absY && absX >= absZ)
+		normalClass = aNormal.x > 0.f ? 0 : 1;
+	else if (absY >= absZ)
+		normalClass = aNormal.y > 0.f ? 2 : 3;
+	else
+		normalClass = aNormal.z > 0.f ? 4 : 5;
+
+	uint32_t key = SamplerUtil::Hash((uint32_t)(level * 6 + normalClass), (uint32_t)(int)std::floor(aPoint.x / cellSize));
+	key = SamplerUtil::Hash(key, (uint32_t)(int)std::floor(aPoint.y / cellSize));
+	key = SamplerUtil::Hash(key, (uint32_t)(int)std::floor(aPoint.z / cellSize));
+	return key != 0 ? key : 1;
+}
+
+bool RadianceCache::Find(uint32_t aKey, Vector3f& aOutRadiance) const
+{
+	for (int probe = 0; probe < ourMaxProbes; ++probe)
+	{
+		const Entry& entry = myEntries[(aKey + probe) & myMask];
+		const uint32_t key = entry.myKey.load(std::memory_order_relaxed);
+		if (key == 0)
+			return false;
+		if (key != aKey)
+			continue;
+
+		// The sums may already include a sample the count doesn't, which is far below the noise of the mean
+		const uint32_t count = entry.myCount.load(std::memory_order_relaxed);
+		if (count < (uint32_t)mySettings.myMinSamples)
+			return false;
+
+		const float scale = 1.f / (ourFixedPointScale * count);
+		aOutRadiance = Vector3f(entry.mySums[0].load(std::memory_order_relaxed) * scale, entry.mySums[1].load(std::memory_order_relaxed) * scale, entry.mySums[2].load(std::memory_order_relaxed) * scale);
+		return true;
+	}
+	return false;
+}
+
+RadianceCache::Entry* RadianceCache::FindOrInsert(uint32_t aKey)
+{
+	for (int probe = 0; probe < ourMaxProbes; ++probe)
+	{
+		Entry& entry = myEntries[(aKey + probe) & myMask];
+		uint32_t key = entry.myKey.load(std::memory_order_relaxed);
+		if (key == 0 && (entry.myKey.compare_exchange_strong(key, aKey, std::memory_order_relaxed) || key == aKey))
+			return &entry;
+		if (key == aKey)
+			return &entry;
+	}
+	return nullptr;
+}
+
+void RadianceCache::AddVertex(PathRecord& aRecord, uint32_t aKey, const Vector3f& aThroughput, const Vector3f& aRadiance) const
+{
+	if (aRecord.myCount < PathRecord::ourMaxVertices)
+		aRecord.myVertices[aRecord.myCount++] = { aThroughput, aRadiance, aKey };
+}
+
+void RadianceCache::FinishPath(const PathRecord& aRecord, const Vector3f& aRadiance)
+{
+	for (int i = 0; i < aRecord.myCount; ++i)
+	{
+		const PathRecord::Vertex& vertex = aRecord.myVertices[i];
+		Entry* entry = FindOrInsert(vertex.myKey);
+		if (!entry)
+			continue;
+
+		// The light found from the vertex on divided by the throughput that reached it is what the surface sent towards the path
+		const Vector3f found = aRadiance - vertex.myRadianceBefore;
+		const float channels[3] = { found.x, found.y, found.z };
+		const float throughputs[3] = { vertex.myThroughput.x, vertex.myThroughput.y, vertex.myThroughput.z };
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const float radiance = throughputs[channel] > 0.f ? channels[channel] / throughputs[channel] : 0.f;
+			const float clamped = std::isfinite(radiance) ? std::min(std::max(radiance, 0.f), mySettings.myMaxRadiance) : 0.f;
+			entry->mySums[channel].fetch_add((uint64_t)(clamped * ourFixedPointScale), std::memory_order_relaxed);
+		}
+		entry->myCount.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+size_t RadianceCache::GetUsedCellCount() const
+{
+	size_t count = 0;
+	for (size_t i = 0; i < GetCapacity(); ++i)
+		count += myEntries[i].myKey.load(std::memory_order_relaxed) != 0;
+	return count;
+}
@@ -1,74 +1,300 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
-#include <ppl.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 #include <chrono>
+#include <thread>
+#include <sstream>
+#include <iomanip>
 #undef _CRT_SECURE_NO_WARNINGS
 
 #include "CScene.h"
 #include "Util.h"
-
-// Enable to run raytracing in parallel
-#define RUN_IN_PARALLEL
+#include "Benchmark.h"
+#include "ThreadPool.h"
+#include "AdaptiveSampling.h"
+#include "Sampler.h"
+#include "Film.h"
+#include "Denoiser.h"
+#include "ProgressiveRendering.h"
+#include "WavefrontRendering.h"
+#include "Animation.h"
 
 int main(int argc, char* argv[])
 {
 	const int width = 800;
 	const int height = 600;
 
+	if (argc > 1 && std::strcmp(argv[1], "--benchmark") == 0)
+	{
+		Benchmark::Run(argc > 2 ? argv[2] : "scene.txt", width, height);
+		return 0;
+	}
+
 	CScene scene(width, height);
 
+	// Raytracer.exe [scene.txt] [--threads count] [--pin] [--tile size] [--adaptive] [--threshold error] [--sampler random|sobol|halton|bluenoise]
+	//               [--lights uniform|power|tree] [--rays count] [--bounces max] [--min-bounces count] [--no-roulette] [--denoise]
+	//               [--progressive] [--time seconds] [--pass-samples count] [--save-every passes] [--guide] [--radiance-cache] [--caustics] [--restir] [--wavefront] [--interleave]
+	//               [--rebuild-threshold ratio]
 	std::string filename = "scene.txt";
-	if (argc > 1)
-		filename = argv[1];
+	int threadCount = 0; // one per hardware thread
+	bool pinThreads = false;
+	int tileSize = 16;
+	bool useAdaptiveSampling = false;
+	AdaptiveSampling::Settings adaptiveSettings;
+	SamplerType samplerType = SamplerType::Sobol;
+	RenderSettings renderSettings;
+	bool useDenoiser = false;
+	Denoiser::Settings denoiserSettings;
+	bool useRadianceCache = false;
+	bool useCausticPhotons = false;
+	bool useDirectLightResampling = false;
+	bool useProgressiveRendering = false;
+	ProgressiveRendering::Settings progressiveSettings;
+	bool useWavefront = false;
+	WavefrontRendering::Settings wavefrontSettings;
+	bool useInterleavedTraversal = false;
+	Animation::Settings animationSettings;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threadCount = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--pin") == 0)
+			pinThreads = true;
+		else if (std::strcmp(argv[i], "--tile") == 0 && i + 1 < argc)
+			tileSize = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--adaptive") == 0)
+			useAdaptiveSampling = true;
+		else if (std::strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			adaptiveSettings.myThreshold = (float)std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--sampler") == 0 && i + 1 < argc)
+		{
+			if (!ParseSamplerType(argv[++i], samplerType))
+				std::cout << "Unknown sampler: " << argv[i] << ", using sobol\n";
+		}
+		else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+		{
+			if (!ParseLightSelectionType(argv[++i], renderSettings.myLightSelection))
+				std::cout << "Unknown light selection: " << argv[i] << ", using uniform\n";
+		}
+		else if (std::strcmp(argv[i], "--rays") == 0 && i + 1 < argc)
+			renderSettings.myRaysPerPixel = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--bounces") == 0 && i + 1 < argc)
+			renderSettings.myMaxBounces = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--min-bounces") == 0 && i + 1 < argc)
+			renderSettings.myMinBounces = std::max(0, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--no-roulette") == 0)
+			renderSettings.myUseRussianRoulette = false;
+		else if (std::strcmp(argv[i], "--denoise") == 0)
+			useDenoiser = true;
+		else if (std::strcmp(argv[i], "--radiance-cache") == 0)
+			useRadianceCache = true;
+		else if (std::strcmp(argv[i], "--caustics") == 0)
+			useCausticPhotons = true;
+		else if (std::strcmp(argv[i], "--restir") == 0)
+		{
+			// Reservoirs are reused across passes
+			useProgressiveRendering = true;
+			useDirectLightResampling = true;
+		}
+		else if (std::strcmp(argv[i], "--progressive") == 0)
+			useProgressiveRendering = true;
+		else if (std::strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+		{
+			useProgressiveRendering = true;
+			progressiveSettings.myTimeBudget = std::atof(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "--pass-samples") == 0 && i + 1 < argc)
+			progressiveSettings.mySamplesPerPass = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--save-every") == 0 && i + 1 < argc)
+			progressiveSettings.mySaveInterval = std::max(0, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--wavefront") == 0)
+			useWavefront = true;
+		else if (std::strcmp(argv[i], "--interleave") == 0)
+			useInterleavedTraversal = true;
+		else if (std::strcmp(argv[i], "--rebuild-threshold") == 0 && i + 1 < argc)
+			animationSettings.myRebuildThreshold = (float)std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--guide") == 0)
+		{
+			useProgressiveRendering = true;
+			progressiveSettings.myUsePathGuiding = true;
+		}
+		else
+			filename = argv[i];
+	}
+
+	scene.SetRenderSettings(renderSettings);
+	scene.SetUseInterleavedTraversal(useInterleavedTraversal);
 
 	auto timer_start = std::chrono::system_clock::now();
 
+	// Created before loading, the BVH is built on it
+	ThreadPool threadPool(threadCount, pinThreads);
+
 	std::cout << "Loading scene: \"" << filename << "\"\n";
 
-	if(!scene.Load(filename.c_str())) {
+	if(!scene.Load(filename.c_str(), &threadPool)) {
 		std::cout << "Coudn't open: " << filename << "... exiting, program." << "\"\n";
 		return 0;
 	}
 
 	uint8_t* pixels = new uint8_t[width * height * 3];
 
-	std::cout << "Rendering...\n";
+	std::cout << "Rendering with " << threadPool.GetWorkerCount() << " threads...\n";
 
-#ifdef RUN_IN_PARALLEL
-	concurrency::parallel_for(0, height, [&](int j)
-#else
-	for (int j = height - 1; j >= 0; --j)
-#endif
+	auto storePixel = [&](int i, int j, SRGB color)
+	{
+		int index = 3 * (j*width + i);
+
+		color = ToneMap(color);
+
+		int ir = int(255.99 * LinearToSrgb(fmin(color.r, 1.f)));
+		int ig = int(255.99 * LinearToSrgb(fmin(color.g, 1.f)));
+		int ib = int(255.99 * LinearToSrgb(fmin(color.b, 1.f)));
+
+		pixels[index + 0] = ir;
+		pixels[index + 1] = ig;
+		pixels[index + 2] = ib;
+	};
+
+	std::string imageFilename = filename.substr(0, filename.find_last_of('.')) + ".png";
+	auto writeImage = [&]()
 	{
-		for (int i = 0; i < width; ++i)
+		std::cout << "Writing image: \"" << imageFilename << "\"\n";
+		stbi_write_png(imageFilename.c_str(), width, height, 3, pixels, width * 3);
+	};
+
+	// The film is in scene coordinates, y up
+	auto storeFilm = [&](const Film& aFilm)
+	{
+		// Denoised before tone mapping, while the colors are still linear
+		std::vector<Vector3f> denoised;
+		if (useDenoiser)
+			denoised = Denoiser::Denoise(aFilm, threadPool, denoiserSettings, tileSize);
+
+		for (int j = 0; j < height; ++j)
+		{
+			for (int i = 0; i < width; ++i)
+			{
+				Vector3f color = useDenoiser ? denoised[(height - 1 - j) * width + i] : aFilm.GetColor(i, height - 1 - j);
+				storePixel(i, j, { color.x, color.y, color.z });
+			}
+		}
+	};
+
+	// Renders aScene into imageFilename, anything learned while rendering starts over for every image
+	auto renderImage = [&](CScene& aScene)
+	{
+		if (progressiveSettings.myUsePathGuiding)
+			aScene.InitializePathGuide(PathGuide::Settings());
+		if (useRadianceCache)
+			aScene.InitializeRadianceCache(RadianceCache::Settings());
+		if (useDirectLightResampling)
+			aScene.InitializeDirectLightResampling(DirectLightResampling::Settings());
+
+		if (useCausticPhotons)
+		{
+			aScene.BuildCausticPhotonMap(CausticPhotonMap::Settings(), threadPool);
+			std::cout << "Caustic photons: " << aScene.GetCausticPhotonMap().GetPhotonCount() << "\n";
+		}
+
+		if (useAdaptiveSampling || useDenoiser || useProgressiveRendering || useWavefront)
 		{
-			int index = 3 * (j*width + i);
+			Film film(width, height);
+			long long samples = 0;
+			if (useAdaptiveSampling)
+			{
+				adaptiveSettings.mySamplerType = samplerType;
+				samples = AdaptiveSampling::Render(aScene, threadPool, film, adaptiveSettings, tileSize);
+			}
+			else if (useWavefront && !useProgressiveRendering)
+			{
+				wavefrontSettings.mySamplerType = samplerType;
+				samples = WavefrontRendering::Render(aScene, threadPool, film, renderSettings.myRaysPerPixel, wavefrontSettings);
+			}
+			else
+			{
+				// Without --progressive all samples are taken in one pass
+				progressiveSettings.mySamplerType = samplerType;
+				progressiveSettings.myTargetSamples = renderSettings.myRaysPerPixel;
+				if (!useProgressiveRendering)
+					progressiveSettings.mySamplesPerPass = renderSettings.myRaysPerPixel;
 
-			SRGB color = scene.Raytrace(i, height - 1 - j);
-			color = ToneMap(color);
+				samples = ProgressiveRendering::Render(aScene, threadPool, film, progressiveSettings, tileSize, [&](const Film& aFilm, int aPassCount)
+				{
+					std::cout << "Pass " << aPassCount << ", ";
+					storeFilm(aFilm);
+					writeImage();
+				});
+			}
+			std::cout << "Average rays per pixel: " << samples / (double)(width * height) << "\n";
 
-			int ir = int(255.99 * LinearToSrgb(fmin(color.r, 1.f)));
-			int ig = int(255.99 * LinearToSrgb(fmin(color.g, 1.f)));
-			int ib = int(255.99 * LinearToSrgb(fmin(color.b, 1.f)));
+			storeFilm(film);
+		}
+		else
+		{
+			std::vector<std::unique_ptr<Sampler>> samplers;
+			for (int i = 0; i < threadPool.GetWorkerCount(); ++i)
+				samplers.push_back(CreateSampler(samplerType));
 
-			pixels[index + 0] = ir;
-			pixels[index + 1] = ig;
-			pixels[index + 2] = ib;
+			threadPool.ForEachTile(width, height, tileSize, [&](const Tile& aTile, int aWorkerIndex)
+			{
+				for (int j = aTile.myY; j < aTile.myY + aTile.myHeight; ++j)
+				{
+					for (int i = aTile.myX; i < aTile.myX + aTile.myWidth; ++i)
+						storePixel(i, j, aScene.Raytrace(i, height - 1 - j, *samplers[aWorkerIndex]));
+				}
+			});
 		}
-#ifdef RUN_IN_PARALLEL
-	});
-#else
+
+		writeImage();
+
+		if (useRadianceCache)
+			std::cout << "Radiance cache cells used: " << aScene.GetRadianceCache().GetUsedCellCount() << " of " << aScene.GetRadianceCache().GetCapacity() << "\n";
+	};
+
+	const int frameCount = scene.GetFrameCount();
+	if (frameCount == 1)
+	{
+		renderImage(scene);
 	}
-#endif
+	else
+	{
+		// Two copies of the scene take turns, one renders a frame while the other moves on to the frame after it
+		CScene nextScene(width, height);
+		nextScene.SetRenderSettings(renderSettings);
+		nextScene.SetUseInterleavedTraversal(useInterleavedTraversal);
+		auto coutBuffer = std::cout.rdbuf(nullptr); // it would print the same as the first copy
+		nextScene.Load(filename.c_str(), &threadPool);
+		std::cout.rdbuf(coutBuffer);
+		std::cout.clear();
 
-	std::string imageFilename = filename.substr(0, filename.find_last_of('.')) + ".png";
+		CScene* scenes[2] = { &scene, &nextScene };
+		const std::string baseFilename = filename.substr(0, filename.find_last_of('.'));
+		Animation::FrameUpdate update = scene.SetFrame(0, animationSettings);
+		for (int frame = 0; frame < frameCount; ++frame)
+		{
+			std::cout << "Frame " << frame + 1 << " of " << frameCount << ", " << (update.myIsRebuilt ? "rebuilt" : "refit") << " the BVH in "
+				<< update.mySeconds * 1e3 << " ms, SAH cost " << update.mySAHCost << "\n";
+
+			std::thread updateThread;
+			if (frame + 1 < frameCount)
+				updateThread = std::thread([&, frame]() { update = scenes[(frame + 1) % 2]->SetFrame(frame + 1, animationSettings); });
 
-	std::cout << "Writing image: \"" << imageFilename << "\"\n";
+			std::ostringstream frameFilename;
+			frameFilename << baseFilename << "_" << std::setw(4) << std::setfill('0') << frame << ".png";
+			imageFilename = frameFilename.str();
+			renderImage(*scenes[frame % 2]);
+
+			if (updateThread.joinable())
+				updateThread.join();
+		}
+	}
 
-	stbi_write_png(imageFilename.c_str(), width, height, 3, pixels, width * 3);
 	delete[] pixels;
 
 	auto timer_end = std::chrono::system_clock::now();
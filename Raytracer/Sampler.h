@@ -0,0 +1,445 @@
+#pragma once
+
+#include "Util.h"
+
+// CommonUtilities
+#include "Vector2.hpp"
+
+// stdlib
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+enum class SamplerType
+{
+	Random,
+	Sobol,
+	Halton,
+	BlueNoise
+};
+
+// The dimension of the sample vector every path decision reads.
+// Each bounce has its own block of PerBounce dimensions, so a decision sees the same dimension in every sample of a pixel.
+// 2D decisions start on an even dimension, which keeps them on one Sobol pair.
+namespace SampleDimension
+{
+	constexpr int Pixel = 0;
+	constexpr int Lens = 2;
+	constexpr int FirstBounce = 4;
+
+	// Offsets into a bounce's block
+	constexpr int Diffuse = 0;
+	constexpr int LightPosition = 2;
+	constexpr int LightSelection = 4;
+	constexpr int Fresnel = 5;
+	constexpr int Roulette = 6;
+	constexpr int GuideSelection = 7;
+	constexpr int PerBounce = 8;
+
+	inline int GetBounce(int aDepth, int anOffset) { return FirstBounce + aDepth * PerBounce + anOffset; }
+
+	// Resampled direct light reads its many candidates from far past the bounces
+	constexpr int Resampling = 1 << 16;
+}
+
+namespace SamplerUtil
+{
+	// Murmur3 finalizer
+	inline uint32_t MixBits(uint32_t aValue)
+	{
+		aValue ^= aValue >> 16;
+		aValue *= 0x85ebca6bu;
+		aValue ^= aValue >> 13;
+		aValue *= 0xc2b2ae35u;
+		aValue ^= aValue >> 16;
+		return aValue;
+	}
+
+	inline uint32_t Hash(uint32_t aSeed, uint32_t aValue)
+	{
+		return MixBits(aSeed ^ (aValue + 0x9e3779b9u + (aSeed << 6) + (aSeed >> 2)));
+	}
+
+	inline uint32_t ReverseBits(uint32_t aValue)
+	{
+		aValue = (aValue << 16) | (aValue >> 16);
+		aValue = ((aValue & 0x00ff00ffu) << 8) | ((aValue & 0xff00ff00u) >> 8);
+		aValue = ((aValue & 0x0f0f0f0fu) << 4) | ((aValue & 0xf0f0f0f0u) >> 4);
+		aValue = ((aValue & 0x33333333u) << 2) | ((aValue & 0xccccccccu) >> 2);
+		aValue = ((aValue & 0x55555555u) << 1) | ((aValue & 0xaaaaaaaau) >> 1);
+		return aValue;
+	}
+
+	// Owen scrambling of the bits of aValue read as a binary fraction, every bit only depends on the bits above it.
+	// Laine and Karras' hash as improved by Burley, "Practical Hash-based Owen Scrambling".
+	inline uint32_t NestedUniformScramble(uint32_t aValue, uint32_t aSeed)
+	{
+		aValue = ReverseBits(aValue);
+		aValue += aSeed;
+		aValue ^= aValue * 0x6c50b47cu;
+		aValue ^= aValue * 0xb82f1e52u;
+		aValue ^= aValue * 0xc7afe638u;
+		aValue ^= aValue * 0x8d22f6e6u;
+		return ReverseBits(aValue);
+	}
+
+	// Largest float below 1
+	constexpr float OneMinusEpsilon = 0.99999994f;
+
+	// [0, 1) from the bits of aValue as a binary fraction
+	inline float ToUnitFloat(uint32_t aValue)
+	{
+		return std::min((float)(aValue * 2.3283064365386963e-10), OneMinusEpsilon);
+	}
+}
+
+// Hands out the sample vector of one pixel sample, one value in [0, 1) per dimension.
+// A sampler is only used by one thread at a time, every render thread has its own.
+class Sampler
+{
+public:
+	virtual ~Sampler() = default;
+
+	inline void StartPixelSample(int aX, int aY, int aSampleIndex)
+	{
+		myPixelSeed = SamplerUtil::Hash(SamplerUtil::Hash(mySeed, (uint32_t)aX), (uint32_t)aY);
+		myX = aX;
+		myY = aY;
+		mySampleIndex = (uint32_t)aSampleIndex;
+	}
+
+	inline float Get1D(int aDimension) const { return GetSample(aDimension); }
+	inline CommonUtilities::Vector2<float> Get2D(int aDimension) const { return GetSample2D(aDimension); }
+
+protected:
+	explicit Sampler(uint32_t aSeed) : mySeed(aSeed) {}
+
+	virtual float GetSample(int aDimension) const = 0;
+	// Overridden by samplers that share work between the two dimensions
+	virtual CommonUtilities::Vector2<float> GetSample2D(int aDimension) const
+	{
+		const float u = GetSample(aDimension);
+		const float v = GetSample(aDimension + 1);
+		return { u, v };
+	}
+
+	uint32_t mySeed;
+	uint32_t myPixelSeed = 0;
+	uint32_t mySampleIndex = 0;
+	int myX = 0;
+	int myY = 0;
+};
+
+// The thread's PCG32 stream, no stratification
+class RandomSampler : public Sampler
+{
+public:
+	explicit RandomSampler(uint32_t aSeed) : Sampler(aSeed) {}
+
+protected:
+	float GetSample(int) const override { return RandomFloat(); }
+};
+
+// Owen scrambled 2D Sobol (0,2)-sequence padded to any number of dimensions.
+// Each pair of dimensions shuffles the sample order with its own seed, so the pairs are stratified but uncorrelated with each other.
+class SobolSampler : public Sampler
+{
+public:
+	explicit SobolSampler(uint32_t aSeed) : Sampler(aSeed) {}
+
+protected:
+	float GetSample(int aDimension) const override
+	{
+		return SamplerUtil::ToUnitFloat(GetScrambledSample(aDimension, myPixelSeed));
+	}
+
+	CommonUtilities::Vector2<float> GetSample2D(int aDimension) const override
+	{
+		if (aDimension % 2 != 0)
+			return Sampler::GetSample2D(aDimension);
+
+		uint32_t values[2];
+		GetScrambledPair(aDimension / 2, myPixelSeed, values);
+		return { SamplerUtil::ToUnitFloat(values[0]), SamplerUtil::ToUnitFloat(values[1]) };
+	}
+
+	inline uint32_t GetScrambledSample(int aDimension, uint32_t aSeed) const
+	{
+		const uint32_t pairSeed = SamplerUtil::Hash(aSeed, (uint32_t)aDimension / 2);
+		const uint32_t index = SamplerUtil::NestedUniformScramble(mySampleIndex, pairSeed);
+		const uint32_t value = aDimension % 2 == 0 ? SamplerUtil::ReverseBits(index) : GetSecondDimension(index);
+		return SamplerUtil::NestedUniformScramble(value, SamplerUtil::Hash(pairSeed, (uint32_t)aDimension % 2 + 1));
+	}
+
+	// Both dimensions of aPair, the same values GetScrambledSample returns for dimensions 2 * aPair and 2 * aPair + 1
+	inline void GetScrambledPair(int aPair, uint32_t aSeed, uint32_t someOutValues[2]) const
+	{
+		const uint32_t pairSeed = SamplerUtil::Hash(aSeed, (uint32_t)aPair);
+		const uint32_t index = SamplerUtil::NestedUniformScramble(mySampleIndex, pairSeed);
+		someOutValues[0] = SamplerUtil::NestedUniformScramble(SamplerUtil::ReverseBits(index), SamplerUtil::Hash(pairSeed, 1));
+		someOutValues[1] = SamplerUtil::NestedUniformScramble(GetSecondDimension(index), SamplerUtil::Hash(pairSeed, 2));
+	}
+
+	// Shuffled indices use all 32 bits, so the generator matrix is applied a byte at a time from tables
+	static inline uint32_t GetSecondDimension(uint32_t anIndex)
+	{
+		const uint32_t* table = GetSecondDimensionTable();
+		return table[anIndex & 0xff] ^ table[256 + ((anIndex >> 8) & 0xff)] ^ table[512 + ((anIndex >> 16) & 0xff)] ^ table[768 + (anIndex >> 24)];
+	}
+
+	static const uint32_t* GetSecondDimensionTable()
+	{
+		static const std::vector<uint32_t> table = []()
+		{
+			uint32_t directions[32];
+			uint32_t direction = 1u << 31;
+			for (int bit = 0; bit < 32; ++bit, direction ^= direction >> 1)
+				directions[bit] = direction;
+
+			std::vector<uint32_t> result(4 * 256, 0);
+			for (int byte = 0; byte < 4; ++byte)
+			{
+				for (uint32_t value = 0; value < 256; ++value)
+				{
+					for (int bit = 0; bit < 8; ++bit)
+					{
+						if (value & (1u << bit))
+							result[byte * 256 + value] ^= directions[byte * 8 + bit];
+					}
+				}
+			}
+			return result;
+		}();
+		return table.data();
+	}
+};
+
+// Halton sequence with Owen scrambled digits, one prime base per dimension.
+// Past ourMaxDimensions the bases get too large to stratify anything and the values are hashed instead.
+class HaltonSampler : public Sampler
+{
+public:
+	explicit HaltonSampler(uint32_t aSeed) : Sampler(aSeed) {}
+
+	static constexpr int ourMaxDimensions = 128;
+
+protected:
+	float GetSample(int aDimension) const override
+	{
+		const uint32_t dimensionSeed = SamplerUtil::Hash(myPixelSeed, (uint32_t)aDimension);
+		if (aDimension >= ourMaxDimensions)
+			return SamplerUtil::ToUnitFloat(SamplerUtil::Hash(dimensionSeed, mySampleIndex));
+
+		return GetScrambledRadicalInverse(GetPrimes()[aDimension], mySampleIndex, dimensionSeed);
+	}
+
+	// Each digit is shifted by a hash of the digits before it.
+	// Once the index runs out of digits the scrambled zeros that would follow are uniform in what is left of the interval, so that is drawn at once.
+	static float GetScrambledRadicalInverse(uint32_t aBase, uint32_t anIndex, uint32_t aSeed)
+	{
+		const double inverseBase = 1.0 / aBase;
+		double digitScale = 1.0;
+		double result = 0.0;
+		uint32_t prefix = aSeed;
+		while (anIndex > 0)
+		{
+			const uint32_t next = anIndex / aBase;
+			const uint32_t digit = anIndex - next * aBase;
+			const uint32_t scrambled = (digit + SamplerUtil::MixBits(prefix) % aBase) % aBase;
+			digitScale *= inverseBase;
+			result += scrambled * digitScale;
+			prefix = SamplerUtil::Hash(prefix, digit);
+			anIndex = next;
+		}
+		result += SamplerUtil::MixBits(prefix) * 2.3283064365386963e-10 * digitScale;
+		return std::min((float)result, SamplerUtil::OneMinusEpsilon);
+	}
+
+	static const uint32_t* GetPrimes()
+	{
+		static const std::vector<uint32_t> primes = []()
+		{
+			std::vector<uint32_t> result;
+			for (uint32_t candidate = 2; (int)result.size() < ourMaxDimensions; ++candidate)
+			{
+				if (std::none_of(result.begin(), result.end(), [candidate](uint32_t aPrime) { return candidate % aPrime == 0; }))
+					result.push_back(candidate);
+			}
+			return result;
+		}();
+		return primes.data();
+	}
+};
+
+// Every pixel uses the same scrambled Sobol points, toroidally shifted by a blue noise mask that is offset per dimension.
+// Neighbouring pixels then get very different shifts, which turns the error at low sample counts into high frequency noise.
+class BlueNoiseSampler : public SobolSampler
+{
+public:
+	explicit BlueNoiseSampler(uint32_t aSeed) : SobolSampler(aSeed), myMask(GetMask()) {}
+
+	static constexpr int ourMaskSize = 64;
+
+protected:
+	float GetSample(int aDimension) const override
+	{
+		return Dither(aDimension, GetScrambledSample(aDimension, mySeed));
+	}
+
+	CommonUtilities::Vector2<float> GetSample2D(int aDimension) const override
+	{
+		if (aDimension % 2 != 0)
+			return Sampler::GetSample2D(aDimension);
+
+		uint32_t values[2];
+		GetScrambledPair(aDimension / 2, mySeed, values);
+		return { Dither(aDimension, values[0]), Dither(aDimension + 1, values[1]) };
+	}
+
+	inline float Dither(int aDimension, uint32_t aValue) const
+	{
+		const uint32_t offset = SamplerUtil::Hash(mySeed ^ 0x5bd1e995u, (uint32_t)aDimension);
+		const int x = (myX + (int)(offset & 0xffff)) & (ourMaskSize - 1);
+		const int y = (myY + (int)(offset >> 16)) & (ourMaskSize - 1);
+		const float value = SamplerUtil::ToUnitFloat(aValue) + myMask[y * ourMaskSize + x];
+		return value < 1.f ? value : std::min(value - 1.f, SamplerUtil::OneMinusEpsilon);
+	}
+
+	static const float* GetMask()
+	{
+		static const std::vector<float> mask = CreateMask();
+		return mask.data();
+	}
+
+	// Ulichney's void and cluster method: points are ranked by repeatedly filling the largest void of a gaussian energy field
+	static std::vector<float> CreateMask()
+	{
+		constexpr int size = ourMaskSize;
+		constexpr int count = size * size;
+		constexpr float sigma = 1.5f;
+
+		float kernel[size * size];
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
+			{
+				const int dx = std::min(x, size - x);
+				const int dy = std::min(y, size - y);
+				kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+			}
+		}
+
+		std::vector<bool> isSet(count, false);
+		std::vector<float> energy(count, 0.f);
+		auto update = [&](int anIndex, float aSign)
+		{
+			const int px = anIndex % size;
+			const int py = anIndex / size;
+			for (int y = 0; y < size; ++y)
+			{
+				for (int x = 0; x < size; ++x)
+					energy[y * size + x] += aSign * kernel[((y - py) & (size - 1)) * size + ((x - px) & (size - 1))];
+			}
+		};
+		auto find = [&](bool aSet, bool aFindMax)
+		{
+			int best = -1;
+			for (int i = 0; i < count; ++i)
+			{
+				if (isSet[i] != aSet)
+					continue;
+				if (best < 0 || (aFindMax ? energy[i] > energy[best] : energy[i] < energy[best]))
+					best = i;
+			}
+			return best;
+		};
+
+		// Initial pattern of a tenth of the points, relaxed until the tightest cluster is the point just placed in the largest void
+		const int initialCount = count / 10;
+		uint32_t state = 0x2545f491u;
+		for (int placed = 0; placed < initialCount;)
+		{
+			state = SamplerUtil::MixBits(state + 1);
+			const int index = (int)(state % count);
+			if (isSet[index])
+				continue;
+			isSet[index] = true;
+			update(index, 1.f);
+			++placed;
+		}
+		while (true)
+		{
+			const int cluster = find(true, true);
+			isSet[cluster] = false;
+			update(cluster, -1.f);
+			const int largestVoid = find(false, false);
+			isSet[largestVoid] = true;
+			update(largestVoid, 1.f);
+			if (largestVoid == cluster)
+				break;
+		}
+
+		std::vector<int> ranks(count, 0);
+		std::vector<bool> initial = isSet;
+		std::vector<float> initialEnergy = energy;
+		for (int rank = initialCount - 1; rank >= 0; --rank)
+		{
+			const int cluster = find(true, true);
+			isSet[cluster] = false;
+			update(cluster, -1.f);
+			ranks[cluster] = rank;
+		}
+
+		isSet = initial;
+		energy = initialEnergy;
+		for (int rank = initialCount; rank < count; ++rank)
+		{
+			const int largestVoid = find(false, false);
+			isSet[largestVoid] = true;
+			update(largestVoid, 1.f);
+			ranks[largestVoid] = rank;
+		}
+
+		std::vector<float> mask(count);
+		for (int i = 0; i < count; ++i)
+			mask[i] = (ranks[i] + 0.5f) / count;
+		return mask;
+	}
+
+	const float* myMask;
+};
+
+inline std::unique_ptr<Sampler> CreateSampler(SamplerType aType, uint32_t aSeed = 0)
+{
+	switch (aType)
+	{
+	case SamplerType::Random:
+		return std::unique_ptr<Sampler>(new RandomSampler(aSeed));
+	case SamplerType::Halton:
+		return std::unique_ptr<Sampler>(new HaltonSampler(aSeed));
+	case SamplerType::BlueNoise:
+		return std::unique_ptr<Sampler>(new BlueNoiseSampler(aSeed));
+	case SamplerType::Sobol:
+	default:
+		return std::unique_ptr<Sampler>(new SobolSampler(aSeed));
+	}
+}
+
+// "random", "sobol", "halton" or "bluenoise"
+inline bool ParseSamplerType(const char* aName, SamplerType& anOutType)
+{
+	if (std::strcmp(aName, "random") == 0)
+		anOutType = SamplerType::Random;
+	else if (std::strcmp(aName, "sobol") == 0)
+		anOutType = SamplerType::Sobol;
+	else if (std::strcmp(aName, "halton") == 0)
+		anOutType = SamplerType::Halton;
+	else if (std::strcmp(aName, "bluenoise") == 0)
+		anOutType = SamplerType::BlueNoise;
+	else
+		return false;
+	return true;
+}
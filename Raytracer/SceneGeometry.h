@@ -0,0 +1,296 @@
+#pragma once
+
+#include "Material.h"
+
+// CommonUtilities
+#include "Vector3.hpp"
+#include "AABB3D.hpp"
+#include "Sphere.hpp"
+#include "Ray.hpp"
+#include "Intersection.hpp"
+#include "SIMD.hpp"
+#include "RayPacket.hpp"
+
+// stdlib
+#include <vector>
+#include <cmath>
+
+enum class PrimitiveShape
+{
+	Sphere,
+	AABB
+};
+
+// Where a ray hit the scene geometry, attributes are calculated from it afterwards
+struct GeometryHit
+{
+	float myT;
+	PrimitiveShape myShape;
+	int mySlot;
+};
+
+// Structure-of-arrays storage of the scene's spheres and boxes, in the order the BVH leaves reference them.
+// Leaves are intersected FloatLanes::ourLaneCount primitives at a time with the batched kernels in Intersection.hpp.
+class SceneGeometry
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+	using Ray = CommonUtilities::Ray<float>;
+	using Lanes = CommonUtilities::FloatLanes;
+
+	static constexpr int ourLaneCount = Lanes::ourLaneCount;
+
+	void Clear();
+	// anIndex is handed back by GetIndex for hits on the primitive
+	void AddSphere(const CommonUtilities::Sphere<float>& aSphere, MaterialID aMaterial, int anIndex);
+	void AddAABB(const CommonUtilities::AABB3D<float>& anAABB, MaterialID aMaterial, int anIndex);
+	// Pads the arrays so the kernels can load full registers at the end of the last leaf, call after the last Add
+	void Finalize();
+
+	// Closest hit among aCount primitives of aShape starting at aFirst, the ray's maxT is lowered to the hit
+	bool Hit(PrimitiveShape aShape, int aFirst, int aCount, Ray& aRay, GeometryHit& aOutHit) const;
+	// Any hit among aCount primitives of aShape starting at aFirst
+	bool Occluded(PrimitiveShape aShape, int aFirst, int aCount, const Ray& aRay) const;
+	// The same for the rays of aPacket in the bitmask aLanes, one primitive at a time against all of them.
+	// Return the bitmask of the rays that hit, Hit lowers their maxT and stores their hits in their lane of someOutHits.
+	template <typename FloatN>
+	int Hit(PrimitiveShape aShape, int aFirst, int aCount, CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, GeometryHit* someOutHits) const;
+	template <typename FloatN>
+	int Occluded(PrimitiveShape aShape, int aFirst, int aCount, const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes) const;
+	// Starts loading the bounds of aCount primitives of aShape starting at aFirst into the cache, without waiting for them
+	inline void Prefetch(PrimitiveShape aShape, int aFirst, int aCount) const;
+
+	Vector3f GetNormal(const GeometryHit& aHit, const Vector3f& aPoint) const;
+	inline MaterialID GetMaterial(const GeometryHit& aHit) const
+	{
+		return aHit.myShape == PrimitiveShape::Sphere ? mySphereMaterials[aHit.mySlot] : myAABBMaterials[aHit.mySlot];
+	}
+	inline int GetIndex(const GeometryHit& aHit) const
+	{
+		return aHit.myShape == PrimitiveShape::Sphere ? mySphereIndices[aHit.mySlot] : myAABBIndices[aHit.mySlot];
+	}
+
+private:
+	inline int Intersect(PrimitiveShape aShape, int aFirst, const Ray& aRay, Lanes& aOutT) const;
+	template <typename FloatN>
+	inline int Intersect(PrimitiveShape aShape, int aSlot, const CommonUtilities::RayPacket<FloatN>& aPacket, FloatN& aOutT) const;
+	static inline int GetLaneMask(int aRemaining) { return aRemaining >= ourLaneCount ? (1 << ourLaneCount) - 1 : (1 << aRemaining) - 1; }
+
+	std::vector<float> mySphereCenterX;
+	std::vector<float> mySphereCenterY;
+	std::vector<float> mySphereCenterZ;
+	std::vector<float> mySphereRadius;
+	std::vector<MaterialID> mySphereMaterials;
+	std::vector<int> mySphereIndices;
+
+	std::vector<float> myAABBMinX;
+	std::vector<float> myAABBMinY;
+	std::vector<float> myAABBMinZ;
+	std::vector<float> myAABBMaxX;
+	std::vector<float> myAABBMaxY;
+	std::vector<float> myAABBMaxZ;
+	std::vector<MaterialID> myAABBMaterials;
+	std::vector<int> myAABBIndices;
+};
+
+void SceneGeometry::Clear()
+{
+	mySphereCenterX.clear();
+	mySphereCenterY.clear();
+	mySphereCenterZ.clear();
+	mySphereRadius.clear();
+	mySphereMaterials.clear();
+	mySphereIndices.clear();
+
+	myAABBMinX.clear();
+	myAABBMinY.clear();
+	myAABBMinZ.clear();
+	myAABBMaxX.clear();
+	myAABBMaxY.clear();
+	myAABBMaxZ.clear();
+	myAABBMaterials.clear();
+	myAABBIndices.clear();
+}
+
+void SceneGeometry::AddSphere(const CommonUtilities::Sphere<float>& aSphere, MaterialID aMaterial, int anIndex)
+{
+	mySphereCenterX.push_back(aSphere.GetCenter().x);
+	mySphereCenterY.push_back(aSphere.GetCenter().y);
+	mySphereCenterZ.push_back(aSphere.GetCenter().z);
+	mySphereRadius.push_back(aSphere.GetRadius());
+	mySphereMaterials.push_back(aMaterial);
+	mySphereIndices.push_back(anIndex);
+}
+
+void SceneGeometry::AddAABB(const CommonUtilities::AABB3D<float>& anAABB, MaterialID aMaterial, int anIndex)
+{
+	myAABBMinX.push_back(anAABB.GetMin().x);
+	myAABBMinY.push_back(anAABB.GetMin().y);
+	myAABBMinZ.push_back(anAABB.GetMin().z);
+	myAABBMaxX.push_back(anAABB.GetMax().x);
+	myAABBMaxY.push_back(anAABB.GetMax().y);
+	myAABBMaxZ.push_back(anAABB.GetMax().z);
+	myAABBMaterials.push_back(aMaterial);
+	myAABBIndices.push_back(anIndex);
+}
+
+void SceneGeometry::Finalize()
+{
+	const size_t sphereSize = mySphereMaterials.size() + ourLaneCount - 1;
+	mySphereCenterX.resize(sphereSize);
+	mySphereCenterY.resize(sphereSize);
+	mySphereCenterZ.resize(sphereSize);
+	mySphereRadius.resize(sphereSize);
+
+	const size_t aabbSize = myAABBMaterials.size() + ourLaneCount - 1;
+	myAABBMinX.resize(aabbSize);
+	myAABBMinY.resize(aabbSize);
+	myAABBMinZ.resize(aabbSize);
+	myAABBMaxX.resize(aabbSize);
+	myAABBMaxY.resize(aabbSize);
+	myAABBMaxZ.resize(aabbSize);
+}
+
+int SceneGeometry::Intersect(PrimitiveShape aShape, int aFirst, const Ray& aRay, Lanes& aOutT) const
+{
+	if (aShape == PrimitiveShape::Sphere)
+	{
+		return CommonUtilities::IntersectionSpheresRay(&mySphereCenterX[aFirst], &mySphereCenterY[aFirst], &mySphereCenterZ[aFirst],
+			&mySphereRadius[aFirst], aRay, aOutT);
+	}
+
+	return CommonUtilities::IntersectionAABBsRay(&myAABBMinX[aFirst], &myAABBMinY[aFirst], &myAABBMinZ[aFirst],
+		&myAABBMaxX[aFirst], &myAABBMaxY[aFirst], &myAABBMaxZ[aFirst], aRay, aOutT);
+}
+
+bool SceneGeometry::Hit(PrimitiveShape aShape, int aFirst, int aCount, Ray& aRay, GeometryHit& aOutHit) const
+{
+	bool isHit = false;
+	for (int i = aFirst; i < aFirst + aCount; i += ourLaneCount)
+	{
+		Lanes t;
+		int mask = Intersect(aShape, i, aRay, t) & GetLaneMask(aFirst + aCount - i);
+		if (mask == 0)
+			continue;
+
+		float ts[ourLaneCount];
+		t.Store(ts);
+		for (int lane = 0; lane < ourLaneCount; ++lane)
+		{
+			if ((mask & (1 << lane)) && ts[lane] <= aRay.GetMaxT())
+			{
+				aRay.SetMaxT(ts[lane]);
+				aOutHit = { ts[lane], aShape, i + lane };
+				isHit = true;
+			}
+		}
+	}
+	return isHit;
+}
+
+bool SceneGeometry::Occluded(PrimitiveShape aShape, int aFirst, int aCount, const Ray& aRay) const
+{
+	for (int i = aFirst; i < aFirst + aCount; i += ourLaneCount)
+	{
+		Lanes t;
+		if (Intersect(aShape, i, aRay, t) & GetLaneMask(aFirst + aCount - i))
+			return true;
+	}
+	return false;
+}
+
+void SceneGeometry::Prefetch(PrimitiveShape aShape, int aFirst, int aCount) const
+{
+	// Leaves are a few primitives, the cache lines of the first and the last one cover them in every array
+	const int last = aFirst + aCount - 1;
+	if (aShape == PrimitiveShape::Sphere)
+	{
+		for (const std::vector<float>* values : { &mySphereCenterX, &mySphereCenterY, &mySphereCenterZ, &mySphereRadius })
+		{
+			_mm_prefetch((const char*)&(*values)[aFirst], _MM_HINT_T0);
+			_mm_prefetch((const char*)&(*values)[last], _MM_HINT_T0);
+		}
+		return;
+	}
+
+	for (const std::vector<float>* values : { &myAABBMinX, &myAABBMinY, &myAABBMinZ, &myAABBMaxX, &myAABBMaxY, &myAABBMaxZ })
+	{
+		_mm_prefetch((const char*)&(*values)[aFirst], _MM_HINT_T0);
+		_mm_prefetch((const char*)&(*values)[last], _MM_HINT_T0);
+	}
+}
+
+template <typename FloatN>
+int SceneGeometry::Intersect(PrimitiveShape aShape, int aSlot, const CommonUtilities::RayPacket<FloatN>& aPacket, FloatN& aOutT) const
+{
+	if (aShape == PrimitiveShape::Sphere)
+		return CommonUtilities::IntersectionSphereRayPacket(mySphereCenterX[aSlot], mySphereCenterY[aSlot], mySphereCenterZ[aSlot], mySphereRadius[aSlot], aPacket, aOutT);
+
+	return CommonUtilities::IntersectionAABBSurfaceRayPacket(Vector3f(myAABBMinX[aSlot], myAABBMinY[aSlot], myAABBMinZ[aSlot]),
+		Vector3f(myAABBMaxX[aSlot], myAABBMaxY[aSlot], myAABBMaxZ[aSlot]), aPacket, aOutT);
+}
+
+template <typename FloatN>
+int SceneGeometry::Hit(PrimitiveShape aShape, int aFirst, int aCount, CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, GeometryHit* someOutHits) const
+{
+	int hitLanes = 0;
+	for (int i = aFirst; i < aFirst + aCount; ++i)
+	{
+		FloatN t;
+		const int mask = Intersect(aShape, i, aPacket, t) & aLanes;
+		if (mask == 0)
+			continue;
+
+		float ts[FloatN::ourLaneCount];
+		t.Store(ts);
+		for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+		{
+			if (mask & (1 << lane))
+			{
+				aPacket.myMaxT[lane] = ts[lane];
+				someOutHits[lane] = { ts[lane], aShape, i };
+			}
+		}
+		hitLanes |= mask;
+	}
+	return hitLanes;
+}
+
+template <typename FloatN>
+int SceneGeometry::Occluded(PrimitiveShape aShape, int aFirst, int aCount, const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes) const
+{
+	int occludedLanes = 0;
+	for (int i = aFirst; i < aFirst + aCount && occludedLanes != aLanes; ++i)
+	{
+		FloatN t;
+		occludedLanes |= Intersect(aShape, i, aPacket, t) & aLanes;
+	}
+	return occludedLanes;
+}
+
+CommonUtilities::Vector3<float> SceneGeometry::GetNormal(const GeometryHit& aHit, const Vector3f& aPoint) const
+{
+	const int slot = aHit.mySlot;
+	if (aHit.myShape == PrimitiveShape::Sphere)
+	{
+		Vector3f center(mySphereCenterX[slot], mySphereCenterY[slot], mySphereCenterZ[slot]);
+		return (aPoint - center) / mySphereRadius[slot];
+	}
+
+	// The normal of the box face closest to the hit
+	const float distances[6] = {
+		std::fabs(aPoint.x - myAABBMinX[slot]), std::fabs(aPoint.x - myAABBMaxX[slot]),
+		std::fabs(aPoint.y - myAABBMinY[slot]), std::fabs(aPoint.y - myAABBMaxY[slot]),
+		std::fabs(aPoint.z - myAABBMinZ[slot]), std::fabs(aPoint.z - myAABBMaxZ[slot]) };
+
+	int face = 0;
+	for (int i = 1; i < 6; ++i)
+	{
+		if (distances[i] < distances[face])
+			face = i;
+	}
+
+	Vector3f normal;
+	(&normal.x)[face / 2] = face % 2 == 0 ? -1.f : 1.f;
+	return normal;
+}
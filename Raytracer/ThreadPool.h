@@ -0,0 +1,249 @@
+#pragma once
+
+// stdlib
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct Tile
+{
+	int myX;
+	int myY;
+	int myWidth;
+	int myHeight;
+};
+
+// Persistent worker threads that render an image tile by tile.
+// Tiles are ordered along a Morton curve and split into one contiguous range per worker.
+// A worker takes tiles from the front of its own range, and when that is empty steals half of another worker's range from the back.
+class ThreadPool
+{
+public:
+	using TileFunction = std::function<void(const Tile& aTile, int aWorkerIndex)>;
+
+	// 0 workers uses one per hardware thread, pinned workers are each bound to their own core
+	explicit ThreadPool(int aWorkerCount = 0, bool aPinWorkers = false);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls aFunction once for every tile of a aWidth x aHeight image, returns when all tiles are done
+	void ForEachTile(int aWidth, int aHeight, int aTileSize, const TileFunction& aFunction);
+
+	inline int GetWorkerCount() const { return (int)myThreads.size(); }
+
+private:
+	// [begin, end) into myTiles packed in one word, so the owner and thieves can both update it with one CAS.
+	// Padded to a cache line so workers don't contend on each other's ranges.
+	struct TileRange
+	{
+		std::atomic<uint64_t> myRange;
+		char myPadding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	static inline uint64_t PackRange(uint32_t aBegin, uint32_t anEnd) { return (uint64_t)anEnd << 32 | aBegin; }
+	static inline uint32_t GetBegin(uint64_t aRange) { return (uint32_t)aRange; }
+	static inline uint32_t GetEnd(uint64_t aRange) { return (uint32_t)(aRange >> 32); }
+	static uint32_t GetMortonCode(uint32_t aX, uint32_t aY);
+	static void PinToCore(std::thread& aThread, int aCore);
+
+	void WorkerLoop(int aWorkerIndex);
+	void RunTiles(int aWorkerIndex);
+	bool PopTile(int aWorkerIndex, uint32_t& aOutTile);
+	bool StealTiles(int aWorkerIndex);
+
+	std::vector<std::thread> myThreads;
+	std::unique_ptr<TileRange[]> myRanges;
+	std::vector<Tile> myTiles;
+
+	std::mutex myMutex;
+	std::condition_variable myWorkCondition;
+	std::condition_variable myDoneCondition;
+	const TileFunction* myFunction = nullptr;
+	int myJobIndex = 0;
+	int myBusyWorkers = 0;
+	bool myIsStopping = false;
+};
+
+ThreadPool::ThreadPool(int aWorkerCount, bool aPinWorkers)
+{
+	const int hardwareThreads = std::max(1, (int)std::thread::hardware_concurrency());
+	const int workerCount = aWorkerCount > 0 ? aWorkerCount : hardwareThreads;
+
+	myRanges.reset(new TileRange[workerCount]);
+	for (int i = 0; i < workerCount; ++i)
+		myRanges[i].myRange.store(0);
+
+	myThreads.reserve(workerCount);
+	for (int i = 0; i < workerCount; ++i)
+	{
+		myThreads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+		if (aPinWorkers)
+			PinToCore(myThreads.back(), i % hardwareThreads);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(myMutex);
+		myIsStopping = true;
+	}
+	myWorkCondition.notify_all();
+
+	for (auto& thread : myThreads)
+		thread.join();
+}
+
+void ThreadPool::ForEachTile(int aWidth, int aHeight, int aTileSize, const TileFunction& aFunction)
+{
+	const int tilesX = (aWidth + aTileSize - 1) / aTileSize;
+	const int tilesY = (aHeight + aTileSize - 1) / aTileSize;
+
+	// Neighbouring tiles stay close in the order, so each worker's range covers a compact patch of the image
+	std::vector<std::pair<uint32_t, Tile>> ordered;
+	ordered.reserve(tilesX * tilesY);
+	for (int y = 0; y < tilesY; ++y)
+	{
+		for (int x = 0; x < tilesX; ++x)
+		{
+			Tile tile = { x * aTileSize, y * aTileSize, std::min(aTileSize, aWidth - x * aTileSize), std::min(aTileSize, aHeight - y * aTileSize) };
+			ordered.emplace_back(GetMortonCode(x, y), tile);
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint32_t, Tile>& aLeft, const std::pair<uint32_t, Tile>& aRight) { return aLeft.first < aRight.first; });
+
+	myTiles.clear();
+	for (const auto& tile : ordered)
+		myTiles.push_back(tile.second);
+
+	const int workerCount = GetWorkerCount();
+	const uint32_t tileCount = (uint32_t)myTiles.size();
+	for (int i = 0; i < workerCount; ++i)
+		myRanges[i].myRange.store(PackRange((uint32_t)((uint64_t)tileCount * i / workerCount), (uint32_t)((uint64_t)tileCount * (i + 1) / workerCount)));
+
+	std::unique_lock<std::mutex> lock(myMutex);
+	myFunction = &aFunction;
+	myBusyWorkers = workerCount;
+	++myJobIndex;
+	myWorkCondition.notify_all();
+	myDoneCondition.wait(lock, [this]() { return myBusyWorkers == 0; });
+	myFunction = nullptr;
+}
+
+void ThreadPool::WorkerLoop(int aWorkerIndex)
+{
+	int jobIndex = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(myMutex);
+			myWorkCondition.wait(lock, [this, jobIndex]() { return myIsStopping || myJobIndex != jobIndex; });
+			if (myIsStopping)
+				return;
+			jobIndex = myJobIndex;
+		}
+
+		RunTiles(aWorkerIndex);
+
+		std::lock_guard<std::mutex> lock(myMutex);
+		if (--myBusyWorkers == 0)
+			myDoneCondition.notify_one();
+	}
+}
+
+void ThreadPool::RunTiles(int aWorkerIndex)
+{
+	uint32_t tile;
+	do
+	{
+		while (PopTile(aWorkerIndex, tile))
+			(*myFunction)(myTiles[tile], aWorkerIndex);
+	} while (StealTiles(aWorkerIndex));
+}
+
+bool ThreadPool::PopTile(int aWorkerIndex, uint32_t& aOutTile)
+{
+	std::atomic<uint64_t>& range = myRanges[aWorkerIndex].myRange;
+	uint64_t current = range.load();
+	while (GetBegin(current) < GetEnd(current))
+	{
+		if (range.compare_exchange_weak(current, PackRange(GetBegin(current) + 1, GetEnd(current))))
+		{
+			aOutTile = GetBegin(current);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::StealTiles(int aWorkerIndex)
+{
+	// Only called with an empty own range, so no thief can be taking from it meanwhile
+	const int workerCount = GetWorkerCount();
+	for (int offset = 1; offset < workerCount; ++offset)
+	{
+		std::atomic<uint64_t>& victim = myRanges[(aWorkerIndex + offset) % workerCount].myRange;
+		uint64_t current = victim.load();
+		while (GetBegin(current) < GetEnd(current))
+		{
+			const uint32_t begin = GetBegin(current);
+			const uint32_t end = GetEnd(current);
+			const uint32_t split = end - (end - begin + 1) / 2;
+			if (victim.compare_exchange_weak(current, PackRange(begin, split)))
+			{
+				myRanges[aWorkerIndex].myRange.store(PackRange(split, end));
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+uint32_t ThreadPool::GetMortonCode(uint32_t aX, uint32_t aY)
+{
+	auto spread = [](uint32_t aValue)
+	{
+		aValue &= 0xFFFF;
+		aValue = (aValue | (aValue << 8)) & 0x00FF00FF;
+		aValue = (aValue | (aValue << 4)) & 0x0F0F0F0F;
+		aValue = (aValue | (aValue << 2)) & 0x33333333;
+		aValue = (aValue | (aValue << 1)) & 0x55555555;
+		return aValue;
+	};
+	return spread(aX) | (spread(aY) << 1);
+}
+
+void ThreadPool::PinToCore(std::thread& aThread, int aCore)
+{
+#if defined(_WIN32)
+	SetThreadAffinityMask(aThread.native_handle(), (DWORD_PTR)1 << aCore);
+#elif defined(__linux__)
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(aCore, &cores);
+	pthread_setaffinity_np(aThread.native_handle(), sizeof(cores), &cores);
+#else
+	(void)aThread;
+	(void)aCore;
+#endif
+}
@@ -2,6 +2,8 @@
 #include <stdint.h>
 #include <math.h>
 
+constexpr float PI = 3.14159265358979323846f;
+
 struct SRGB
 {
 	float r;
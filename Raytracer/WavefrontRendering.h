@@ -0,0 +1,269 @@
+#pragma once
+
+#include "CScene.h"
+#include "Film.h"
+#include "ThreadPool.h"
+#include "Sampler.h"
+
+// stdlib
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+// Renders a wave of many paths at a time, a bounce at a time, instead of one path from start to end like CScene::Raytrace.
+// Every bounce runs in stages over the whole wave: intersect every path, shade the paths queue by queue, one queue for each kind
+// of material hit, then trace the shadow rays the shading deferred. Each stage is a parallel loop over chunks of its queue and
+// hands paths on through queues that every chunk appends to with one atomic add, so a kernel's code and materials stay in cache
+// while it runs and the intersections are one large batch, traced in ray packets where neighbouring paths point the same way.
+// Path guide training and resampled direct light rely on the order of the passes and aren't supported.
+namespace WavefrontRendering
+{
+	struct Settings
+	{
+		// Paths in flight, each takes about 550 bytes, more with the radiance cache.
+		// Few enough that the wave stays in cache between stages, enough to keep every thread busy on its last bounces.
+		int myWaveSize = 1 << 12;
+		// Paths per task of a stage
+		int myChunkSize = 128;
+		SamplerType mySamplerType = SamplerType::Sobol;
+	};
+
+	// Indices of the paths waiting for a stage
+	class PathQueue
+	{
+	public:
+		inline void Reserve(int aCapacity) { myPaths.resize(aCapacity); }
+		inline void Clear() { myCount.store(0, std::memory_order_relaxed); }
+		inline int GetCount() const { return myCount.load(std::memory_order_relaxed); }
+		inline int operator[](int anIndex) const { return myPaths[anIndex]; }
+
+		// Safe to call from many workers at once, the stage that reads the queue only starts after they are done
+		inline void Append(const std::vector<int>& somePaths)
+		{
+			if (somePaths.empty())
+				return;
+			const int first = myCount.fetch_add((int)somePaths.size(), std::memory_order_relaxed);
+			std::copy(somePaths.begin(), somePaths.end(), myPaths.begin() + first);
+		}
+
+	private:
+		std::vector<int> myPaths;
+		std::atomic<int> myCount{ 0 };
+	};
+
+	// Where every path waits between stages
+	enum Queue
+	{
+		MissQueue,
+		EmissiveQueue,
+		MirrorQueue,
+		GlassQueue,
+		DiffuseQueue,
+		ShadowQueue,
+		ActiveQueue, // paths left for the next bounce
+		QueueCount
+	};
+
+	struct PathSlot
+	{
+		PathState myPath;
+		SurfaceHit myHit;
+		FeatureSample myFeatures;
+		ShadowQuery myShadows[2];
+		int myX;
+		int myY;
+		int mySampleIndex;
+	};
+
+	inline Queue GetShadingQueue(MaterialType aType)
+	{
+		switch (aType)
+		{
+		case MaterialType::Emissive: return EmissiveQueue;
+		case MaterialType::Mirror: return MirrorQueue;
+		case MaterialType::Glass: return GlassQueue;
+		default: return DiffuseQueue;
+		}
+	}
+
+	// Calls aFunction(aFirst, aLast, aWorkerIndex) for chunks of [0, aCount) on the thread pool
+	template <typename Function>
+	inline void ForEachChunk(ThreadPool& aThreadPool, int aCount, int aChunkSize, const Function& aFunction)
+	{
+		if (aCount == 0)
+			return;
+		const int chunkCount = (aCount + aChunkSize - 1) / aChunkSize;
+		aThreadPool.ForEachTile(chunkCount, 1, 1, [&](const Tile& aTile, int aWorkerIndex)
+		{
+			const int first = aTile.myX * aChunkSize;
+			aFunction(first, std::min(first + aChunkSize, aCount), aWorkerIndex);
+		});
+	}
+
+	// Takes aSamplesPerPixel samples of every pixel into aFilm, returns the total number of samples taken
+	inline long long Render(CScene& aScene, ThreadPool& aThreadPool, Film& aFilm, int aSamplesPerPixel, const Settings& someSettings)
+	{
+		const int width = aFilm.GetWidth();
+		const int height = aFilm.GetHeight();
+		const long long totalSamples = (long long)width * height * aSamplesPerPixel;
+		const int waveSize = (int)std::min<long long>(someSettings.myWaveSize, totalSamples);
+		const int chunkSize = someSettings.myChunkSize;
+
+		std::vector<std::unique_ptr<Sampler>> samplers;
+		for (int i = 0; i < aThreadPool.GetWorkerCount(); ++i)
+			samplers.push_back(CreateSampler(someSettings.mySamplerType));
+
+		std::vector<PathSlot> slots(waveSize);
+		std::vector<RadianceCache::PathRecord> cacheRecords(aScene.GetRadianceCache().IsEnabled() ? waveSize : 0);
+
+		// A bounce reads one active queue and fills the other for the next bounce
+		PathQueue queues[ActiveQueue];
+		PathQueue activeQueues[2];
+		PathQueue* active = &activeQueues[0];
+		PathQueue* nextActive = &activeQueues[1];
+		for (PathQueue& queue : queues)
+			queue.Reserve(waveSize);
+		for (PathQueue& queue : activeQueues)
+			queue.Reserve(waveSize);
+
+		// What a chunk appends to the queues, gathered first so the shared counters are only touched once per chunk
+		std::vector<std::vector<std::vector<int>>> workerQueues(aThreadPool.GetWorkerCount(), std::vector<std::vector<int>>(QueueCount));
+		auto startChunk = [&](int aWorkerIndex) -> std::vector<std::vector<int>>&
+		{
+			for (std::vector<int>& paths : workerQueues[aWorkerIndex])
+				paths.clear();
+			return workerQueues[aWorkerIndex];
+		};
+		auto flushChunk = [&](int aWorkerIndex)
+		{
+			for (int queue = 0; queue < QueueCount; ++queue)
+				(queue == ActiveQueue ? *nextActive : queues[queue]).Append(workerQueues[aWorkerIndex][queue]);
+		};
+
+		for (long long waveStart = 0; waveStart < totalSamples; waveStart += waveSize)
+		{
+			const int pathCount = (int)std::min<long long>(waveSize, totalSamples - waveStart);
+
+			// Generate, the samples of a pixel are next to each other
+			nextActive->Clear();
+			ForEachChunk(aThreadPool, pathCount, chunkSize, [&](int aFirst, int aLast, int aWorkerIndex)
+			{
+				std::vector<std::vector<int>>& local = startChunk(aWorkerIndex);
+				Sampler& sampler = *samplers[aWorkerIndex];
+				for (int i = aFirst; i < aLast; ++i)
+				{
+					const long long sample = waveStart + i;
+					const int pixel = (int)(sample / aSamplesPerPixel);
+					PathSlot& slot = slots[i];
+					slot.myX = pixel % width;
+					slot.myY = pixel / width;
+					slot.mySampleIndex = (int)(sample % aSamplesPerPixel);
+
+					const Ray ray = aScene.CreatePixelRay(slot.myX, slot.myY, slot.mySampleIndex, sampler);
+					aScene.InitializePath(slot.myPath, ray, pixel, &slot.myFeatures, nullptr, cacheRecords.empty() ? nullptr : &cacheRecords[i]);
+					slot.myPath.myDeferredShadows = slot.myShadows;
+					local[ActiveQueue].push_back(i);
+				}
+				flushChunk(aWorkerIndex);
+			});
+			std::swap(active, nextActive);
+
+			while (active->GetCount() > 0)
+			{
+				for (PathQueue& queue : queues)
+					queue.Clear();
+				nextActive->Clear();
+
+				// Intersect a packet of neighbouring paths at a time, camera rays of the same pixel stay coherent
+				ForEachChunk(aThreadPool, active->GetCount(), chunkSize, [&](int aFirst, int aLast, int aWorkerIndex)
+				{
+					std::vector<std::vector<int>>& local = startChunk(aWorkerIndex);
+					for (int first = aFirst; first < aLast; first += RayPacket::ourLaneCount)
+					{
+						const int count = aLast - first < RayPacket::ourLaneCount ? aLast - first : RayPacket::ourLaneCount;
+						Ray rays[RayPacket::ourLaneCount];
+						SurfaceHit hits[RayPacket::ourLaneCount];
+						bool isHit[RayPacket::ourLaneCount];
+						for (int i = 0; i < count; ++i)
+							rays[i] = slots[(*active)[first + i]].myPath.myRay;
+						aScene.Hit(rays, count, hits, isHit);
+
+						for (int i = 0; i < count; ++i)
+						{
+							const int path = (*active)[first + i];
+							if (isHit[i])
+							{
+								slots[path].myHit = hits[i];
+								local[GetShadingQueue(aScene.GetMaterialType(hits[i]))].push_back(path);
+							}
+							else
+							{
+								local[MissQueue].push_back(path);
+							}
+						}
+					}
+					flushChunk(aWorkerIndex);
+				});
+
+				// Shade, one kind of material at a time
+				for (int queue = MissQueue; queue <= DiffuseQueue; ++queue)
+				{
+					const PathQueue& shading = queues[queue];
+					ForEachChunk(aThreadPool, shading.GetCount(), chunkSize, [&](int aFirst, int aLast, int aWorkerIndex)
+					{
+						std::vector<std::vector<int>>& local = startChunk(aWorkerIndex);
+						Sampler& sampler = *samplers[aWorkerIndex];
+						for (int i = aFirst; i < aLast; ++i)
+						{
+							PathSlot& slot = slots[shading[i]];
+							PathState& path = slot.myPath;
+							path.myDeferredShadowCount = 0;
+							sampler.StartPixelSample(slot.myX, slot.myY, slot.mySampleIndex);
+							if (queue == MissQueue)
+								aScene.ShadeMiss(path);
+							else
+								aScene.ShadeHit(path, slot.myHit, sampler);
+
+							if (path.myDeferredShadowCount > 0)
+								local[ShadowQueue].push_back(shading[i]);
+							if (!path.myIsDone && path.myDepth < aScene.GetRenderSettings().myMaxBounces)
+								local[ActiveQueue].push_back(shading[i]);
+						}
+						flushChunk(aWorkerIndex);
+					});
+				}
+
+				// Shadow rays
+				const PathQueue& shadows = queues[ShadowQueue];
+				ForEachChunk(aThreadPool, shadows.GetCount(), chunkSize, [&](int aFirst, int aLast, int)
+				{
+					for (int i = aFirst; i < aLast; ++i)
+					{
+						PathState& path = slots[shadows[i]].myPath;
+						for (int shadow = 0; shadow < path.myDeferredShadowCount; ++shadow)
+						{
+							const ShadowQuery& query = path.myDeferredShadows[shadow];
+							if (!aScene.Occluded(query.myRay, query.myMaxT))
+								path.myRadiance += query.myRadiance;
+						}
+					}
+				});
+
+				std::swap(active, nextActive);
+			}
+
+			ForEachChunk(aThreadPool, pathCount, chunkSize, [&](int aFirst, int aLast, int)
+			{
+				for (int i = aFirst; i < aLast; ++i)
+					aScene.FinishPath(slots[i].myPath);
+			});
+
+			// In order, a pixel's samples can be split between chunks
+			for (int i = 0; i < pathCount; ++i)
+				aFilm.AddSample(slots[i].myX, slots[i].myY, slots[i].myPath.myRadiance, slots[i].myFeatures);
+		}
+
+		return totalSamples;
+	}
+}
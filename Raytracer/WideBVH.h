@@ -0,0 +1,677 @@
+#pragma once
+
+#include "BVH.h"
+
+// stdlib
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <xmmintrin.h>
+
+// Four-wide BVH collapsed from a binary BVH.
+// The bounds of all children of a node are stored as SoA lanes and tested against a ray with one set of SSE instructions.
+// Packets of rays that point into the same octant are traced together. Inner nodes are only tested against a frustum
+// around the whole packet, with one set of SSE instructions for all children and rays, and leaves against every ray of it.
+// Groups of rays that point anywhere can be traced to their closest hits interleaved instead: every ray takes one step of its own
+// traversal in turn and prefetches what its next step reads, so on scenes larger than the cache the misses of the group overlap.
+class WideBVH
+{
+public:
+	using Vector3f = CommonUtilities::Vector3<float>;
+	using AABB3Df = CommonUtilities::AABB3D<float>;
+	using Ray = CommonUtilities::Ray<float>;
+
+	static constexpr int ourWidth = 4;
+	// Rays traced interleaved at a time, enough to cover the latency of a cache miss with the steps of the others
+	static constexpr int ourInterleavedRayCount = 8;
+
+	struct alignas(16) Node
+	{
+		float myMinX[ourWidth];
+		float myMinY[ourWidth];
+		float myMinZ[ourWidth];
+		float myMaxX[ourWidth];
+		float myMaxY[ourWidth];
+		float myMaxZ[ourWidth];
+		int myChild[ourWidth]; // first primitive for leaf children, wide node index for inner children
+		int myCount[ourWidth]; // primitives in a leaf child, 0 for inner children and -1 for empty slots
+		PrimitiveShape myShape[ourWidth];
+	};
+
+	void Build(const BVH& aBVH);
+	// Closest hit within the ray's [minT, maxT], only the distance is calculated
+	bool Hit(const Ray& aRay, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const;
+	// Any hit within the ray's [minT, maxT], stops at the first one found
+	bool Occluded(const Ray& aRay, const SceneGeometry& aGeometry) const;
+	// The same for the rays of aPacket in the bitmask aLanes, which have to point into the same octant.
+	// Return the bitmask of the rays that hit, Hit stores their hits in their lane of someOutHits.
+	template <typename FloatN>
+	int Hit(CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, const SceneGeometry& aGeometry, GeometryHit* someOutHits) const;
+	template <typename FloatN>
+	int Occluded(const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, const SceneGeometry& aGeometry) const;
+	// Closest hits of up to ourInterleavedRayCount rays in any directions, traced interleaved. Each ray visits the same nodes
+	// in the same order as when traced alone, so the results are the same.
+	void Hit(const Ray* someRays, int aCount, const SceneGeometry& aGeometry, GeometryHit* someOutHits, bool* someOutIsHit) const;
+
+	inline size_t GetNodeCount() const { return myNodes.size(); }
+
+private:
+	void Collapse(const std::vector<BVH::Node>& someBinaryNodes, int aBinaryIndex, int aWideIndex);
+
+	struct RayLanes
+	{
+		__m128 myOriginX, myOriginY, myOriginZ;
+		__m128 myInvDirX, myInvDirY, myInvDirZ;
+		bool myNegativeX, myNegativeY, myNegativeZ;
+	};
+
+	static constexpr int ourStackSize = (ourWidth - 1) * BVH::ourMaxDepth + 2;
+
+	struct StackEntry
+	{
+		int myIndex;
+		int myCount; // > 0 for a leaf, 0 for a wide node
+		PrimitiveShape myShape;
+		float myNearT;
+	};
+
+	// Where a ray traced interleaved stopped after its last step
+	struct HitState
+	{
+		RayLanes myLanes;
+		Ray myRay;
+		StackEntry myStack[ourStackSize];
+		int myStackSize;
+		bool myIsHit;
+	};
+
+	// Ranges of the origins and reciprocal directions of a packet's rays, which bound the distances of every slab from below and above
+	struct PacketFrustum
+	{
+		__m128 myOriginMin[3], myOriginMax[3];
+		__m128 myInvDirMin[3], myInvDirMax[3];
+		int mySign[3];
+		float myMinT; // smallest of the rays
+		bool myIsValid; // false if a ray is parallel to an axis, its reciprocal direction can't bound anything
+	};
+
+	static inline RayLanes CreateRayLanes(const Ray& aRay);
+	// Returns a bitmask of the children whose bounds overlap [aMinT, aMaxT]
+	static inline int IntersectChildren(const Node& aNode, const RayLanes& aRay, float aMinT, float aMaxT, __m128& aOutNearT);
+	template <typename FloatN>
+	static inline PacketFrustum CreateFrustum(const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes);
+	// Returns a bitmask of the children some ray of the frustum might reach before aMaxT, the closest any of them might enter them is stored in aOutNearT
+	static inline int CullChildren(const Node& aNode, const PacketFrustum& aFrustum, float aMaxT, __m128& aOutNearT);
+	// Returns a bitmask of the rays of aPacket in aLanes whose [minT, maxT] overlaps the bounds of the child, with the closest distance any of them enters it
+	template <typename FloatN>
+	static inline int IntersectChild(const Node& aNode, int aChild, const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, float& aOutNearT);
+	// Tests the next node or leaf on the stack that the ray can still reach and prefetches the one after it, false once the stack is empty
+	inline bool StepHit(HitState& aState, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const;
+	inline void PrefetchNode(int anIndex) const;
+
+	std::vector<Node> myNodes;
+};
+
+void WideBVH::Build(const BVH& aBVH)
+{
+	myNodes.clear();
+
+	const auto& binaryNodes = aBVH.GetNodes();
+	if (binaryNodes.empty())
+		return;
+
+	myNodes.reserve(binaryNodes.size() / 2 + 1);
+	myNodes.emplace_back();
+	Collapse(binaryNodes, 0, 0);
+}
+
+void WideBVH::Collapse(const std::vector<BVH::Node>& someBinaryNodes, int aBinaryIndex, int aWideIndex)
+{
+	int children[ourWidth];
+	int childCount = 0;
+
+	const auto& binaryNode = someBinaryNodes[aBinaryIndex];
+	if (binaryNode.IsLeaf())
+		children[childCount++] = aBinaryIndex;
+	else
+	{
+		children[childCount++] = binaryNode.myFirst;
+		children[childCount++] = binaryNode.myFirst + 1;
+	}
+
+	// Keep opening the inner child with the largest surface area until the node is full
+	while (childCount < ourWidth)
+	{
+		int largest = -1;
+		float largestArea = -1.f;
+		for (int i = 0; i < childCount; ++i)
+		{
+			const auto& child = someBinaryNodes[children[i]];
+			if (!child.IsLeaf() && child.myBounds.GetSurfaceArea() > largestArea)
+			{
+				largestArea = child.myBounds.GetSurfaceArea();
+				largest = i;
+			}
+		}
+		if (largest < 0)
+			break;
+
+		const int opened = children[largest];
+		children[largest] = someBinaryNodes[opened].myFirst;
+		children[childCount++] = someBinaryNodes[opened].myFirst + 1;
+	}
+
+	int innerChildren[ourWidth];
+	for (int i = 0; i < ourWidth; ++i)
+	{
+		Node& node = myNodes[aWideIndex];
+		innerChildren[i] = -1;
+
+		if (i >= childCount)
+		{
+			// Empty slots have inverted bounds so the slab test always misses them
+			const float inf = std::numeric_limits<float>::infinity();
+			node.myMinX[i] = node.myMinY[i] = node.myMinZ[i] = inf;
+			node.myMaxX[i] = node.myMaxY[i] = node.myMaxZ[i] = -inf;
+			node.myChild[i] = 0;
+			node.myCount[i] = -1;
+			node.myShape[i] = PrimitiveShape::Sphere;
+			continue;
+		}
+
+		const auto& child = someBinaryNodes[children[i]];
+		const auto min = child.myBounds.GetMin();
+		const auto max = child.myBounds.GetMax();
+		node.myMinX[i] = min.x;
+		node.myMinY[i] = min.y;
+		node.myMinZ[i] = min.z;
+		node.myMaxX[i] = max.x;
+		node.myMaxY[i] = max.y;
+		node.myMaxZ[i] = max.z;
+
+		node.myShape[i] = child.myShape;
+		if (child.IsLeaf())
+		{
+			node.myChild[i] = child.myFirst;
+			node.myCount[i] = child.myCount;
+		}
+		else
+		{
+			node.myChild[i] = (int)myNodes.size();
+			node.myCount[i] = 0;
+			innerChildren[i] = children[i];
+			myNodes.emplace_back();
+		}
+	}
+
+	for (int i = 0; i < childCount; ++i)
+	{
+		if (innerChildren[i] >= 0)
+			Collapse(someBinaryNodes, innerChildren[i], myNodes[aWideIndex].myChild[i]);
+	}
+}
+
+WideBVH::RayLanes WideBVH::CreateRayLanes(const Ray& aRay)
+{
+	const Vector3f& origin = aRay.GetOrigin();
+	const Vector3f& invDir = aRay.GetInverseDirection();
+
+	RayLanes lanes;
+	lanes.myOriginX = _mm_set1_ps(origin.x);
+	lanes.myOriginY = _mm_set1_ps(origin.y);
+	lanes.myOriginZ = _mm_set1_ps(origin.z);
+	lanes.myInvDirX = _mm_set1_ps(invDir.x);
+	lanes.myInvDirY = _mm_set1_ps(invDir.y);
+	lanes.myInvDirZ = _mm_set1_ps(invDir.z);
+
+	// The near and far planes of every slab only depend on the sign of the direction
+	lanes.myNegativeX = aRay.GetSign(0) != 0;
+	lanes.myNegativeY = aRay.GetSign(1) != 0;
+	lanes.myNegativeZ = aRay.GetSign(2) != 0;
+	return lanes;
+}
+
+int WideBVH::IntersectChildren(const Node& aNode, const RayLanes& aRay, float aMinT, float aMaxT, __m128& aOutNearT)
+{
+	// NaNs from a zero direction component are dropped by max/min returning their second operand
+	__m128 nearT = _mm_set1_ps(aMinT);
+	__m128 farT = _mm_set1_ps(aMaxT);
+	nearT = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeX ? aNode.myMaxX : aNode.myMinX), aRay.myOriginX), aRay.myInvDirX), nearT);
+	farT = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeX ? aNode.myMinX : aNode.myMaxX), aRay.myOriginX), aRay.myInvDirX), farT);
+	nearT = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeY ? aNode.myMaxY : aNode.myMinY), aRay.myOriginY), aRay.myInvDirY), nearT);
+	farT = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeY ? aNode.myMinY : aNode.myMaxY), aRay.myOriginY), aRay.myInvDirY), farT);
+	nearT = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeZ ? aNode.myMaxZ : aNode.myMinZ), aRay.myOriginZ), aRay.myInvDirZ), nearT);
+	farT = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(aRay.myNegativeZ ? aNode.myMinZ : aNode.myMaxZ), aRay.myOriginZ), aRay.myInvDirZ), farT);
+
+	aOutNearT = nearT;
+	return _mm_movemask_ps(_mm_cmple_ps(nearT, farT));
+}
+
+bool WideBVH::Hit(const Ray& aRay, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const
+{
+	if (myNodes.empty())
+		return false;
+
+	const RayLanes lanes = CreateRayLanes(aRay);
+	Ray ray = aRay;
+
+	StackEntry stack[ourStackSize];
+	int stackSize = 0;
+
+	bool isHit = false;
+	stack[stackSize++] = { 0, 0, PrimitiveShape::Sphere, ray.GetMinT() };
+
+	while (stackSize > 0)
+	{
+		const StackEntry entry = stack[--stackSize];
+		if (entry.myNearT > ray.GetMaxT())
+			continue;
+
+		if (entry.myCount > 0)
+		{
+			isHit |= aGeometry.Hit(entry.myShape, entry.myIndex, entry.myCount, ray, aOutHit);
+			continue;
+		}
+
+		const Node& node = myNodes[entry.myIndex];
+
+		__m128 nearT;
+		int mask = IntersectChildren(node, lanes, ray.GetMinT(), ray.GetMaxT(), nearT);
+		if (mask == 0)
+			continue;
+
+		alignas(16) float nearTs[ourWidth];
+		_mm_store_ps(nearTs, nearT);
+
+		// Order the hit children far to near, so the nearest one ends up on top of the stack
+		StackEntry hits[ourWidth];
+		int hitCount = 0;
+		for (int i = 0; i < ourWidth; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			StackEntry hit = { node.myChild[i], node.myCount[i], node.myShape[i], nearTs[i] };
+			int j = hitCount++;
+			for (; j > 0 && hits[j - 1].myNearT < hit.myNearT; --j)
+				hits[j] = hits[j - 1];
+			hits[j] = hit;
+		}
+
+		for (int i = 0; i < hitCount; ++i)
+			stack[stackSize++] = hits[i];
+	}
+
+	return isHit;
+}
+
+bool WideBVH::Occluded(const Ray& aRay, const SceneGeometry& aGeometry) const
+{
+	if (myNodes.empty())
+		return false;
+
+	const RayLanes lanes = CreateRayLanes(aRay);
+
+	int stack[ourStackSize];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		const Node& node = myNodes[stack[--stackSize]];
+
+		__m128 nearT;
+		int mask = IntersectChildren(node, lanes, aRay.GetMinT(), aRay.GetMaxT(), nearT);
+
+		for (int i = 0; i < ourWidth; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			if (node.myCount[i] == 0)
+			{
+				stack[stackSize++] = node.myChild[i];
+				continue;
+			}
+
+			if (aGeometry.Occluded(node.myShape[i], node.myChild[i], node.myCount[i], aRay))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+void WideBVH::PrefetchNode(int anIndex) const
+{
+	const char* node = (const char*)&myNodes[anIndex];
+	for (size_t offset = 0; offset < sizeof(Node); offset += 64)
+		_mm_prefetch(node + offset, _MM_HINT_T0);
+}
+
+bool WideBVH::StepHit(HitState& aState, const SceneGeometry& aGeometry, GeometryHit& aOutHit) const
+{
+	// Entries the ray can no longer reach are dropped without reading their memory, they don't count as a step
+	StackEntry entry;
+	do
+	{
+		if (aState.myStackSize == 0)
+			return false;
+		entry = aState.myStack[--aState.myStackSize];
+	} while (entry.myNearT > aState.myRay.GetMaxT());
+
+	if (entry.myCount > 0)
+	{
+		aState.myIsHit |= aGeometry.Hit(entry.myShape, entry.myIndex, entry.myCount, aState.myRay, aOutHit);
+	}
+	else
+	{
+		const Node& node = myNodes[entry.myIndex];
+
+		__m128 nearT;
+		const int mask = IntersectChildren(node, aState.myLanes, aState.myRay.GetMinT(), aState.myRay.GetMaxT(), nearT);
+		alignas(16) float nearTs[ourWidth];
+		_mm_store_ps(nearTs, nearT);
+
+		// The same far to near order as Hit
+		StackEntry hits[ourWidth];
+		int hitCount = 0;
+		for (int i = 0; i < ourWidth; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			StackEntry hit = { node.myChild[i], node.myCount[i], node.myShape[i], nearTs[i] };
+			int j = hitCount++;
+			for (; j > 0 && hits[j - 1].myNearT < hit.myNearT; --j)
+				hits[j] = hits[j - 1];
+			hits[j] = hit;
+		}
+
+		for (int i = 0; i < hitCount; ++i)
+			aState.myStack[aState.myStackSize++] = hits[i];
+	}
+
+	if (aState.myStackSize == 0)
+		return false;
+
+	const StackEntry& next = aState.myStack[aState.myStackSize - 1];
+	if (next.myCount > 0)
+		aGeometry.Prefetch(next.myShape, next.myIndex, next.myCount);
+	else
+		PrefetchNode(next.myIndex);
+	return true;
+}
+
+void WideBVH::Hit(const Ray* someRays, int aCount, const SceneGeometry& aGeometry, GeometryHit* someOutHits, bool* someOutIsHit) const
+{
+	if (myNodes.empty())
+	{
+		for (int i = 0; i < aCount; ++i)
+			someOutIsHit[i] = false;
+		return;
+	}
+
+	HitState states[ourInterleavedRayCount];
+	int active[ourInterleavedRayCount];
+	int activeCount = 0;
+	for (int i = 0; i < aCount; ++i)
+	{
+		HitState& state = states[i];
+		state.myLanes = CreateRayLanes(someRays[i]);
+		state.myRay = someRays[i];
+		state.myStack[0] = { 0, 0, PrimitiveShape::Sphere, someRays[i].GetMinT() };
+		state.myStackSize = 1;
+		state.myIsHit = false;
+		active[activeCount++] = i;
+	}
+	PrefetchNode(0);
+
+	// Round robin over the rays still traversing, a finished ray hands its place to the last one
+	while (activeCount > 0)
+	{
+		for (int i = 0; i < activeCount;)
+		{
+			const int ray = active[i];
+			if (StepHit(states[ray], aGeometry, someOutHits[ray]))
+				++i;
+			else
+				active[i] = active[--activeCount];
+		}
+	}
+
+	for (int i = 0; i < aCount; ++i)
+		someOutIsHit[i] = states[i].myIsHit;
+}
+
+template <typename FloatN>
+WideBVH::PacketFrustum WideBVH::CreateFrustum(const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes)
+{
+	const float inf = std::numeric_limits<float>::infinity();
+
+	PacketFrustum frustum;
+	frustum.myIsValid = true;
+	frustum.myMinT = inf;
+	for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+	{
+		if (aLanes & (1 << lane))
+			frustum.myMinT = std::fmin(frustum.myMinT, aPacket.myMinT[lane]);
+	}
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float* origins = aPacket.GetOrigin(axis);
+		const float* invDirs = aPacket.GetInverseDirection(axis);
+		float originMin = inf, originMax = -inf, invDirMin = inf, invDirMax = -inf;
+		for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+		{
+			if (!(aLanes & (1 << lane)))
+				continue;
+			originMin = std::fmin(originMin, origins[lane]);
+			originMax = std::fmax(originMax, origins[lane]);
+			invDirMin = std::fmin(invDirMin, invDirs[lane]);
+			invDirMax = std::fmax(invDirMax, invDirs[lane]);
+		}
+
+		if (!(std::fabs(invDirMin) < inf && std::fabs(invDirMax) < inf))
+			frustum.myIsValid = false;
+		frustum.myOriginMin[axis] = _mm_set1_ps(originMin);
+		frustum.myOriginMax[axis] = _mm_set1_ps(originMax);
+		frustum.myInvDirMin[axis] = _mm_set1_ps(invDirMin);
+		frustum.myInvDirMax[axis] = _mm_set1_ps(invDirMax);
+		frustum.mySign[axis] = aPacket.mySign[axis];
+	}
+	return frustum;
+}
+
+int WideBVH::CullChildren(const Node& aNode, const PacketFrustum& aFrustum, float aMaxT, __m128& aOutNearT)
+{
+	const float* bounds[2][3] = { { aNode.myMinX, aNode.myMinY, aNode.myMinZ }, { aNode.myMaxX, aNode.myMaxY, aNode.myMaxZ } };
+
+	// The origin closest to a child's near plane gives the smallest distance to it, the one farthest from its far plane the largest.
+	// With the rays in one octant the reciprocal directions have one sign, so the range of products is spanned by its ends.
+	__m128 nearT = _mm_set1_ps(aFrustum.myMinT);
+	__m128 farT = _mm_set1_ps(aMaxT);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const int sign = aFrustum.mySign[axis];
+		const __m128 toNear = _mm_sub_ps(_mm_load_ps(bounds[sign][axis]), sign ? aFrustum.myOriginMin[axis] : aFrustum.myOriginMax[axis]);
+		const __m128 toFar = _mm_sub_ps(_mm_load_ps(bounds[1 - sign][axis]), sign ? aFrustum.myOriginMax[axis] : aFrustum.myOriginMin[axis]);
+		nearT = _mm_max_ps(nearT, _mm_min_ps(_mm_mul_ps(toNear, aFrustum.myInvDirMin[axis]), _mm_mul_ps(toNear, aFrustum.myInvDirMax[axis])));
+		farT = _mm_min_ps(farT, _mm_max_ps(_mm_mul_ps(toFar, aFrustum.myInvDirMin[axis]), _mm_mul_ps(toFar, aFrustum.myInvDirMax[axis])));
+	}
+	aOutNearT = nearT;
+	return _mm_movemask_ps(_mm_cmple_ps(nearT, farT));
+}
+
+template <typename FloatN>
+int WideBVH::IntersectChild(const Node& aNode, int aChild, const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, float& aOutNearT)
+{
+	FloatN nearT;
+	const int lanes = CommonUtilities::IntersectionAABBRayPacket(Vector3f(aNode.myMinX[aChild], aNode.myMinY[aChild], aNode.myMinZ[aChild]),
+		Vector3f(aNode.myMaxX[aChild], aNode.myMaxY[aChild], aNode.myMaxZ[aChild]), aPacket, nearT) & aLanes;
+	if (lanes == 0)
+		return 0;
+
+	float nearTs[FloatN::ourLaneCount];
+	nearT.Store(nearTs);
+	aOutNearT = std::numeric_limits<float>::infinity();
+	for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+	{
+		if (lanes & (1 << lane))
+			aOutNearT = std::fmin(aOutNearT, nearTs[lane]);
+	}
+	return lanes;
+}
+
+template <typename FloatN>
+int WideBVH::Hit(CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, const SceneGeometry& aGeometry, GeometryHit* someOutHits) const
+{
+	if (myNodes.empty() || aLanes == 0)
+		return 0;
+
+	const PacketFrustum frustum = CreateFrustum(aPacket, aLanes);
+
+	struct PacketEntry
+	{
+		int myIndex;
+		int myCount; // > 0 for a leaf, 0 for a wide node
+		PrimitiveShape myShape;
+		int myLanes; // the rays that reached it
+		float myNearT; // closest any of them enters it
+	};
+	PacketEntry stack[ourStackSize];
+	int stackSize = 0;
+
+	int hitLanes = 0;
+	stack[stackSize++] = { 0, 0, PrimitiveShape::Sphere, aLanes, -std::numeric_limits<float>::infinity() };
+
+	while (stackSize > 0)
+	{
+		const PacketEntry entry = stack[--stackSize];
+
+		// Farthest any of the rays still reaches, their maxT shrinks as they hit
+		float maxT = -std::numeric_limits<float>::infinity();
+		for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+		{
+			if (entry.myLanes & (1 << lane))
+				maxT = std::fmax(maxT, aPacket.myMaxT[lane]);
+		}
+		if (entry.myNearT > maxT)
+			continue;
+
+		if (entry.myCount > 0)
+		{
+			hitLanes |= aGeometry.Hit(entry.myShape, entry.myIndex, entry.myCount, aPacket, entry.myLanes, someOutHits);
+			continue;
+		}
+
+		const Node& node = myNodes[entry.myIndex];
+		alignas(16) float frustumNearTs[ourWidth];
+		int children = (1 << ourWidth) - 1;
+		if (frustum.myIsValid)
+		{
+			__m128 nearT;
+			children = CullChildren(node, frustum, maxT, nearT);
+			_mm_store_ps(frustumNearTs, nearT);
+		}
+
+		// Order the hit children far to near, so the nearest one ends up on top of the stack
+		PacketEntry hits[ourWidth];
+		int hitCount = 0;
+		for (int i = 0; i < ourWidth; ++i)
+		{
+			if (!(children & (1 << i)) || node.myCount[i] < 0)
+				continue;
+
+			// Leaves drop the rays that miss them before their primitives are tested against the rest
+			int lanes = entry.myLanes;
+			float nearT = frustumNearTs[i];
+			if (!frustum.myIsValid || node.myCount[i] > 0)
+			{
+				lanes = IntersectChild(node, i, aPacket, lanes, nearT);
+				if (lanes == 0)
+					continue;
+			}
+
+			PacketEntry hit = { node.myChild[i], node.myCount[i], node.myShape[i], lanes, nearT };
+			int j = hitCount++;
+			for (; j > 0 && hits[j - 1].myNearT < hit.myNearT; --j)
+				hits[j] = hits[j - 1];
+			hits[j] = hit;
+		}
+
+		for (int i = 0; i < hitCount; ++i)
+			stack[stackSize++] = hits[i];
+	}
+
+	return hitLanes;
+}
+
+template <typename FloatN>
+int WideBVH::Occluded(const CommonUtilities::RayPacket<FloatN>& aPacket, int aLanes, const SceneGeometry& aGeometry) const
+{
+	if (myNodes.empty() || aLanes == 0)
+		return 0;
+
+	const PacketFrustum frustum = CreateFrustum(aPacket, aLanes);
+	float maxT = -std::numeric_limits<float>::infinity();
+	for (int lane = 0; lane < FloatN::ourLaneCount; ++lane)
+	{
+		if (aLanes & (1 << lane))
+			maxT = std::fmax(maxT, aPacket.myMaxT[lane]);
+	}
+
+	struct PacketEntry
+	{
+		int myIndex;
+		int myLanes;
+	};
+	PacketEntry stack[ourStackSize];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, aLanes };
+
+	int occludedLanes = 0;
+	while (stackSize > 0)
+	{
+		const PacketEntry entry = stack[--stackSize];
+		const int lanes = entry.myLanes & ~occludedLanes;
+		if (lanes == 0)
+			continue;
+
+		const Node& node = myNodes[entry.myIndex];
+		int children = (1 << ourWidth) - 1;
+		if (frustum.myIsValid)
+		{
+			__m128 nearT;
+			children = CullChildren(node, frustum, maxT, nearT);
+		}
+
+		for (int i = 0; i < ourWidth; ++i)
+		{
+			if (!(children & (1 << i)) || node.myCount[i] < 0)
+				continue;
+
+			int childLanes = lanes & ~occludedLanes;
+			if (!frustum.myIsValid || node.myCount[i] > 0)
+			{
+				float nearT;
+				childLanes = IntersectChild(node, i, aPacket, childLanes, nearT);
+				if (childLanes == 0)
+					continue;
+			}
+
+			if (node.myCount[i] == 0)
+			{
+				stack[stackSize++] = { node.myChild[i], childLanes };
+				continue;
+			}
+
+			occludedLanes |= aGeometry.Occluded(node.myShape[i], node.myChild[i], node.myCount[i], aPacket, childLanes);
+			if (occludedLanes == aLanes)
+				return occludedLanes;
+		}
+	}
+
+	return occludedLanes;
+}